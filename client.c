@@ -0,0 +1,467 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#define OP_CREATE 1
+#define OP_MKDIR 2
+#define OP_FIND 3
+#define OP_LS 4
+#define OP_READ 5
+#define OP_WRITE 6
+#define OP_IMPORT 7
+#define OP_EXPORT 8
+#define MAX_IO (1 << 20)
+#define LOAD_IO 4096
+
+/**
+ * Client of the server mode of fs1 (fs1 -s <socket>), and a load generator for it.
+ * The protocol structures must match the ones in fs1.c.
+ *
+ * op: one of the OP_ constants
+ * dir_id: directory in which name is looked up or created, 1 for /
+ * type: 4 for files, 2 for directories (OP_FIND)
+ * len: bytes to read (OP_READ) or bytes of data following (OP_WRITE)
+ * offset: byte offset in the file (OP_READ, OP_WRITE)
+ * name: name of the item in directory dir_id
+ * path: host path (OP_IMPORT, OP_EXPORT)
+ */
+struct request {
+	int op;
+	int dir_id;
+	int type;
+	int len;
+	long long offset;
+	char name[256];
+	char path[PATH_MAX];
+};
+
+/**
+ * status: result of the request, -1 on errors
+ * len: bytes of data following the reply
+ */
+struct reply {
+	int status;
+	int len;
+};
+
+struct ls_entry {
+	int type;
+	int id;
+	char name[256];
+};
+
+/**
+ * Arguments and results of one load generator thread
+ * ops: requests completed
+ * usecs: total latency of those requests in microseconds
+ */
+struct load_arg {
+	char *sock;
+	int id;
+	double seconds;
+	long ops;
+	double usecs;
+};
+
+int connect_to(char *);
+int call(int fd, struct request *, char *data, struct reply *, char **out);
+int resolve(int fd, char *path, char *name);
+void host_path(char *path, char *out);
+void *load_worker(void *);
+double now();
+void usage();
+
+int main(int argc, char *argv[])
+{
+	int i;
+	int fd;
+	int n;
+	int threads;
+	long ops;
+	double usecs;
+	double start;
+	char *buf;
+	char *cmd;
+	pthread_t *tid;
+	struct load_arg *arg;
+	struct request req;
+	struct reply rep;
+	struct ls_entry *ls;
+
+	if (argc < 3) {
+		usage();
+
+		return 1;
+	}
+
+	cmd = argv[2];
+
+	if (strcmp(cmd, "load") == 0) {
+		threads = (argc > 3) ? atoi(argv[3]) : 4;
+		threads = (threads < 1) ? 1 : threads;
+
+		tid = (pthread_t *) malloc(threads * sizeof(pthread_t));
+		arg = (struct load_arg *) malloc(threads * sizeof(struct load_arg));
+		start = now();
+
+		for (i = 0; i < threads; ++i) {
+			arg[i].sock = argv[1];
+			arg[i].id = i;
+			arg[i].seconds = (argc > 4) ? atof(argv[4]) : 5;
+			arg[i].ops = 0;
+			arg[i].usecs = 0;
+			pthread_create(&tid[i], NULL, load_worker, &arg[i]);
+		}
+
+		ops = 0;
+		usecs = 0;
+
+		for (i = 0; i < threads; ++i) {
+			pthread_join(tid[i], NULL);
+			ops += arg[i].ops;
+			usecs += arg[i].usecs;
+		}
+
+		printf("%d clients: %ld requests in %.2f s, %.0f requests/s, %.1f us average latency\n", threads,
+				ops, now() - start, ops / (now() - start), (ops > 0) ? usecs / ops : 0);
+
+		return 0;
+	}
+
+	fd = connect_to(argv[1]);
+
+	if (fd == -1) {
+		return 1;
+	}
+
+	buf = (char *) malloc(MAX_IO);
+	memset(&req, 0, sizeof(req));
+
+	if ((strcmp(cmd, "create") == 0) || (strcmp(cmd, "mkdir") == 0) || (strcmp(cmd, "find") == 0)) {
+		if (argc < 4) {
+			usage();
+
+			return 1;
+		}
+
+		req.dir_id = resolve(fd, argv[3], req.name);
+		req.op = (strcmp(cmd, "create") == 0) ? OP_CREATE : ((strcmp(cmd, "mkdir") == 0) ? OP_MKDIR : OP_FIND);
+		req.type = 4;
+		call(fd, &req, NULL, &rep, NULL);
+
+		if ((req.op == OP_FIND) && (rep.status == -1)) {
+			req.type = 2;
+			call(fd, &req, NULL, &rep, NULL);
+		}
+
+		printf("%d\n", rep.status);
+	} else if (strcmp(cmd, "ls") == 0) {
+		req.op = OP_FIND;
+		req.type = 2;
+		req.dir_id = 1;
+
+		if ((argc > 3) && (strcmp(argv[3], "/") != 0)) {
+			req.dir_id = resolve(fd, argv[3], req.name);
+			call(fd, &req, NULL, &rep, NULL);
+			req.dir_id = rep.status;
+		}
+
+		req.op = OP_LS;
+		n = call(fd, &req, NULL, &rep, &buf);
+		ls = (struct ls_entry *) buf;
+
+		for (i = 0; i < n; ++i) {
+			printf("%s %20s %d\n", (ls[i].type == 4) ? "f" : "D", ls[i].name, ls[i].id);
+		}
+	} else if ((strcmp(cmd, "read") == 0) && (argc > 5)) {
+		req.op = OP_READ;
+		req.dir_id = resolve(fd, argv[3], req.name);
+		req.offset = atoll(argv[4]);
+		n = atoi(argv[5]);
+
+		while (n > 0) {
+			req.len = (n < MAX_IO) ? n : MAX_IO;
+
+			i = call(fd, &req, NULL, &rep, &buf);
+
+			if ((i < 0) || (rep.len < i)) {
+				fprintf(stderr, "Read failed at offset %lld\n", req.offset);
+
+				return 1;
+			}
+
+			if (i == 0) {
+				break;
+			}
+
+			fwrite(buf, rep.status, 1, stdout);
+			req.offset += rep.status;
+			n -= rep.status;
+		}
+	} else if ((strcmp(cmd, "write") == 0) && (argc > 4)) {
+		req.op = OP_WRITE;
+		req.dir_id = resolve(fd, argv[3], req.name);
+		req.offset = atoll(argv[4]);
+
+		while ((n = fread(buf, 1, MAX_IO, stdin)) > 0) {
+			req.len = n;
+
+			if (call(fd, &req, buf, &rep, NULL) != n) {
+				printf("Write failed at offset %lld\n", req.offset);
+
+				return 1;
+			}
+
+			req.offset += n;
+		}
+	} else if ((strcmp(cmd, "import") == 0) && (argc > 4)) {
+		req.op = OP_IMPORT;
+		host_path(argv[3], req.path);
+		req.dir_id = resolve(fd, argv[4], req.name);
+		printf("%d\n", call(fd, &req, NULL, &rep, NULL));
+	} else if ((strcmp(cmd, "export") == 0) && (argc > 4)) {
+		req.op = OP_EXPORT;
+		req.dir_id = resolve(fd, argv[3], req.name);
+		host_path(argv[4], req.path);
+		printf("%d\n", call(fd, &req, NULL, &rep, NULL));
+	} else {
+		usage();
+
+		return 1;
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+void usage()
+{
+	printf("Usage: client <socket> <command>\n");
+	printf("  mkdir <path> | create <path> | find <path> | ls [path]\n");
+	printf("  read <path> <offset> <length>    (data to stdout)\n");
+	printf("  write <path> <offset>            (data from stdin)\n");
+	printf("  import <host file> <path> | export <path> <host file>\n");
+	printf("  load <clients> <seconds>         (load generator)\n");
+
+	return;
+}
+
+int connect_to(char *sock)
+{
+	int fd;
+	struct sockaddr_un addr;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock);
+
+	if ((fd == -1) || (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)) {
+		printf("Can not connect to %s\n", sock);
+
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * Sends request req, followed by req->len bytes of data for OP_WRITE, and reads the reply
+ * into rep and its data into *out, a malloc'd buffer of MAX_IO bytes that is grown for
+ * long OP_LS replies. With out NULL, reply data is read and dropped. Returns rep->status,
+ * -1 if the connection failed.
+ */
+int call(int fd, struct request *req, char *data, struct reply *rep, char **out)
+{
+	ssize_t n;
+	size_t got;
+	char skip[4096];
+
+	if (write(fd, req, sizeof(*req)) != sizeof(*req)) {
+		return -1;
+	}
+
+	if ((req->op == OP_WRITE) && (write(fd, data, req->len) != req->len)) {
+		return -1;
+	}
+
+	for (got = 0; got < sizeof(*rep); got += n) {
+		n = read(fd, (char *) rep + got, sizeof(*rep) - got);
+
+		if (n <= 0) {
+			rep->status = -1;
+
+			return -1;
+		}
+	}
+
+	if (rep->len <= 0) {
+		return rep->status;
+	}
+
+	if ((out != NULL) && (rep->len > MAX_IO)) {
+		*out = (char *) realloc(*out, rep->len);
+	}
+
+	for (got = 0; got < (size_t) rep->len; got += n) {
+		if (out == NULL) {
+			n = read(fd, skip, ((size_t) rep->len - got < sizeof(skip)) ? (size_t) rep->len - got : sizeof(skip));
+		} else {
+			n = read(fd, *out + got, rep->len - got);
+		}
+
+		if (n <= 0) {
+			return -1;
+		}
+	}
+
+	return rep->status;
+}
+
+/**
+ * Looks up the directories of path one at a time. Returns the id of the directory holding
+ * the last component, and copies that component into name.
+ */
+int resolve(int fd, char *path, char *name)
+{
+	int dir_id;
+	char *c;
+	char *next;
+	char tmp[PATH_MAX];
+	struct request req;
+	struct reply rep;
+
+	snprintf(tmp, sizeof(tmp), "%s", path);
+	memset(&req, 0, sizeof(req));
+	req.op = OP_FIND;
+	req.type = 2;
+	dir_id = 1;
+
+	for (c = tmp; *c == '/'; ++c)
+		;
+
+	while ((next = strchr(c, '/')) != NULL) {
+		*next = '\0';
+		req.dir_id = dir_id;
+		snprintf(req.name, sizeof(req.name), "%.255s", c);
+		dir_id = call(fd, &req, NULL, &rep, NULL);
+
+		if (dir_id == -1) {
+			printf("Directory %s does not exist\n", c);
+			exit(1);
+		}
+
+		for (c = next + 1; *c == '/'; ++c)
+			;
+	}
+
+	snprintf(name, 256, "%.255s", c);
+
+	return dir_id;
+}
+
+/**
+ * The server resolves host paths in its own working directory, so relative paths are
+ * made absolute.
+ */
+void host_path(char *path, char *out)
+{
+	char cwd[PATH_MAX];
+
+	if ((path[0] == '/') || (getcwd(cwd, sizeof(cwd)) == NULL)) {
+		snprintf(out, PATH_MAX, "%s", path);
+	} else {
+		snprintf(out, PATH_MAX, "%.*s/%s", PATH_MAX / 2, cwd, path);
+	}
+
+	return;
+}
+
+/**
+ * One simulated client: makes a directory of its own, then creates files in it, writing,
+ * reading back and looking up each one, until its time is up.
+ */
+void *load_worker(void *a)
+{
+	int i;
+	int fd;
+	double t;
+	double end;
+	char *data;
+	char dir[64];
+	struct load_arg *arg;
+	struct request req;
+	struct reply rep;
+
+	arg = (struct load_arg *) a;
+	fd = connect_to(arg->sock);
+
+	if (fd == -1) {
+		return NULL;
+	}
+
+	data = (char *) malloc(MAX_IO);
+	memset(&req, 0, sizeof(req));
+	memset(data, 'x', LOAD_IO);
+	snprintf(dir, sizeof(dir), "load_%d_%d", (int) getpid(), arg->id);
+
+	req.op = OP_MKDIR;
+	req.dir_id = 1;
+	strcpy(req.name, dir);
+	req.dir_id = call(fd, &req, NULL, &rep, NULL);
+
+	if (req.dir_id == -1) {
+		close(fd);
+		free(data);
+
+		return NULL;
+	}
+
+	end = now() + arg->seconds;
+
+	for (i = 0; now() < end; ++i) {
+		snprintf(req.name, sizeof(req.name), "f%d", i);
+
+		t = now();
+		req.op = OP_CREATE;
+		call(fd, &req, NULL, &rep, NULL);
+
+		req.op = OP_WRITE;
+		req.offset = 0;
+		req.len = LOAD_IO;
+		call(fd, &req, data, &rep, NULL);
+
+		req.op = OP_READ;
+		call(fd, &req, NULL, &rep, &data);
+
+		req.op = OP_FIND;
+		req.type = 4;
+		req.len = 0;
+		call(fd, &req, NULL, &rep, NULL);
+
+		arg->usecs += (now() - t) * 1e6 / 4;
+		arg->ops += 4;
+	}
+
+	close(fd);
+	free(data);
+
+	return NULL;
+}
+
+double now()
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
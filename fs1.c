@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,23 +6,92 @@
 #include <unistd.h>
 #include <time.h>
 #include <sys/resource.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <signal.h>
+#include <sys/random.h>
+#include <sys/uio.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 #define MAGIC "FaSTdEvL"
 #define BS 4096
+#define MAX_BS 65536
+#define NODE_KEYS(bs) (((bs) - 24) / 12)
+#define NODE_LINKS_AT(bs) (12 + NODE_KEYS(bs) * 8)
+#define PTRS(bs) ((bs) / 4)
+#define MAX_FILE_SIZE(bs) ((13 + PTRS(bs) + (off_t) PTRS(bs) * PTRS(bs)) * (bs))
+#define FS_VERSION 1
+#define BLOCK_OFF(sb, b) ((off_t) (b) * (sb)->blocksize)
+#define INODE_REF(sb, i) ((sb)->blocks + (i))
+#define INODE_OFF(sb, i) (BLOCK_OFF(sb, 2 + (sb)->freeblocksmap) + (off_t) (i) * sizeof(struct inode))
+#define CLUSTER 16
+#define ZMARK(len) (-2 - (len))
 #define DEBUG 0
 
+#define SNAP_MAX 32
+#define SNAP_NAME 24
+
+/**
+ * A snapshot: a read-only image of the namespace, kept as the root of the B+ tree at the
+ * time it was taken.
+ * name: name given to snapshot
+ * ctime: creation time, formatted like the times of struct item_stat
+ * root: root node of the snapshot's tree, -1 if the filesystem was empty
+ */
+struct snapshot {
+	char name[SNAP_NAME];
+	char ctime[28];
+	int root;
+};
+
 /**
  * Stored in block 0 and its backup in block 1
  * 
  * magic: Magic string
  * label: FS label
- * blocksize: blocksize of the FS
+ * blocksize: blocksize of the FS, one of 4096, 16384 or 65536
  * blocks: Total number of blocks
  * n_inodes: Total number of inodes in the FS
  * inodes: Number of inodes per block
  * root: Root of the B+ Tree, initially -1
  * freeblocksmap: number of blocks for freeblocks map
  * idcounter: maintains a count of id# last assigned. Useful for item id generation
+ * version: on-disk format revision, FS_VERSION
+ * agcount: number of allocation groups, 0 on images made before groups existed (one group)
+ * agblocks: blocks per allocation group, a multiple of 8; the last group may be shorter
+ * aginodes: inodes per allocation group, a multiple of inodes
+ * journal: first block of the metadata journal, right after the inode blocks
+ * journal_blocks: size of the journal in blocks, 0 on images made before it existed
+ * refmap, refmap_blocks: reference count map, right after the journal; 0 blocks on images
+ * 	made before snapshots existed, which can not take any
+ * shared: set by the first snapshot; until then nothing is shared and the map is not read
+ * snaps: number of snapshots in snap[]
+ * snap: saved roots of the B+ tree, see snapshot()
+ * dedup, dedup_blocks: index of data blocks by content, after the reference count map,
+ * 	see dedup_block(); 0 blocks on images made before it existed
+ * csum, csum_blocks: CRC32C of every data block, after the dedup index, see init_csum();
+ * 	0 blocks on images made before checksums existed
+ * cipher: 1 if every block after the two superblocks is encrypted, see crypt_range()
+ * kdf_iter, kdf_salt: PBKDF2-HMAC-SHA256 parameters deriving the keys from the passphrase
+ * key_check: derived along with the keys, to recognise the right passphrase at mount
+ * stripes, stripe_unit: number of image files the image is striped over, and blocks per
+ * 	stripe unit; 0 on images made before striping existed, which use one file
+ * shards, shard: number of B+ trees the namespace is split into, see dir_shard(), and the
+ * 	first of the blocks holding the roots and id counters of trees 1 and on (tree 0 uses
+ * 	root and idcounter); 0 on images made before sharding existed, which have one tree
  * padding: Padding bytes
+ *
+ * Since FS_VERSION 1, every location stored on disk (root, node links, inode pointers,
+ * indirect blocks, lastblock) is a 32-bit block number, and leaf links and stat.inode are
+ * inode numbers. They are scaled to 64-bit byte offsets with BLOCK_OFF() and INODE_OFF()
+ * only when accessed, so images are limited by 2^31 blocks instead of 2^31 bytes.
  */
 struct superblock {
 	char magic[8];
@@ -33,17 +103,46 @@ struct superblock {
 	int root;
 	int freeblocksmap;
 	int idcounter;
-	char padding[4052];
+	int version;
+	int agcount;
+	int agblocks;
+	int aginodes;
+	int journal;
+	int journal_blocks;
+	int refmap;
+	int refmap_blocks;
+	int shared;
+	int snaps;
+	struct snapshot snap[SNAP_MAX];
+	int dedup;
+	int dedup_blocks;
+	int csum;
+	int csum_blocks;
+	int cipher;
+	int kdf_iter;
+	unsigned char kdf_salt[16];
+	unsigned char key_check[16];
+	int stripes;
+	int stripe_unit;
+	int shards;
+	int shard;
+	char padding[2148];
 };
 
 /**
  *  64 bytes inode 
  *  Each inode can point to an item.
  *  An item can be either a stat item, a directory or a simple file.
- *  f[0]: points to the stat file, is -1 if unoccupied
- *  f[1-13]: point to direct blocks of the file
+ *  f[0]: block number of the stat file, is -1 if unoccupied, -2 while reserved by get_inode()
+ *  f[1-13]: block numbers of direct blocks of the file
  *  f[14]: points to a block, which contains pointers to other blocks (single indirect)
  *  f[15]: points to indirect blocks (double indirect)
+ * Within the first stat.blocks blocks of a file, a -1 pointer (in the inode or in an
+ * indirect block) is a hole that reads as zeroes. A missing indirect block is PTRS(blocksize) holes.
+ * Files imported with compression are stored in clusters of CLUSTER logical blocks (the
+ * last one may be shorter). A cluster of n blocks whose compressed data fits in k < n
+ * blocks points to those k blocks, and its other n - k pointers all hold ZMARK(compressed
+ * length), which is below -1; see import_cluster() and read_cluster().
  */
 struct inode {
 	int f[16];
@@ -66,7 +165,7 @@ struct Key {
  * inode: inode number of the file/directory
  * dir_id: id of directory it belongs to
  * type: 4 for file, 2 for directory
- * lastblock: location of last block of the file
+ * lastblock: block number of last block of the file
  * lastblockbytes: number of bytes in last block of the file. Used when reading the file.
  * uid: Linux user id value; range [0-65534], where 65534 is reserved for nobody
  * gid: Linux group id value
@@ -78,7 +177,7 @@ struct Key {
  * blocks: number of blocks in file
  * padding: padding bytes for matching structure size with blocksize
  */
-struct stat {
+struct item_stat {
 	struct Key k;
 	int inode;
 	int type;
@@ -98,231 +197,1461 @@ struct stat {
 /**
  * n = degree of B+ tree. Then each leaf has a maximum of n children links.
  * And a maximum of n-1 keys in each node
- *  parent: location of parent of the node. -1, for root node
+ *  parent: block number of parent of the node. -1, for root node
  * 	isLeaf: 1 if node is leaf, else 0
  * 	size: number of keys currently in the node
- *  key[339]: stores keys in the node
- *  link[340]: stores links to children of the node, but in case of leaf node, stores inode location
- * 	left: logical left node of leaf node
- * 	right: logical right node of leaf node
+ *  key[n - 1]: stores keys in the node
+ *  link[n]: stores block numbers of children of the node, but in case of leaf node, stores inode number
+ * 	left: logical left node of leaf node, as of the split that made it
+ * 	right: logical right node of leaf node, as of the last split of the node
  *  padding: padding bytes to match size of structure with blocksize
  * if non-leaf node, left and right should be set to -1
- * (5 * 4 + 4 * n + 8 * (n - 1)) = 4096, because we want the size to match the block size.
- * => n = 340.67 = 340
+ * Leaves may be shared with snapshots, and a shared leaf keeps pointing at the old copy
+ * of a sibling the live tree has shadowed, so left and right are only readahead hints.
+ * Leaf scans go on with next_leaf().
+ * (5 * 4 + 4 * n + 8 * (n - 1)) = blocksize, because we want the size to match the block size.
+ * => n = (blocksize - 12) / 12, i.e. NODE_KEYS(blocksize) + 1
+ *    4096: 340, 16384: 1364, 65536: 5460
+ *
+ * In a node block the links start right after the NODE_KEYS(blocksize) keys, so only the 65536
+ * layout matches struct node, which is sized for MAX_BS. Nodes of smaller filesystems are
+ * converted in read_node() and write_node().
  */
 struct node {
 	int parent;
 	int isLeaf;
 	int size;
-	struct Key key[339];
-	int link[340];
+	struct Key key[NODE_KEYS(MAX_BS)];
+	int link[NODE_KEYS(MAX_BS) + 1];
 	int left;
 	int right;
 	char padding[4];
 };
 
-struct freeblock {
-	char f[4096];
+/**
+ * One run of a file's block map.
+ * Logical blocks [lblock, lblock + len) of the file are stored contiguously,
+ * the first of them at block number loc. loc is -1 for a run of holes, and the ZMARK()
+ * of a compressed cluster for its blocks past the compressed data.
+ */
+struct extent {
+	int lblock;
+	int loc;
+	int len;
+};
+
+/**
+ * Entry of the open file table. Caches the block map of a file as an array of
+ * extents, built from f[1-15] and the indirect blocks when the file is opened.
+ * The table is shared by all threads and guarded by oft_lock; an entry's map is
+ * only read while it is in use, and rebuilt when nobody uses it.
+ *
+ * inode_loc: inode number of the open file
+ * inode_off: byte location of that inode
+ * bs: block size of the filesystem the file is on
+ * valid: 0 if the block map has to be rebuilt before use
+ * users: number of open_file() calls not yet matched by close_file(); entries in use are never replaced
+ * blocks: number of blocks in the file
+ * size: file size in bytes
+ * n_ext: number of extents in ext
+ * cap: number of extents allocated for ext
+ * ext: the block map, sorted by lblock
+ * tick: last use, for replacing the least recently used entry
+ * zc, zbuf, zlock: compressed cluster last decompressed by read_file() (-1 if none), its
+ * 	contents, and the lock its users take
+ */
+struct open_file {
+	int inode_loc;
+	off_t inode_off;
+	int bs;
+	int valid;
+	int users;
+	int blocks;
+	off_t size;
+	int n_ext;
+	int cap;
+	struct extent *ext;
+	unsigned long tick;
+	int zc;
+	char *zbuf;
+	pthread_mutex_t zlock;
+};
+
+/**
+ * State of the readahead engine for one stream of accesses, either the blocks
+ * of a file in logical order or the leaves of a scan.
+ * Positions are logical block indices for files and block numbers for leaves.
+ *
+ * next: position expected next if the access is sequential
+ * window: number of blocks prefetched ahead of the current one
+ * ahead: position up to which prefetches have already been issued
+ */
+struct readahead {
+	int next;
+	int window;
+	int ahead;
+};
+
+/**
+ * Entry of the dedup index: a data block and the hash of its contents. blk is 0 (the
+ * superblock) in unused entries.
+ */
+struct dedup_entry {
+	unsigned long long hash;
+	int blk;
+	char padding[4];
+};
+
+/**
+ * State of one import().
+ * dedup: blocks go through the dedup index (import -d)
+ * compress: clusters are compressed (import -c)
+ * blocks, shared: blocks looked up in the dedup index, and how many of them were found
+ * 	there and shared instead of written
+ * packed, stored: blocks of the compressed clusters, and blocks their compressed data takes
+ * total: blocks of the local file
+ * ptr: block map of the cluster being imported, filled at its first block
+ * zin, zout: the cluster and its compressed data
+ * run, run_start, run_len: blocks stored next to each other and not written yet, so they
+ * 	are written IMPORT_CHUNK bytes at a time (see import_flush())
+ * full: a block could not be allocated, so the import is given up
+ */
+struct import_state {
+	bool dedup;
+	bool compress;
+	bool full;
+	long long blocks;
+	long long shared;
+	long long packed;
+	long long stored;
+	int total;
+	int ptr[CLUSTER];
+	char *zin;
+	char *zout;
+	char *run;
+	int run_start;
+	int run_len;
+};
+
+/**
+ * State of one remove_item().
+ * items: inodes of the items remove_range() took out of the tree, not let go of yet
+ * dirs: directories whose items are still in the tree (rm -r)
+ * blocks, inodes: blocks and inodes to release with the next batch (see release_items())
+ * files, subdirs: items removed, reported at the end
+ */
+struct rm_state {
+	int *items;
+	int n_items;
+	int cap_items;
+	int *dirs;
+	int n_dirs;
+	int cap_dirs;
+	int *blocks;
+	int n_blocks;
+	int cap_blocks;
+	int *inodes;
+	int n_inodes;
+	int cap_inodes;
+	long long files;
+	long long subdirs;
+};
+
+/**
+ * Tracks the data and hole ranges of a local file while importing it.
+ * fd: descriptor of the local file
+ * data: start of the next data range at or after the current offset
+ * hole: start of the hole following that data range
+ * size: size of the local file
+ */
+struct hole_scan {
+	int fd;
+	off_t data;
+	off_t hole;
+	off_t size;
+};
+
+#define RA_MIN 4
+#define RA_MAX 256
+
+#define MAX_OPEN 16
+
+#define AG_COUNT 8
+#define AG_MIN_BLOCKS 1024
+
+#define FILE_LOCKS 64
+#define REF_LOCKS 64
+#define DEDUP_LOCKS 64
+#define DEDUP_PROBE 16
+
+#define OP_CREATE 1
+#define OP_MKDIR 2
+#define OP_FIND 3
+#define OP_LS 4
+#define OP_READ 5
+#define OP_WRITE 6
+#define OP_IMPORT 7
+#define OP_EXPORT 8
+#define MAX_IO (1 << 20)
+#define SERVER_WORKERS 16
+#define SERVER_BACKLOG 128
+
+#define IMPORT_CHUNK (1 << 20)
+#define IMPORT_DEDUP 1
+#define IMPORT_COMPRESS 2
+#define LZ_HASH_BITS 12
+#define IMPORT_QUEUE 64
+#define IMPORT_WRITERS 8
+#define CRC32C_POLY 0x82F63B78
+#define SCRUB_CHUNK (4 << 20)
+#define DIGEST_RUN (1 << 20)
+#define KDF_ITER 100000
+#define CIPHER_SW 0
+#define CIPHER_AESNI 1
+#define CIPHER_VAES 2
+#define STRIPE_MAX 16
+#define STRIPE_UNIT (64 << 10)
+#define STRIPE_READ 0
+#define STRIPE_WRITE 1
+#define STRIPE_SYNC 2
+#define EXPORT_RUN (1 << 20)
+#define SHARD_MAX 16
+#define SHARD_IDS (1 << 27)
+#define RM_BATCH 4096
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define JOURNAL_MAGIC "FsJoUrNl"
+#define JOURNAL_DESC 0x4A444553
+#define JOURNAL_COMMIT 0x4A434D54
+#define JOURNAL_BUCKETS 256
+#define JOURNAL_BATCH 256
+#define FLUSH_AGE_MS 1000
+#define FLUSH_INTERVAL_MS 100
+#define CACHE_BLOCKS 4096
+#define JOURNAL_MIN 32
+#define JOURNAL_MAX_BYTES (64 << 20)
+
+struct open_file oft[MAX_OPEN];
+unsigned long oft_tick;
+
+/**
+ * Reader/writer latch of one B+ tree node, looked up by block number in a hash table.
+ * Entries exist only while some thread holds or waits for the latch.
+ *
+ * blk: block number of the node
+ * users: number of threads holding or waiting for rw
+ * rw: the latch itself
+ * next: next entry in the same bucket
+ */
+struct latch {
+	int blk;
+	int users;
+	pthread_rwlock_t rw;
+	struct latch *next;
+};
+
+#define LATCH_BUCKETS 256
+#define DIR_LOCKS 64
+#define MAX_DEPTH 32
+
+/**
+ * Locking order: move_lock, dir_lock, a shard latch, node latches from the root down, then any of
+ * sb_lock, the allocation group locks, ref_lock and oft_lock, which are never held while
+ * taking another lock. Leaf scans hold one leaf at a time.
+ *
+ * shard latch: guards the root of its tree, write locked while the root may split or be
+ * 	shadowed; held before the node latches of that tree
+ * sb_lock: guards the other superblock fields and its on-disk copies
+ * oft_lock: guards the open file table
+ * move_lock: serialises moves and removals, so that checking a directory is not moved
+ * 	into itself and moving it is atomic, and nothing is moved into a tree being removed
+ * dir_lock: serialises creation of items with the same dir_id % DIR_LOCKS, so that
+ * 	checking a name and inserting it is atomic; a move takes those of both
+ * 	directories, the lower index first, and a removal those of the directories it
+ * 	takes apart, one at a time
+ * file_lock: serialises writes to files with the same inode_loc % FILE_LOCKS; taken
+ * 	first, like dir_lock, except by copy_file(), move_item() and remove_item(), which
+ * 	take it right after dir_lock
+ * journal.ops_lock: read locked by begin_op() right after dir_lock or file_lock and
+ * 	before any other lock, write locked by a commit and by snapshot()
+ * journal.dirty, journal.ops, journal.first and journal.gen: no lock, only read and
+ * 	written with the __atomic builtins, as the flusher polls them
+ * ref_lock: serialises updates of reference counts with the same index % REF_LOCKS
+ * dedup_lock: guards the dedup index blocks with the same number % DEDUP_LOCKS; taken
+ * 	before the allocation group locks and ref_lock
+ */
+struct latch *latches[LATCH_BUCKETS];
+pthread_mutex_t latch_lock[LATCH_BUCKETS];
+pthread_mutex_t sb_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t oft_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t move_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t oft_free = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t dir_lock[DIR_LOCKS];
+pthread_mutex_t file_lock[FILE_LOCKS];
+pthread_mutex_t ref_lock[REF_LOCKS];
+pthread_mutex_t dedup_lock[DEDUP_LOCKS];
+
+/**
+ * In-memory state of one allocation group. The image is divided into groups at makefs
+ * time, each owning a range of blocks (and so a slice of the freeblocks map) and a range
+ * of inodes, so threads allocating in different groups never wait for each other.
+ * Free counts are taken from the maps the first time the group is used after mount.
+ *
+ * start, end: blocks [start, end) belong to the group
+ * first_inode, n_inodes: inodes [first_inode, first_inode + n_inodes) belong to the group
+ * free_blocks, free_inodes: free blocks and inodes in the group, -1 until counted
+ * next_block: where the next free block search starts
+ * next_inode: where the next free inode search starts, first inode of an inode block
+ * lock: guards all of the above and the group's part of the maps
+ */
+struct alloc_group {
+	int start;
+	int end;
+	int first_inode;
+	int n_inodes;
+	int free_blocks;
+	int free_inodes;
+	int next_block;
+	int next_inode;
+	pthread_mutex_t lock;
+};
+
+struct alloc_group *groups;
+int n_groups;
+
+/**
+ * In-memory state of one shard of the namespace. The items of a directory are kept in the
+ * B+ tree of the shard that gave out the id of the directory (see dir_shard()), so a
+ * subtree stays in one tree, and operations in different shards share no latch, counter or
+ * superblock. Shard 0 keeps its root and id counter in the superblock, the others in a
+ * block of their own (struct shard_head).
+ * root: root of the tree, -1 while it is empty; sb->root for shard 0
+ * idcounter: next id to give out, from [SHARD_IDS * i, SHARD_IDS * (i + 1)); sb->idcounter
+ * 	for shard 0
+ * head: block of the struct shard_head, -1 for shard 0
+ * latch: root latch of the tree
+ * lock: guards idcounter and the head block
+ */
+struct shard {
+	int root;
+	unsigned idcounter;
+	int head;
+	pthread_rwlock_t latch;
+	pthread_mutex_t lock;
+};
+
+struct shard_head {
+	int root;
+	unsigned idcounter;
+};
+
+struct shard shards[SHARD_MAX];
+int n_shards = 1;
+
+/* top level directories are given shards round robin */
+int next_shard;
+
+/**
+ * Threads are given home groups round robin on their first allocation, and put new
+ * tree nodes and file blocks there. Items are created in the group of their directory.
+ */
+int next_home;
+__thread int home = -1;
+
+/**
+ * Set in script mode: no prompts, banners or progress messages
+ */
+bool batch;
+
+/**
+ * Block of metadata changed since the last journal commit.
+ * blk: block number
+ * version: bumped on every write, so a commit only drops blocks not written since it
+ * 	copied them
+ * data: contents of the block, newer than the image
+ * next: next block in the same bucket
+ */
+struct jblock {
+	int blk;
+	unsigned int version;
+	char *data;
+	struct jblock *next;
+};
+
+/**
+ * Metadata journal and write-back cache of the mounted image. While it is open, dwrite()
+ * only changes the in-memory copies of blocks in bucket[], so repeated updates of a node,
+ * bitmap block or the superblock are merged, and dread() reads through them. The flusher
+ * thread commits them in the background; see flusher(). A commit writes
+ * all changed blocks to the journal region, followed by a commit block with their
+ * checksum, makes them durable with a single fdatasync(), and only then writes them to
+ * their places. Operations (begin_op() to end_op()) never span commits, so a crash leaves
+ * every operation either replayed in full at the next mount or not done at all. File data
+ * is written in place by data_write() before the metadata pointing to it is committed.
+ *
+ * Journal region: block start holds struct journal_header, commits follow from block
+ * start + 1. A commit is one or more descriptor blocks, each listing the block numbers of
+ * the blocks that follow it, then the commit block, with a jsum() of the block numbers and
+ * contents of every descriptor in turn. Commits are appended at head until the
+ * region is full, when the image is synced and the journal starts over (a checkpoint).
+ *
+ * Images made before the journal existed have no region (blocks is 0): they get the same
+ * write-back cache, and a commit writes the blocks in place.
+ *
+ * on: set while open; metadata is written straight to the image otherwise
+ * start, blocks: journal region
+ * limit: dirty blocks allowed, the size of the journal or CACHE_BLOCKS without one
+ * head: next free block of the region, relative to start
+ * seq: sequence number of the next commit; only commits from the header's seq on count
+ * dirty: blocks in bucket[]
+ * ops: operations finished since the last commit
+ * first: time in ms when the oldest block in bucket[] was written
+ * gen: bumped whenever a block leaves bucket[], so readers can tell their read raced
+ * 	with a commit
+ * flusher, wake, flush_lock, stop: background flusher thread
+ * freed, n_freed, cap_freed, fsb, free_lock: data blocks released since the last commit
+ * 	and the superblock they belong to, freed once the commit is durable; see release_block()
+ * csum, csum_blocks: checksum map of the image, kept up to date by data_write(); 0 blocks
+ * 	if it has none
+ */
+struct journal {
+	bool on;
+	FILE *p;
+	int bs;
+	int start;
+	int blocks;
+	int limit;
+	int head;
+	unsigned int seq;
+	int dirty;
+	int ops;
+	long long first;
+	unsigned long gen;
+	pthread_rwlock_t ops_lock;
+	pthread_mutex_t commit_lock;
+	pthread_mutex_t lock[JOURNAL_BUCKETS];
+	struct jblock *bucket[JOURNAL_BUCKETS];
+	pthread_t flusher;
+	pthread_cond_t wake;
+	pthread_mutex_t flush_lock;
+	bool stop;
+	int *freed;
+	int n_freed;
+	int cap_freed;
+	struct superblock *fsb;
+	pthread_mutex_t free_lock;
+	int csum;
+	int csum_blocks;
+};
+
+struct journal_header {
+	char magic[8];
+	unsigned int seq;
+};
+
+struct journal journal;
+__thread int op_depth;
+
+/* CRC32C lookup table, and whether the CPU has the SSE4.2 crc32 instruction */
+unsigned int crc32c_table[256];
+bool crc32c_hw;
+
+/* SHA-256 round constants, and whether the CPU has the SHA extensions */
+const unsigned int sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+bool sha256_hw;
+
+/* AES S-boxes and round tables of the portable implementation, see init_aes() */
+unsigned char aes_sbox[256];
+unsigned char aes_inv_sbox[256];
+unsigned int aes_te[256];
+unsigned int aes_td[256];
+
+/* x^128 times each polynomial of degree below 8, reduced, for xts_skip() */
+unsigned short xts_red[256];
+
+/**
+ * Encryption of the mounted image, see crypt_range().
+ * on: the image is encrypted
+ * bs: block size of the image, the XTS data unit
+ * impl: AES implementation in use, CIPHER_SW, CIPHER_AESNI or CIPHER_VAES
+ * ek, dk: AES-128 encryption and decryption round keys of the data key
+ * tk: AES-128 encryption round keys of the tweak key
+ */
+struct cipher {
+	bool on;
+	int bs;
+	int impl;
+	unsigned char ek[176];
+	unsigned char dk[176];
+	unsigned char tk[176];
+} cipher;
+
+/**
+ * A transfer of one backing file of a striped image, run by its I/O thread.
+ * op: STRIPE_READ, STRIPE_WRITE or STRIPE_SYNC
+ * iov, cnt, off: the pieces of the transfer, which follow one another in the file from off
+ * ok: false if the file could not be read or written
+ * pending: jobs of the same transfer still running, decremented as they end
+ */
+struct stripe_job {
+	int op;
+	int fd;
+	struct iovec *iov;
+	int cnt;
+	off_t off;
+	bool ok;
+	int *pending;
+	struct stripe_job *next;
+};
+
+/**
+ * Backing files of the mounted image. Byte off of the image is in stripe unit
+ * u = off / unit, kept by file u % n at offset (u / n) * unit + off % unit, so a transfer
+ * spanning several units goes to several files. File 0 is the image itself, file i the
+ * image name followed by .i; each has an I/O thread of its own, so the parts of large
+ * transfers are read and written at the same time. The calling thread moves the part of
+ * the first file a transfer touches itself, and image_sync() syncs file 0 itself.
+ * n: number of files, 1 for images that are not striped
+ * unit: bytes per stripe unit
+ * fd: the files, used by their I/O threads and by the calling thread as above
+ * queue: jobs waiting for the thread of each file
+ */
+struct stripe {
+	int n;
+	off_t unit;
+	int fd[STRIPE_MAX];
+	pthread_t io[STRIPE_MAX];
+	struct stripe_job *queue[STRIPE_MAX];
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	bool stop;
+} stripe;
+
+/**
+ * One host file of a batch import.
+ * path: host path of the file
+ * name: name of the new file in the filesystem
+ * inode_loc: inode number of the new file, -1 if it could not be created
+ * k: key of the new file, inserted into the B+ tree after all data is written
+ */
+struct batch_file {
+	char path[PATH_MAX];
+	char name[256];
+	int inode_loc;
+	struct Key k;
+};
+
+/**
+ * A run of contiguous blocks on its way from a reader to a writer of a batch import.
+ * loc: first block of the run
+ * len: number of blocks
+ * data: len blocks of data
+ */
+struct write_req {
+	int loc;
+	int len;
+	char *data;
+	struct write_req *next;
+};
+
+/**
+ * Bounded queue of write requests. Readers wait while max requests are queued, so host
+ * reads never run more than the queue ahead of the image writes.
+ * done: set once all readers have finished; writers then drain the queue and exit
+ */
+struct write_queue {
+	struct write_req *head;
+	struct write_req *tail;
+	int n;
+	int max;
+	int done;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+};
+
+/**
+ * State shared by the threads of one batch import.
+ * next: index of the next file to be taken by a reader
+ * bytes: bytes of host files read so far
+ */
+struct batch {
+	FILE *p;
+	struct superblock *sb;
+	struct batch_file *files;
+	int n_files;
+	int next;
+	long long bytes;
+	struct write_queue q;
+};
+
+/**
+ * One item of a directory, as collected by scan_dir(). name comes first, so that
+ * entries sorted by cmp_name() can be searched for a name.
+ * first: first data block of a file, or its stat block if that is a hole
+ */
+struct dir_entry {
+	char name[256];
+	int type;
+	int id;
+	int inode_loc;
+	int first;
+};
+
+/**
+ * A file of a recursive export and the host path it goes to.
+ */
+struct export_job {
+	int inode_loc;
+	int first;
+	char path[PATH_MAX];
+};
+
+/**
+ * State shared by the workers of one recursive export.
+ * next: index of the next job to be taken by a worker
+ * bytes: bytes exported so far
+ */
+struct export_batch {
+	FILE *p;
+	struct superblock *sb;
+	struct export_job *jobs;
+	int n_jobs;
+	int next;
+	long long bytes;
+};
+
+/**
+ * Running SHA-256 of a stream, see sha256_update().
+ * h: hash state
+ * buf, n: the first n bytes of the next 64 byte block
+ * len: bytes hashed so far
+ */
+struct sha256 {
+	unsigned int h[8];
+	unsigned char buf[64];
+	int n;
+	unsigned long long len;
+};
+
+/**
+ * State shared by the workers of one scrub. The image is handed out SCRUB_CHUNK bytes
+ * (per blocks) at a time, in order, so the workers read it front to back together.
+ * next: index of the next chunk to be taken by a worker
+ * chunks: chunks in the image
+ * checked, bad: blocks verified, and how many of them did not match their checksum
+ * bytes: bytes read
+ */
+struct scrub_batch {
+	FILE *p;
+	struct superblock *sb;
+	int per;
+	int chunks;
+	int next;
+	long long checked;
+	long long bad;
+	long long bytes;
+};
+
+/**
+ * Request of the server protocol, sent by clients over the Unix socket in server mode,
+ * followed by len bytes of data for OP_WRITE. client.c has a copy of it.
+ *
+ * op: one of the OP_ constants
+ * dir_id: directory in which name is looked up or created, 1 for /
+ * type: 4 for files, 2 for directories (OP_FIND)
+ * len: bytes to read (OP_READ) or bytes of data following (OP_WRITE)
+ * offset: byte offset in the file (OP_READ, OP_WRITE)
+ * name: name of the item in directory dir_id
+ * path: host path (OP_IMPORT, OP_EXPORT)
+ */
+struct request {
+	int op;
+	int dir_id;
+	int type;
+	int len;
+	long long offset;
+	char name[256];
+	char path[PATH_MAX];
+};
+
+/**
+ * Reply to a request, followed by len bytes of data.
+ * status: id of the item (OP_CREATE, OP_MKDIR, OP_FIND), number of entries (OP_LS),
+ * 	bytes read or written (OP_READ, OP_WRITE, OP_IMPORT, OP_EXPORT), or -1 on errors
+ */
+struct reply {
+	int status;
+	int len;
+};
+
+/**
+ * Entry of an OP_LS reply
+ */
+struct ls_entry {
+	int type;
+	int id;
+	char name[256];
+};
+
+/**
+ * State shared by the server's workers: one mounted image and its superblock, and the
+ * epoll instance watching the open connections
+ */
+struct server {
+	FILE *p;
+	struct superblock *sb;
+	int epfd;
+};
+
+/**
+ * State of the command shell, for the prompt and for script mode
+ * name: image file
+ * pwd, pwd_id: name and id of the current directory
+ * snap: name of the snapshot mounted read only by snapmount, empty for the live tree
+ * view: copy of sb with the root of that snapshot, used for every command meanwhile
+ */
+struct session {
+	FILE *p;
+	struct superblock sb;
+	char name[256];
+	char pwd[256];
+	int pwd_id;
+	char snap[SNAP_NAME];
+	struct superblock view;
+	bool mounted;
+};
+
+/**
+ * Arguments of one bench_mt() worker thread
+ */
+struct bench_arg {
+	FILE *p;
+	struct superblock *sb;
+	int dir_id;
+	int items;
 };
 
 bool mount(FILE **, char[]);
-void makefs(FILE *);
+void makefs(FILE *, char name[], int bs, bool encrypt, int stripes, int unit, int shards);
 void setlabel(FILE *, char[]);
 void showinfo();
-void remount(FILE **, char[]);
+int run_command(struct session *, char *line);
+void run_script(struct session *, char *script);
+bool remount(FILE **, char[]);
 int comp_str(char[], char[], int len);
-int init_freemap(FILE *, int blocks);
+int init_freemap(FILE *, struct superblock *sb);
 int get_node(FILE *, struct superblock *sb);
-void use_block(FILE *, int i);
-void free_block(FILE *, int i);
+void read_node(FILE *, struct superblock *sb, int loc, struct node *);
+void write_node(FILE *, struct superblock *sb, int loc, struct node *);
+void use_block(FILE *, struct superblock *sb, int i);
+void free_block(FILE *, struct superblock *sb, int i);
 void insert(FILE *, int id, int dir_id, int block, struct superblock *);
-int promote(struct Key k, int parent, int l, int r, FILE *p, struct superblock *sb);
-int find_parent(struct Key, FILE *, struct superblock *);
+int promote(struct Key k, int r, int *path, int depth, FILE *p, struct superblock *sb);
+bool insert_optimistic(FILE *, struct superblock *, struct Key k, int block);
+void insert_pessimistic(FILE *, struct superblock *, struct Key k, int block);
+int split_leaf(FILE *, struct superblock *, int curr, struct node *, struct Key k, int block, struct Key *sep);
+void leaf_put(struct node *, struct Key k, int block);
+int child_index(struct node *, struct Key *);
+struct latch *find_leaf(FILE *, struct superblock *, unsigned dir_id, int *loc, struct node *);
 void debug_show_filled_blocks(FILE *);
-bool check_block(FILE *, int);
-int get_free_block(FILE *, struct superblock *);
+bool check_block(FILE *, struct superblock *sb, int);
+int get_free_block(FILE *, struct superblock *, struct alloc_group *);
+int alloc_block(FILE *, struct superblock *, int group);
+int scan_map(FILE *, struct superblock *, int from, int to);
+void init_groups(struct superblock *);
+void count_group(FILE *, struct superblock *, struct alloc_group *);
+int home_group();
+int dir_group(int dir_id);
+int inode_group(int inode_loc);
+int block_group(int b);
 void update_sb(FILE *, struct superblock *);
 int comparator(const void *, const void *);
 void err_noblocks();
 void init_inodes(FILE *, struct superblock *sb);
-int get_inode(FILE *, struct superblock *sb);
+int get_inode(FILE *, struct superblock *sb, int group);
 int new_empty_file_dir(FILE *, struct superblock *, char *, int, int);
-int get_id(char *, FILE *, struct superblock *);
-void init_stat(struct stat *, struct Key, int inode_loc, int type, char *name);
+int get_id(char *, FILE *, struct superblock *, int dir_id, int type);
+void init_shards(FILE *, struct superblock *, int n);
+void load_shards(FILE *, struct superblock *);
+struct shard *dir_shard(unsigned dir_id);
+int *shard_root(struct superblock *, struct shard *);
+void set_root(FILE *, struct superblock *, struct shard *, int root);
+void write_shard(FILE *, struct superblock *, struct shard *);
+void init_stat(struct item_stat *, struct Key, int inode_loc, int type, char *name);
 void get_time(char *);
 void ls(FILE *, struct superblock *, int);
 void debug_showroot(FILE *, struct superblock *);
 void batch_create_files(FILE *, struct superblock *, int n, int dir_id);
-void inorder(FILE *, int);
+void inorder(FILE *, struct superblock *, int);
 int find(FILE *, struct superblock *, int, char *, int, int);
-void import(FILE *, struct superblock *sb, char *path, int dir_id, char *name);
+int find_dir(FILE *, struct superblock *, int dir_id, char *path);
+int import(FILE *, struct superblock *sb, char *path, int dir_id, char *name, int flags);
+void release_ptrs(FILE *, struct superblock *, int *ptr, int n);
 void extract(FILE *, struct superblock *, int dir_id, char *, char *);
-
-int main()
+off_t block_slot(FILE *, struct superblock *, int inode_loc, struct inode *, int index);
+void append(FILE *, struct superblock *sb, char *path, int dir_id, char *name);
+int copy_file(FILE *, struct superblock *, int dir_id, char *from, char *to);
+int move_item(FILE *, struct superblock *, int from, char *name, int to, char *to_name);
+bool valid_name(const char *);
+void remove_item(FILE *, struct superblock *, int dir_id, char *name, bool recursive, int pwd_id);
+void drop_item(FILE *, struct superblock *, int inode_loc, struct inode *, struct rm_state *);
+void drop_ptr_block(FILE *, struct superblock *, int b, int level, struct rm_state *);
+void release_items(FILE *, struct superblock *, struct rm_state *);
+void free_inode(FILE *, struct superblock *, int i);
+void list_add(int **a, int *n, int *cap, int v);
+struct open_file *open_file(FILE *, struct superblock *, int inode_loc);
+void invalidate_map(int inode_loc);
+void read_ptr_block(FILE *, int bs, int loc, int *ptr);
+int build_map(FILE *, struct open_file *);
+int map_block(struct open_file *, int lblock);
+int read_file(FILE *, struct superblock *, int inode_loc, off_t offset, char *buf, int len);
+bool zero_block(const char *, int len);
+int import_block(FILE *, struct superblock *, FILE *, struct hole_scan *, int lblock, char *block, struct import_state *);
+bool import_read(FILE *, struct hole_scan *, int bs, int lblock, char *block);
+int import_store(FILE *, struct superblock *, char *block, struct import_state *);
+void import_flush(FILE *, struct superblock *, struct import_state *);
+void import_cluster(FILE *, struct superblock *, FILE *, struct hole_scan *, int lblock, struct import_state *);
+int lz_compress(const unsigned char *src, int n, unsigned char *dst, int cap);
+int lz_sequence(unsigned char *dst, int op, int cap, const unsigned char *lit, int nlit, int off, int len);
+int lz_decompress(const unsigned char *src, int n, unsigned char *dst, int cap);
+bool cluster_packed(struct open_file *, int lblock);
+int read_cluster(FILE *, struct open_file *, int c, char *buf);
+bool unpack_clusters(FILE *, struct superblock *, int inode_loc, struct inode *, struct item_stat *, int from, int to);
+void release_block(FILE *, struct superblock *, int b);
+unsigned long long block_hash(const char *, int len);
+int dedup_block(FILE *, struct superblock *, const char *block);
+void init_dedup(FILE *, struct superblock *);
+void init_csum(FILE *, struct superblock *);
+void init_hashes();
+unsigned int crc32c(const char *, size_t len);
+unsigned int crc32c_sw(const char *, size_t len);
+unsigned int crc32c_sse42(const char *, size_t len);
+unsigned int block_csum(const char *, int bs);
+void set_csums(FILE *, const char *buf, size_t len, off_t off);
+bool check_csum(FILE *, int b, const char *block);
+void init_aes();
+void aes_expand(const unsigned char *key, unsigned char *ek, unsigned char *dk);
+void aes_block(const unsigned char *rk, bool enc, const unsigned char *in, unsigned char *out);
+void aes_block_aesni(const unsigned char *rk, const unsigned char *in, unsigned char *out);
+void xts_skip(unsigned char *t, int n);
+void xts_units(bool enc, unsigned char *buf, int n, unsigned char *t);
+void xts_units_aesni(bool enc, unsigned char *buf, int n, unsigned char *t);
+void xts_units_vaes(bool enc, unsigned char *buf, int n, unsigned char *t);
+void crypt_range(bool enc, char *buf, size_t len, off_t off);
+bool cipher_create(struct superblock *, const char *pass);
+bool cipher_open(struct superblock *);
+void pbkdf2_sha256(const char *pass, const unsigned char *salt, int salt_len, int iter, unsigned char *out, int len);
+unsigned char gf_mul(unsigned char a, unsigned char b);
+bool disk_read(FILE *, void *buf, size_t len, off_t off);
+bool image_io(FILE *, int op, void *buf, size_t len, off_t off);
+void image_sync(FILE *);
+void image_advise(FILE *, off_t off, off_t len, int advice);
+bool stripe_span(off_t off, size_t len, int m, off_t *start, off_t *end);
+bool vec_io(int fd, int op, struct iovec *iov, int cnt, off_t off);
+bool stripe_open(char *name, int n, off_t unit, bool create, off_t *size);
+void stripe_close();
+void *stripe_worker(void *);
+void sha256_init(struct sha256 *);
+void sha256_update(struct sha256 *, const void *buf, size_t len);
+void sha256_final(struct sha256 *, unsigned char *out);
+void sha256_blocks(unsigned int *h, const unsigned char *data, size_t n);
+void sha256_blocks_sw(unsigned int *h, const unsigned char *data, size_t n);
+void sha256_blocks_shani(unsigned int *h, const unsigned char *data, size_t n);
+off_t digest_file(FILE *, struct superblock *, int inode_loc, bool stored, unsigned char *out);
+void digest(FILE *, struct superblock *, int dir_id, char *name, bool stored);
+void scrub(FILE *, struct superblock *, int threads);
+void *scrub_worker(void *);
+void ra_init(struct readahead *);
+void ra_file(FILE *, struct open_file *, struct readahead *, int lblock);
+void ra_leaf(FILE *, struct superblock *, struct readahead *, int loc, int right);
+void dread(FILE *, void *buf, size_t len, off_t off);
+void dwrite(FILE *, const void *buf, size_t len, off_t off);
+void disk_write(FILE *, const void *buf, size_t len, off_t off);
+void data_write(FILE *, const void *buf, size_t len, off_t off);
+void init_locks();
+void begin_op();
+void end_op(FILE *);
+void journal_read(void *buf, size_t len, off_t off);
+void journal_write(FILE *, const void *buf, size_t len, off_t off, bool add);
+int journal_commit(FILE *, bool wait);
+void journal_checkpoint(FILE *);
+void init_journal(FILE *, struct superblock *);
+int journal_replay(FILE *, struct superblock *);
+void journal_open(FILE *, struct superblock *);
+void journal_close(FILE *);
+void *flusher(void *);
+bool flush_due();
+long long now_ms();
+unsigned int jsum(unsigned int h, const char *buf, size_t len);
+struct latch *latch(int blk, int write);
+void unlatch(struct latch *);
+void close_file(struct open_file *);
+void bench_mt(FILE *, struct superblock *, int threads, int items, int dir_id);
+int make_item(FILE *, struct superblock *, struct Key k, int type, char *name);
+int alloc_run(FILE *, struct superblock *, int group, int want, int *len);
+int write_ptr_block(FILE *, struct superblock *, int *ptr, int n);
+void write_block_map(FILE *, struct superblock *, struct inode *, int *ptr, int blocks);
+void batch_import(FILE *, struct superblock *, char *src, int dir_id, int threads);
+int batch_list(char *src, struct batch_file **files);
+void *batch_reader(void *);
+void *batch_writer(void *);
+void queue_put(struct write_queue *, struct write_req *);
+struct write_req *queue_get(struct write_queue *);
+int cmp_name(const void *, const void *);
+int cmp_batch_file(const void *, const void *);
+int scan_dir(FILE *, struct superblock *, int dir_id, int type, struct dir_entry **);
+off_t export_file(FILE *, struct superblock *, int inode_loc, char *fname);
+void export_tree(FILE *, struct superblock *, int dir_id, char *path, int threads);
+void *export_worker(void *);
+int cmp_export_job(const void *, const void *);
+int cmp_int(const void *, const void *);
+int write_file(FILE *, struct superblock *, int inode_loc, off_t offset, char *buf, int len);
+void serve(FILE *, struct superblock *, char *sock, int workers);
+void *server_worker(void *);
+void handle(struct server *, int fd, struct request *, char *data);
+bool read_full(int fd, void *buf, size_t len);
+bool write_full(int fd, const void *buf, size_t len);
+void *bench_worker(void *);
+void init_refmap(FILE *, struct superblock *);
+int get_ref(FILE *, struct superblock *, int i);
+void add_ref(FILE *, struct superblock *, int i, int delta);
+int shadow_node(FILE *, struct superblock *, int curr, struct node *);
+void relink(FILE *, struct superblock *, int parent, int old, int copy);
+struct latch *cow_leaf(FILE *, struct superblock *, struct Key k, int *loc, struct node *);
+int cow_item(FILE *, struct superblock *, int inode_loc);
+int remove_key(FILE *, struct superblock *, struct Key k);
+void drop_node(FILE *, struct superblock *, struct Key k, int *path, int depth);
+void remove_range(FILE *, struct superblock *, unsigned dir_id, struct rm_state *);
+int prune(FILE *, struct superblock *, unsigned dir_id, int parent, int *loc, struct rm_state *);
+bool merge_leaves(FILE *, struct superblock *, struct node *, int i);
+int cow_ptr_block(FILE *, struct superblock *, int b);
+int cow_data(FILE *, struct superblock *, off_t slot);
+struct latch *next_leaf(FILE *, struct superblock *, struct latch *, int *loc, struct node *, int *start);
+void snapshot(FILE *, struct superblock *, char *name);
+void list_snapshots(struct superblock *);
+int find_snapshot(struct superblock *, char *name);
+
+int main(int argc, char *argv[])
 {
-	FILE *p;
-	struct superblock sb;
-	int tmp;
-	int pwd_id;
-	int new_id;
-	char change[256];
-	char pwd[256];
-	char name[256];
-	char fname[256];
-	char choice[20];
-	char label[8];
+	struct session s;
+	char line[2 * PATH_MAX];
 	char t[25];
 
+	init_locks();
+	init_hashes();
+	init_aes();
 	get_time(t);
-	strcpy(pwd, "/");
-	pwd_id = 1;
-
-	printf("\nCurrent time: %s", t);
-	printf("\nSize of superblock: %lu", sizeof(struct superblock));
-	printf("\nSize of one inode: %lu", sizeof(struct inode));
-	printf("\nSize of one stat file: %lu", sizeof(struct stat));
-	printf("\nSize of one int: %lu", sizeof(int));
-	printf("\nSize of B+ tree node: %lu", sizeof(struct node));
-	printf("\nDegree of B+ tree: 340");
-	printf("\n");
-	strcpy(name, "part1.img");
+	strcpy(s.pwd, "/");
+	s.pwd_id = 1;
+	s.snap[0] = '\0';
+	strcpy(s.name, "part1.img");
+	batch = (argc > 2) && (strcmp(argv[1], "-f") == 0);
+
+	if (!batch) {
+		printf("\nCurrent time: %s", t);
+		printf("\nSize of superblock: %lu", sizeof(struct superblock));
+		printf("\nSize of one inode: %lu", sizeof(struct inode));
+		printf("\nSize of one stat file: %lu", sizeof(struct item_stat));
+		printf("\nSize of one int: %lu", sizeof(int));
+		printf("\n");
+	}
 /*	printf("\nEnter name of file in which psuedo partition is stored(without spaces): ");
 
 	scanf("%255s", name);
 */
-	if (mount(&p, name) == false) {
+	s.p = NULL;
+	s.mounted = mount(&s.p, s.name);
+
+	if (!s.mounted) {
 		printf("\nPartition mount failed. Maybe it is unformatted or file is corrupted.");
 		printf("\nMaybe try creating a partition or recovery options.\n");
+
+		if ((s.p == NULL) || ((argc > 1) && (strcmp(argv[1], "-s") == 0))) {
+			return 1;
+		}
+	}
+
+	dread(s.p, &s.sb, sizeof(struct superblock), 0);
+
+	if ((argc > 2) && (strcmp(argv[1], "-s") == 0)) {
+		serve(s.p, &s.sb, argv[2], (argc > 3) ? atoi(argv[3]) : SERVER_WORKERS);
+
+		return 0;
+	}
+
+	if (batch) {
+		run_script(&s, argv[2]);
+		journal_close(s.p);
+		fclose(s.p);
+
+		return 0;
 	}
 
 	printf("\n\n>>");
-	scanf("%s", choice);
-
-	while (strcmp(choice, "quit") != 0) {
-		if (strcmp(choice, "makefs") == 0) {
-			printf("\nCreating new filesystem.");
-			makefs(p);
-			printf("\nDone.");
-		} else if (strcmp(choice, "setlabel") == 0) {
-			scanf("%s", label);
-			setlabel(p, label);
-			remount(&p, name);
-		} else if ((strcmp(choice, "remount") == 0) || (strcmp(choice, "mount") == 0)) {
-			remount(&p, name);
-		} else if (strcmp(choice, "debug_show_filled_blocks") == 0) {
-			debug_show_filled_blocks(p);
-		} else if (strcmp(choice, "newfile") == 0) {
-			if (p == NULL) {
-				printf("\nPlease mount fs first.");
-				continue;
-			}
-			scanf("%255s", fname);
-			fseek(p, 0, SEEK_SET);
-			fread(&sb, sizeof(struct superblock), 1, p);
-			printf("\nFile ID: %d\n", get_id(fname, p, &sb));
-			new_empty_file_dir(p, &sb, fname, pwd_id, 4);
-		} else if (strcmp(choice, "ls") == 0) {
-			fseek(p, 0, SEEK_SET);
-			fread(&sb, sizeof(struct superblock), 1, p);
-			ls(p, &sb, pwd_id);
-		} else if (strcmp(choice, "pwd") == 0) {
-			printf("%s\n", pwd);
-		} else if (strcmp(choice, "debug_showroot") == 0){
-			fseek(p, 0, SEEK_SET);
-			fread(&sb, sizeof(struct superblock), 1, p);
-			debug_showroot(p, &sb);
-		} else if (strcmp(choice, "bcf") == 0) {
-			scanf("%d", &tmp);
-			fseek(p, 0, SEEK_SET);
-			fread(&sb, sizeof(struct superblock), 1, p);
-			batch_create_files(p, &sb, tmp, pwd_id);
-		} else if(strcmp(choice, "debug_inorder") == 0) {
-			fseek(p, 0, SEEK_SET);
-			fread(&sb, sizeof(struct superblock), 1, p);
-			inorder(p, sb.root);
-		} else if (strcmp(choice, "mkdir") == 0) {
-			scanf("%s", fname);
-			fseek(p, 0, SEEK_SET);
-			fread(&sb, sizeof(struct superblock), 1, p);
-			new_empty_file_dir(p, &sb, fname, pwd_id, 2);
-		} else if (strcmp(choice, "cd") == 0) {
-			scanf("%s", change);
-			fseek(p, 0, SEEK_SET);
-			fread(&sb, sizeof(struct superblock), 1, p);
-			new_id = find(p, &sb, pwd_id, change, 2, 0);
-			if (new_id == -1) {
-				printf("\nDirectory \"%s\" does not exist!", change);
-			} else {
-				pwd_id = new_id;
-				strcpy(pwd, change);
-				printf("Entered directory: %s", change);
-			}
-		} else if (strcmp(choice, "import") == 0) {
-			char path[256];
-
-			scanf("%s", path);
-			scanf("%s", fname);
-			fseek(p, 0, SEEK_SET);
-			fread(&sb, 4096, 1, p);
-			import(p, &sb, path, pwd_id, fname);
-		} else if (strcmp(choice, "export") == 0) {
-			char path[256];
-
-			scanf("%s %s", fname, path);
-			fseek(p, 0, SEEK_SET);
-			fread(&sb, 4096, 1, p);
-			extract(p, &sb, pwd_id, fname, path);
-		} else if (strcmp(choice, "find") == 0) {
-			scanf("%s", fname);
-			fseek(p, 0, SEEK_SET);
-			fread(&sb, 4096, 1, p);
-			if (find(p, &sb, pwd_id, fname, 4, 0) != -1) {
-				printf("\nFound file %s", fname);
-			} else {
-				printf("\nNo file by the name %s", fname);
-			}
-			if (find(p, &sb, pwd_id, fname, 2, 0) != -1) {
-				printf("\nFound directory %s", fname);
-			} else {
-				printf("\nNo directory by the name %s", fname);
-			}
-		} else {
-			printf("\nInvalid choice (Enter quit to exit)");
-		}
+
+	while ((fgets(line, sizeof(line), stdin) != NULL) && (run_command(&s, line) != 1)) {
+		journal_commit(s.p, true);
 		printf("\n>>");
-		scanf("%s", choice);
 	}
 
-	fclose(p);
+	journal_close(s.p);
+	fclose(s.p);
 
 	return 0;
 }
 
-void showinfo(struct superblock sb)
+/**
+ * Runs one command line of the shell. s->sb is read at mount and kept current by the
+ * functions that change it, so it is only read again after makefs, setlabel and remount.
+ * Returns 1 for quit, -1 if the command is unknown or misses arguments, 0 otherwise.
+ */
+int run_command(struct session *s, char *line)
 {
-	int size;
-	int count;
+	FILE *p;
+	struct superblock *sb;
 	int tmp;
-	char cat[3];
+	int n;
+	int new_id;
+	char *args;
+	char choice[20];
+	char fname[256];
+	char path[PATH_MAX];
+	char label[8];
+	static const char *writes[] = {"newfile", "mkdir", "bcf", "import", "append", "cp", "mv",
+		"rm", "bimport", "bench_mt", "snapshot", NULL};
 
-	count = 0;
-	tmp = sb.blocksize;
+	p = s->p;
+	sb = (s->snap[0] != '\0') ? &s->view : &s->sb;
+	n = 0;
 
-	do {
-		++count;
-		tmp = tmp>>10;
-	} while (tmp>>10 > 0);
+	if ((sscanf(line, "%19s %n", choice, &n) < 1) || (choice[0] == '#')) {
+		return 0;
+	}
 
-	size = tmp;
-	tmp = sb.blocks;
+	args = line + n;
 
-	do {
-		++count;
-		tmp = tmp>>10;
-	} while (tmp>>10 > 0);
+	for (tmp = 0; (s->snap[0] != '\0') && (writes[tmp] != NULL); ++tmp) {
+		if (strcmp(choice, writes[tmp]) == 0) {
+			printf("\nSnapshot %s is mounted read only, snapmount - goes back.", s->snap);
 
-	size *= tmp;
-	strcpy(cat, "B");
+			return 0;
+		}
+	}
+
+	/* an image that failed to mount can only be formatted or mounted again */
+	if (!s->mounted && (strcmp(choice, "quit") != 0) && (strcmp(choice, "makefs") != 0)
+			&& (strcmp(choice, "remount") != 0) && (strcmp(choice, "mount") != 0)) {
+		printf("\nNo filesystem is mounted, makefs formats the image and remount tries again.");
+
+		return 0;
+	}
+
+	if (strcmp(choice, "quit") == 0) {
+		return 1;
+	} else if (strcmp(choice, "makefs") == 0) {
+		bool encrypt;
+		int stripes;
+		int unit;
+		int shards;
+
+		tmp = BS;
+		encrypt = false;
+		stripes = 1;
+		unit = 0;
+		shards = 1;
+
+		/* makefs [block size] [-e] [-s <files>[:<stripe unit in KB>]] [-n <shards>] */
+		while (sscanf(args, "%255s %n", fname, &n) == 1) {
+			args += n;
+
+			if (strcmp(fname, "-e") == 0) {
+				encrypt = true;
+			} else if ((strcmp(fname, "-s") == 0) && (sscanf(args, "%255s %n", fname, &n) == 1)) {
+				args += n;
+				sscanf(fname, "%d:%d", &stripes, &unit);
+				unit *= 1024;
+			} else if ((strcmp(fname, "-n") == 0) && (sscanf(args, "%d %n", &shards, &n) == 1)) {
+				args += n;
+			} else {
+				tmp = atoi(fname);
+			}
+		}
+
+		if ((tmp != 4096) && (tmp != 16384) && (tmp != 65536)) {
+			printf("\nBlock size must be 4096, 16384 or 65536.");
+		} else if ((stripes < 1) || (stripes > STRIPE_MAX) || (unit < 0)) {
+			printf("\nAn image can be striped over 1 to %d files.", STRIPE_MAX);
+		} else if ((shards < 1) || (shards > SHARD_MAX)) {
+			printf("\nThe namespace can be split into 1 to %d shards.", SHARD_MAX);
+		} else if (encrypt && (getenv("FS1_KEY") == NULL)) {
+			printf("\nSet FS1_KEY to the passphrase of the new filesystem.");
+		} else {
+			if (!batch) {
+				printf("\nCreating new filesystem.");
+			}
+			makefs(p, s->name, tmp, encrypt, stripes, unit, shards);
+			sb = &s->sb;
+			dread(p, sb, sizeof(struct superblock), 0);
+			journal_open(p, sb);
+			strcpy(s->pwd, "/");
+			s->pwd_id = 1;
+			s->snap[0] = '\0';
+			s->mounted = true;
+			if (!batch) {
+				printf("\nDone.");
+			}
+		}
+	} else if (strcmp(choice, "setlabel") == 0) {
+		if (sscanf(args, "%7s", label) != 1) {
+			return -1;
+		}
+		setlabel(p, label);
+		s->mounted = remount(&s->p, s->name);
+		dread(s->p, &s->sb, sizeof(struct superblock), 0);
+		s->view = s->sb;
+		if (s->snap[0] != '\0') {
+			s->view.root = s->sb.snap[find_snapshot(&s->sb, s->snap)].root;
+		}
+	} else if ((strcmp(choice, "remount") == 0) || (strcmp(choice, "mount") == 0)) {
+		s->mounted = remount(&s->p, s->name);
+		dread(s->p, &s->sb, sizeof(struct superblock), 0);
+		strcpy(s->pwd, "/");
+		s->pwd_id = 1;
+		s->snap[0] = '\0';
+	} else if (strcmp(choice, "snapshot") == 0) {
+		if (sscanf(args, "%23s", fname) != 1) {
+			return -1;
+		}
+		snapshot(p, sb, fname);
+	} else if (strcmp(choice, "snapshots") == 0) {
+		list_snapshots(&s->sb);
+	} else if (strcmp(choice, "snapmount") == 0) {
+		if (sscanf(args, "%23s", fname) != 1) {
+			return -1;
+		}
+		tmp = find_snapshot(&s->sb, fname);
+		if ((strcmp(fname, "-") != 0) && (tmp == -1)) {
+			printf("\nNo snapshot by the name %s", fname);
+		} else {
+			s->view = s->sb;
+			if (tmp == -1) {
+				s->snap[0] = '\0';
+			} else {
+				s->view.root = s->sb.snap[tmp].root;
+				strcpy(s->snap, fname);
+			}
+			strcpy(s->pwd, "/");
+			s->pwd_id = 1;
+			if (!batch) {
+				printf("Mounted %s", (tmp == -1) ? "the live filesystem" : fname);
+			}
+		}
+	} else if (strcmp(choice, "sync") == 0) {
+		if (journal_commit(p, true) == 0) {
+			image_sync(p);
+		}
+	} else if (strcmp(choice, "scrub") == 0) {
+		tmp = sysconf(_SC_NPROCESSORS_ONLN);
+		sscanf(args, "%d", &tmp);
+		scrub(p, sb, tmp);
+	} else if (strcmp(choice, "debug_show_filled_blocks") == 0) {
+		debug_show_filled_blocks(p);
+	} else if (strcmp(choice, "newfile") == 0) {
+		if (sscanf(args, "%255s", fname) != 1) {
+			return -1;
+		}
+		if (!batch) {
+			printf("\nFile ID: %d\n", get_id(fname, p, sb, s->pwd_id, 4));
+		}
+		new_empty_file_dir(p, sb, fname, s->pwd_id, 4);
+	} else if (strcmp(choice, "ls") == 0) {
+		ls(p, sb, s->pwd_id);
+	} else if (strcmp(choice, "pwd") == 0) {
+		printf("%s\n", s->pwd);
+	} else if (strcmp(choice, "debug_showroot") == 0){
+		debug_showroot(p, sb);
+	} else if (strcmp(choice, "bcf") == 0) {
+		if (sscanf(args, "%d", &tmp) != 1) {
+			return -1;
+		}
+		batch_create_files(p, sb, tmp, s->pwd_id);
+	} else if(strcmp(choice, "debug_inorder") == 0) {
+		for (tmp = 0; tmp < n_shards; ++tmp) {
+			inorder(p, sb, *shard_root(sb, &shards[tmp]));
+		}
+	} else if (strcmp(choice, "mkdir") == 0) {
+		if (sscanf(args, "%255s", fname) != 1) {
+			return -1;
+		}
+		new_empty_file_dir(p, sb, fname, s->pwd_id, 2);
+	} else if (strcmp(choice, "cd") == 0) {
+		if (sscanf(args, "%255s", fname) != 1) {
+			return -1;
+		}
+		new_id = find(p, sb, s->pwd_id, fname, 2, 0);
+		if (new_id == -1) {
+			printf("\nDirectory \"%s\" does not exist!", fname);
+		} else {
+			s->pwd_id = new_id;
+			strcpy(s->pwd, fname);
+			if (!batch) {
+				printf("Entered directory: %s", fname);
+			}
+		}
+	} else if (strcmp(choice, "import") == 0) {
+		/* options: -d deduplicates, -c compresses, also given together as -dc */
+		tmp = 0;
+		while ((sscanf(args, "%4095s %n", path, &n) == 1) && (path[0] == '-') && (path[1] != '\0')) {
+			tmp |= (strchr(path, 'd') != NULL) ? IMPORT_DEDUP : 0;
+			tmp |= (strchr(path, 'c') != NULL) ? IMPORT_COMPRESS : 0;
+			args += n;
+		}
+		if (sscanf(args, "%4095s %255s", path, fname) != 2) {
+			return -1;
+		}
+		import(p, sb, path, s->pwd_id, fname, tmp);
+	} else if (strcmp(choice, "export") == 0) {
+		if (sscanf(args, "%255s %4095s", fname, path) != 2) {
+			return -1;
+		}
+		if (strcmp(fname, "-r") == 0) {
+			if (sscanf(args, "%*s %255s %4095s", fname, path) != 2) {
+				return -1;
+			}
+			new_id = (strcmp(fname, ".") == 0) ? s->pwd_id : find(p, sb, s->pwd_id, fname, 2, 0);
+			if (new_id == -1) {
+				printf("\nDirectory \"%s\" does not exist!", fname);
+			} else {
+				export_tree(p, sb, new_id, path, sysconf(_SC_NPROCESSORS_ONLN));
+			}
+		} else {
+			extract(p, sb, s->pwd_id, fname, path);
+		}
+	} else if (strcmp(choice, "cp") == 0) {
+		if (sscanf(args, "%255s %255s", fname, path) != 2) {
+			return -1;
+		}
+		tmp = copy_file(p, sb, s->pwd_id, fname, path);
+		if ((tmp != -1) && !batch) {
+			printf("\nCopied %s to %s, sharing %d blocks", fname, path, tmp);
+		}
+	} else if (strcmp(choice, "mv") == 0) {
+		char *to;
+
+		if (sscanf(args, "%255s %4095s", fname, path) != 2) {
+			return -1;
+		}
+		/* mv <name> <new name>, or into a directory: mv <name> <dir>[/<new name>] */
+		new_id = (strcmp(path, fname) != 0) ? find_dir(p, sb, s->pwd_id, path) : -1;
+		to = "";
+		if (new_id == -1) {
+			to = strrchr(path, '/');
+			if (to != NULL) {
+				*to++ = '\0';
+				new_id = find_dir(p, sb, s->pwd_id, (path[0] == '\0') ? "/" : path);
+			} else if ((strcmp(path, ".") != 0) && (strcmp(path, "..") != 0)) {
+				/* a "." or ".." that is no directory (".." at /) is not a new name */
+				new_id = s->pwd_id;
+				to = path;
+			}
+		}
+		if (new_id == -1) {
+			printf("\nDirectory \"%s\" does not exist!", path);
+		} else {
+			move_item(p, sb, s->pwd_id, fname, new_id, (to[0] == '\0') ? fname : to);
+		}
+	} else if (strcmp(choice, "rm") == 0) {
+		if (sscanf(args, "%255s", fname) != 1) {
+			return -1;
+		}
+		/* rm <name>, or rm -r <directory> with everything in it */
+		tmp = (strcmp(fname, "-r") == 0);
+		if (tmp && (sscanf(args, "%*s %255s", fname) != 1)) {
+			return -1;
+		}
+		remove_item(p, sb, s->pwd_id, fname, tmp, s->pwd_id);
+	} else if (strcmp(choice, "append") == 0) {
+		if (sscanf(args, "%4095s %255s", path, fname) != 2) {
+			return -1;
+		}
+		append(p, sb, path, s->pwd_id, fname);
+	} else if (strcmp(choice, "read") == 0) {
+		long offset;
+		int len;
+		int got;
+		char buf[4096];
+
+		if (sscanf(args, "%255s %ld %d", fname, &offset, &len) != 3) {
+			return -1;
+		}
+		tmp = find(p, sb, s->pwd_id, fname, 4, 1);
+		if (tmp == -1) {
+			printf("\nNo file by the name %s", fname);
+		} else {
+			printf("\n");
+			while (len > 0) {
+				got = read_file(p, sb, tmp, offset, buf, (len < 4096) ? len : 4096);
+				if (got <= 0) {
+					break;
+				}
+				fwrite(buf, got, 1, stdout);
+				offset += got;
+				len -= got;
+			}
+		}
+	} else if (strcmp(choice, "digest") == 0) {
+		if (sscanf(args, "%255s", fname) != 1) {
+			return -1;
+		}
+		tmp = (strcmp(fname, "-b") == 0);
+		if (tmp && (sscanf(args, "%*s %255s", fname) != 1)) {
+			return -1;
+		}
+		digest(p, sb, s->pwd_id, fname, tmp);
+	} else if (strcmp(choice, "bimport") == 0) {
+		tmp = sysconf(_SC_NPROCESSORS_ONLN);
+		if (sscanf(args, "%4095s %d", path, &tmp) < 1) {
+			return -1;
+		}
+		batch_import(p, sb, path, s->pwd_id, (tmp < 1) ? 1 : tmp);
+	} else if (strcmp(choice, "bench_mt") == 0) {
+		int threads;
+
+		if (sscanf(args, "%d %d", &threads, &tmp) != 2) {
+			return -1;
+		}
+		bench_mt(p, sb, threads, tmp, s->pwd_id);
+	} else if (strcmp(choice, "find") == 0) {
+		if (sscanf(args, "%255s", fname) != 1) {
+			return -1;
+		}
+		if (find(p, sb, s->pwd_id, fname, 4, 0) != -1) {
+			printf("\nFound file %s", fname);
+		} else {
+			printf("\nNo file by the name %s", fname);
+		}
+		if (find(p, sb, s->pwd_id, fname, 2, 0) != -1) {
+			printf("\nFound directory %s", fname);
+		} else {
+			printf("\nNo directory by the name %s", fname);
+		}
+	} else {
+		if (!batch) {
+			printf("\nInvalid choice (Enter quit to exit)");
+		}
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Script mode (fs1 -f <script>, or -f - for stdin): runs the commands of script one per
+ * line against the image mounted once, without prompts or progress messages. Blank lines
+ * and lines starting with # are skipped. The time of every command goes to stderr, so
+ * stdout only carries the output of the commands.
+ */
+void run_script(struct session *s, char *script)
+{
+	FILE *in;
+	int lineno;
+	int cmds;
+	int failed;
+	int ret;
+	double ms;
+	double total;
+	char line[2 * PATH_MAX];
+	char cmd[64];
+	struct timespec start;
+	struct timespec end;
+
+	in = (strcmp(script, "-") == 0) ? stdin : fopen(script, "r");
+
+	if (in == NULL) {
+		printf("\nCan not open script %s\n", script);
+
+		return;
+	}
+
+	lineno = 0;
+	cmds = 0;
+	failed = 0;
+	total = 0;
+
+	while (fgets(line, sizeof(line), in) != NULL) {
+		++lineno;
+
+		if ((sscanf(line, "%63s", cmd) < 1) || (cmd[0] == '#')) {
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		ret = run_command(s, line);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+		line[strcspn(line, "\n")] = '\0';
+		fflush(stdout);
+
+		if (ret == 1) {
+			break;
+		} else if (ret == -1) {
+			fprintf(stderr, "%d: invalid command or missing arguments: %s\n", lineno, line);
+			++failed;
+		} else {
+			fprintf(stderr, "%d: %.3f ms: %s\n", lineno, ms, line);
+			total += ms;
+			++cmds;
+		}
+	}
+
+	fprintf(stderr, "%d commands in %.3f s, %.0f commands/s, %d invalid\n", cmds, total / 1e3,
+			(total > 0) ? cmds * 1e3 / total : 0, failed);
+
+	if (in != stdin) {
+		fclose(in);
+	}
+
+	return;
+}
+
+void showinfo(struct superblock sb)
+{
+	int size;
+	int count;
+	int tmp;
+	char cat[3];
+
+	count = 0;
+	tmp = sb.blocksize;
+
+	do {
+		++count;
+		tmp = tmp>>10;
+	} while (tmp>>10 > 0);
+
+	size = tmp;
+	tmp = sb.blocks;
+
+	do {
+		++count;
+		tmp = tmp>>10;
+	} while (tmp>>10 > 0);
+
+	size *= tmp;
+	strcpy(cat, "B");
 
 	switch (count) {
 		case 0:	strcpy(cat, "B");
@@ -353,7 +1682,20 @@ void showinfo(struct superblock sb)
 	printf("\nBlocks: %d", sb.blocks);
 	printf("\nTotal Inodes: %d", sb.n_inodes);
 	printf("\nInodes per block: %d", sb.inodes);
+	printf("\nDegree of B+ tree: %d", NODE_KEYS(sb.blocksize) + 1);
+	printf("\nPointers per indirect block: %d", PTRS(sb.blocksize));
 	printf("\n#Blocks reserved for freeblocks bitmap: %d", sb.freeblocksmap);
+	printf("\nAllocation groups: %d of %d blocks and %d inodes", n_groups, groups[0].end - groups[0].start, groups[0].n_inodes);
+	printf("\nSnapshots: %d", sb.snaps);
+	printf("\nEncryption: %s", (sb.cipher == 0) ? "none" :
+			((cipher.impl == CIPHER_VAES) ? "XTS-AES-128 (VAES)" :
+			((cipher.impl == CIPHER_AESNI) ? "XTS-AES-128 (AES-NI)" : "XTS-AES-128 (portable)")));
+	if (sb.shards > 1) {
+		printf("\nShards: %d B+ trees", sb.shards);
+	}
+	if (sb.stripes > 1) {
+		printf("\nStriped over %d files, %d KB stripe unit", sb.stripes, sb.stripe_unit * (sb.blocksize >> 10));
+	}
 	if (sb.root == -1) {
 		printf("\nNo files/directories in fs.");
 	} else {
@@ -366,6 +1708,7 @@ void showinfo(struct superblock sb)
 
 bool mount(FILE **p, char name[])
 {
+	off_t size;
 	struct superblock sb;
 	char ch;
 
@@ -378,23 +1721,26 @@ bool mount(FILE **p, char name[])
 		return false;
 	}
 
-	fseek(*p, 0, SEEK_SET);
-	fread(&sb, sizeof(struct superblock), 1, *p);
+	/* the superblock is always at the start of the image file itself */
+	stripe_close();
+	dread(*p, &sb, sizeof(struct superblock), 0);
+
+	if ((comp_str(sb.magic, MAGIC, 8) != 0) && batch) {
+		printf("\nNo filesystem on %s, the script has to start with makefs.\n", name);
 
-	if (comp_str(sb.magic, MAGIC, 8) != 0) {
+		return false;
+	} else if (comp_str(sb.magic, MAGIC, 8) != 0) {
 		printf("\n\tInvalid partition detected. Want to create new filesystem on partition? (Y/n) : ");
 		scanf(" %c", &ch);
 
 		if ((ch == 'y') || (ch == 'Y')) {
-			makefs(*p);
+			makefs(*p, name, BS, false, 1, 0, 1);
 		} else {
 
 			return false;
 		}
 
-		fseek(*p, 0, SEEK_SET);
-		fread(&sb, sizeof(struct superblock), 1, *p);
-		fseek(*p, 0, SEEK_SET);
+		dread(*p, &sb, sizeof(struct superblock), 0);
 
 		if (comp_str(sb.magic, MAGIC, 8) != 0) {
 			printf("\n\tMagic string read was: %s, Requires: %s", sb.magic, MAGIC);
@@ -406,26 +1752,84 @@ bool mount(FILE **p, char name[])
 		}
 	}
 
-	printf("Mounting filesystem complete!");
+	if (sb.version != FS_VERSION) {
+		printf("\n\tImage uses on-disk format revision %d, this build needs %d. Run makefs to reformat.", sb.version, FS_VERSION);
+
+		return false;
+	}
+
+	if ((sb.stripes > 1) && !stripe_open(name, sb.stripes, (off_t) sb.stripe_unit * sb.blocksize, false, &size)) {
+		fclose(*p);
+		*p = NULL;
+
+		return false;
+	}
+
+	/* nothing of an image that can not be decrypted is usable, not even for makefs */
+	if (!cipher_open(&sb)) {
+		fclose(*p);
+		*p = NULL;
+
+		return false;
+	}
+
+	if (journal_replay(*p, &sb) > 0) {
+		dread(*p, &sb, sizeof(struct superblock), 0);
+	}
+
+	journal_open(*p, &sb);
+	init_groups(&sb);
+	load_shards(*p, &sb);
+
+	if (!batch) {
+		printf("Mounting filesystem complete!");
 
-	showinfo(sb);
+		showinfo(sb);
+	}
 
 	return true;
 }
 
-void makefs(FILE *p)
+/**
+ * name: the image file, named again for the files of a striped image
+ * bs: block size, one of 4096, 16384 or 65536. B+ tree degree, inodes per block and
+ * pointers per indirect block are all derived from it.
+ * encrypt: encrypt the image with the passphrase in the environment variable FS1_KEY,
+ * 	which the caller has checked is set
+ * stripes: number of files to stripe the image over, at most STRIPE_MAX; 1 for the image
+ * 	file alone. The others are created as large as the image if they do not exist.
+ * unit: bytes per stripe unit, rounded down to whole blocks; 0 for STRIPE_UNIT
+ * shards: number of B+ trees to split the namespace into, at most SHARD_MAX
+ */
+void makefs(FILE *p, char name[], int bs, bool encrypt, int stripes, int unit, int shards)
 {
-	long int size;
+	off_t size;
 	struct superblock SuperB;
 
-	fseek(p, 0, SEEK_END);
-	size = ftell(p);
-	fseek(p, 0, SEEK_SET);
+	journal_close(p);
+	stripe_close();
+
+	size = lseek(fileno(p), 0, SEEK_END);
+	unit = (unit == 0) ? STRIPE_UNIT : unit;
+	unit = (unit < bs) ? bs : unit - unit % bs;
+
+	if ((stripes > 1) && !stripe_open(name, stripes, unit, true, &size)) {
+		return;
+	}
+
+	if (size / bs > INT_MAX) {
+		printf("\nImage holds more than %d blocks of %d bytes, only the first %d are used.", INT_MAX, bs, INT_MAX);
+		size = (off_t) INT_MAX * bs;
+	}
 
+	memset(&SuperB, 0, sizeof(struct superblock));
 	strcpy(SuperB.magic, MAGIC);
 	strcpy(SuperB.label, "NEWLABEL");
-	SuperB.blocksize = 4096;
-	SuperB.blocks = size / 4096;
+	SuperB.blocksize = bs;
+	SuperB.blocks = size / bs;
+	SuperB.version = FS_VERSION;
+	SuperB.stripes = stripes;
+	SuperB.stripe_unit = (stripes > 1) ? unit / bs : 0;
 	SuperB.n_inodes = (SuperB.blocks) / 10;
 
 	if ((SuperB.blocks % 10) != 0) {
@@ -433,16 +1837,44 @@ void makefs(FILE *p)
 	}
 
 	SuperB.root = -1;
-	SuperB.inodes = 64;
-	SuperB.freeblocksmap = init_freemap(p, SuperB.blocks);
+	SuperB.inodes = bs / sizeof(struct inode);
+
+	SuperB.agblocks = SuperB.blocks / AG_COUNT;
+
+	if (SuperB.agblocks < AG_MIN_BLOCKS) {
+		SuperB.agblocks = AG_MIN_BLOCKS;
+	}
+
+	SuperB.agblocks += (8 - SuperB.agblocks % 8) % 8;
+	SuperB.agcount = (SuperB.blocks - 1) / SuperB.agblocks + 1;
+	SuperB.aginodes = SuperB.n_inodes / SuperB.agcount;
+
+	if (((SuperB.aginodes % SuperB.inodes) != 0) || (SuperB.aginodes == 0)) {
+		SuperB.aginodes += SuperB.inodes - (SuperB.aginodes % SuperB.inodes);
+	}
+
+	SuperB.n_inodes = SuperB.aginodes * SuperB.agcount;
+
+	cipher.on = false;
+
+	if (encrypt && !cipher_create(&SuperB, getenv("FS1_KEY"))) {
+		return;
+	}
+
+	SuperB.freeblocksmap = init_freemap(p, &SuperB);
 	SuperB.idcounter = 2;
 	init_inodes(p, &SuperB);
+	init_journal(p, &SuperB);
+	init_refmap(p, &SuperB);
+	init_dedup(p, &SuperB);
+	init_csum(p, &SuperB);
+	init_shards(p, &SuperB, shards);
+
+	dwrite(p, &SuperB, sizeof(struct superblock), 0);
+	dwrite(p, &SuperB, sizeof(struct superblock), bs);
 
-	fseek(p, 0, SEEK_SET);
-	fwrite(&SuperB, sizeof(struct superblock), 1, p);
-	fseek(p, 4096, SEEK_SET);
-	fwrite(&SuperB, sizeof(struct superblock), 1, p);
-	fseek(p, 0, SEEK_SET);
+	init_groups(&SuperB);
+	load_shards(p, &SuperB);
 
 	return;
 }
@@ -451,19 +1883,19 @@ void setlabel(FILE *p, char label[8])
 {
 	struct superblock sb;
 
-	fseek(p, 0, SEEK_SET);
-	fread(&sb, sizeof(struct superblock), 1, p);
-	fseek(p, 0, SEEK_SET);
+	dread(p, &sb, sizeof(struct superblock), 0);
 
 	strcpy(sb.label, label);
 
-	fwrite(&sb, sizeof(struct superblock), 1, p);
-	fwrite(&sb, sizeof(struct superblock), 1, p);
+	update_sb(p, &sb);
 
 	return;
 }
 
-void remount(FILE **p, char name[])
+/**
+ * Closes image name and mounts it again. Returns false if the mount failed.
+ */
+bool remount(FILE **p, char name[])
 {
 	if (*p == NULL) {
 		printf("\n\tERROR: Remount failed as NULL was passed to be remounted.");
@@ -471,1437 +1903,8833 @@ void remount(FILE **p, char name[])
 		exit(1);
 	}
 
+	journal_close(*p);
 	fclose(*p);
 	*p = fopen(name, "rb+");
-	mount(p, name);
-
-	return;
-}
-
-int comp_str(char a[], char b[], int len)
-{
-	int i;
-
-	for (i = 0; i < len; ++i) {
-		if (a[i] != b[i]) {
-			return 1;
-		}
-	}
 
-	return 0;
+	return mount(p, name);
 }
 
 /**
- * returns number of blocks reserved for freeblocks map
+ * Takes snapshot name of the live tree of sb. Running operations are waited for, and new
+ * ones wait meanwhile, so the snapshot holds none of them half done. Then the root node
+ * gains an owner and is saved in sb->snap[]; nothing is copied, the live tree copies the
+ * nodes, inodes and blocks it changes from now on. Snapshots are never changed, and can be
+ * mounted read only with snapmount.
  */
-int init_freemap(FILE *p, int blocks)
+void snapshot(FILE *p, struct superblock *sb, char *name)
 {
-	struct freeblock *freemap;
-	int freeblocks;
-	int i;
-	int j;
+	struct snapshot *snap;
 
-	freeblocks = blocks/(8 * 4096);
+	if (sb->refmap_blocks == 0) {
+		printf("\nThis image was made before snapshots existed. Run makefs to take snapshots.");
 
-	if ((blocks % (8 * 4096)) != 0) {
-		++freeblocks;
+		return;
 	}
 
-	freemap = (struct freeblock *) malloc(freeblocks * sizeof(struct freeblock));
-	i = 0;
+	/* a snapshot saves one root */
+	if (sb->shards > 1) {
+		printf("\nSnapshots of images split into shards are not supported.");
 
-	while (i < freeblocks) {
-		j = 0;
-		while (j < 4096) {
-			freemap[i].f[j] = 0;
-			++j;
-		}
-		++i;
+		return;
 	}
 
-	fseek(p, 2 * 4096, SEEK_SET);
-	fwrite(freemap, freeblocks * sizeof(struct freeblock), 1, p);
+	if (find_snapshot(sb, name) != -1) {
+		printf("\nSnapshot \"%s\" already exists!", name);
 
-	i = 0;
-	while (i < (freeblocks + 2)) {
-		use_block(p, i);
-		++i;
+		return;
 	}
 
-	return freeblocks;
-}
-
-/**
- * Sets i'th block's entry in freemap.
- * One block holds 8 * 4096 bits.
- * For i'th block:
- * 	b: block number
- * 	m: byte within b'th block number
- * 	x: bit within m'th byte of b'th block number
- * 	loc: byte location to be read and written back to
- */
-void use_block(FILE *p, int i)
-{
-	int b;
-	int m;
-	int x;
-	int loc;
-	char a;
-	int tmp; 
+	if (sb->snaps == SNAP_MAX) {
+		printf("\nNo room for more than %d snapshots.", SNAP_MAX);
 
-	b = i / (8 * 4096) + 2;
-	m = (i % (8 * 4096)) / 8;
-	x = (i % (8 * 4096)) % 8;
+		return;
+	}
 
-	loc = b * 4096 + m;
+	pthread_rwlock_wrlock(&journal.ops_lock);
 
-	fseek(p, loc, SEEK_SET);
-	fread(&a, sizeof(char), 1, p);
+	if (sb->root != -1) {
+		add_ref(p, sb, sb->root, 1);
+	}
 
-	a ^= (1 << x);
+	pthread_mutex_lock(&sb_lock);
+	snap = &sb->snap[sb->snaps];
+	snprintf(snap->name, SNAP_NAME, "%s", name);
+	get_time(snap->ctime);
+	snap->root = sb->root;
+	sb->shared = 1;
+	++sb->snaps;
+	pthread_mutex_unlock(&sb_lock);
 
-	fseek(p, loc, SEEK_SET);
-	fwrite(&a, sizeof(char), 1, p);
+	update_sb(p, sb);
 
-	tmp = (a >> x) && 1;
+	pthread_rwlock_unlock(&journal.ops_lock);
 
-	if (DEBUG)
-		printf("\nToggled block %d, byte %d, index %d, byte location: %d, to %d", b, m, x, loc, tmp);
+	journal_commit(p, true);
 
 	return;
 }
 
-/**
- * use_block(FILE *, int) basically toggles bit using XOR operation, so, freeing a 
- * used block needs only toggling bit from 1 to 0, which is achieved by using the 
- * same function.
- * */
-void free_block(FILE *p, int i)
+void list_snapshots(struct superblock *sb)
 {
-	use_block(p, i);
+	int i;
+
+	for (i = 0; i < sb->snaps; ++i) {
+		printf("%20s    %25s\n", sb->snap[i].name, sb->snap[i].ctime);
+	}
 
 	return;
 }
 
-int get_node(FILE *p, struct superblock *sb)
+/**
+ * Returns the index of snapshot name in sb->snap, -1 if there is none.
+ */
+int find_snapshot(struct superblock *sb, char *name)
 {
-	int fb;
 	int i;
-	struct node nn;
 
-	fb = get_free_block(p, sb);
+	for (i = 0; i < sb->snaps; ++i) {
+		if (strcmp(sb->snap[i].name, name) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+int comp_str(char a[], char b[], int len)
+{
+	int i;
+
+	for (i = 0; i < len; ++i) {
+		if (a[i] != b[i]) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Reads len bytes at byte location off of the image. pread() keeps no file position,
+ * so any number of threads can read and write the image at the same time.
+ */
+void dread(FILE *p, void *buf, size_t len, off_t off)
+{
+	unsigned long gen;
+
+	do {
+		gen = __atomic_load_n(&journal.gen, __ATOMIC_SEQ_CST);
+
+		if (!disk_read(p, buf, len, off)) {
+			memset(buf, 0, len);
+		}
+
+		if (__atomic_load_n(&journal.dirty, __ATOMIC_SEQ_CST) > 0) {
+			journal_read(buf, len, off);
+		}
+	} while (gen != __atomic_load_n(&journal.gen, __ATOMIC_SEQ_CST));
+
+	return;
+}
+
+/**
+ * Writes metadata: into the journal while one is open, else straight to the image.
+ */
+void dwrite(FILE *p, const void *buf, size_t len, off_t off)
+{
+	if (journal.on) {
+		journal_write(p, buf, len, off, true);
+	} else {
+		disk_write(p, buf, len, off);
+	}
+
+	return;
+}
+
+/**
+ * Reads len bytes at off from the image itself, decrypting them on encrypted images.
+ * Ranges that do not start or end on a 16 byte unit are read and decrypted whole units at
+ * a time, in a buffer of the thread. Returns false if not all of them could be read.
+ */
+bool disk_read(FILE *p, void *buf, size_t len, off_t off)
+{
+	off_t a0;
+	off_t a1;
+	static __thread char *tmp;
+	static __thread size_t cap;
+
+	if (!cipher.on) {
+		return image_io(p, STRIPE_READ, buf, len, off);
+	}
+
+	a0 = off & ~(off_t) 15;
+	a1 = (off + (off_t) len + 15) & ~(off_t) 15;
+
+	if ((a0 == off) && (a1 == off + (off_t) len)) {
+		if (!image_io(p, STRIPE_READ, buf, len, off)) {
+			return false;
+		}
+
+		crypt_range(false, (char *) buf, len, off);
+
+		return true;
+	}
+
+	if ((size_t) (a1 - a0) > cap) {
+		cap = a1 - a0;
+		tmp = (char *) realloc(tmp, cap);
+	}
+
+	if (!image_io(p, STRIPE_READ, tmp, a1 - a0, a0)) {
+		return false;
+	}
+
+	crypt_range(false, tmp, a1 - a0, a0);
+	memcpy(buf, tmp + (off - a0), len);
+
+	return true;
+}
+
+/**
+ * Writes len bytes at off to the image itself, encrypting them on encrypted images. The
+ * units a range starts or ends inside of are read back first, so their other bytes are
+ * kept.
+ */
+void disk_write(FILE *p, const void *buf, size_t len, off_t off)
+{
+	off_t a0;
+	off_t a1;
+	static __thread char *tmp;
+	static __thread size_t cap;
+
+	a0 = off;
+	a1 = off + len;
+
+	if (cipher.on) {
+		a0 = off & ~(off_t) 15;
+		a1 = (off + (off_t) len + 15) & ~(off_t) 15;
+
+		if ((size_t) (a1 - a0) > cap) {
+			cap = a1 - a0;
+			tmp = (char *) realloc(tmp, cap);
+		}
+
+		if ((a0 < off) && !disk_read(p, tmp, 16, a0)) {
+			memset(tmp, 0, 16);
+		}
+
+		if ((a1 > off + (off_t) len) && !disk_read(p, tmp + (a1 - a0 - 16), 16, a1 - 16)) {
+			memset(tmp + (a1 - a0 - 16), 0, 16);
+		}
+
+		memcpy(tmp + (off - a0), buf, len);
+		crypt_range(true, tmp, a1 - a0, a0);
+		buf = tmp;
+	}
+
+	if (!image_io(p, STRIPE_WRITE, (void *) buf, a1 - a0, a0)) {
+		printf("\nERROR: Write of %lu bytes at %ld failed!", (unsigned long) len, (long) off);
+	}
+
+	return;
+}
+
+/**
+ * Reads (STRIPE_READ) or writes (STRIPE_WRITE) len bytes at off of the image files, as
+ * they are, without encryption. On a striped image the bytes of each file are moved with
+ * one preadv() or pwritev(), and when the range spans several files their I/O threads
+ * move theirs while this thread moves the bytes of the first one. Returns false if not all
+ * bytes could be moved.
+ */
+bool image_io(FILE *p, int op, void *buf, size_t len, off_t off)
+{
+	int m;
+	int cnt;
+	int pending;
+	off_t u;
+	off_t lo;
+	off_t hi;
+	off_t start;
+	off_t end;
+	bool ok;
+	struct iovec *iov;
+	struct stripe_job job[STRIPE_MAX];
+	struct stripe_job *first;
+
+	if (stripe.n <= 1) {
+		if (op == STRIPE_READ) {
+			return pread(fileno(p), buf, len, off) == (ssize_t) len;
+		}
+
+		return pwrite(fileno(p), buf, len, off) == (ssize_t) len;
+	}
+
+	if (len == 0) {
+		return true;
+	}
+
+	iov = (struct iovec *) malloc(((len + stripe.unit - 1) / stripe.unit + 1) * sizeof(struct iovec));
+	first = NULL;
+	pending = 0;
+	cnt = 0;
+
+	for (m = 0; m < stripe.n; ++m) {
+		job[m].cnt = 0;
+
+		if (!stripe_span(off, len, m, &start, &end)) {
+			continue;
+		}
+
+		job[m].op = op;
+		job[m].fd = stripe.fd[m];
+		job[m].iov = iov + cnt;
+		job[m].off = start;
+		job[m].ok = true;
+		job[m].pending = &pending;
+
+		/* the units of file m in the range, a stripe of the image apart */
+		for (u = off / stripe.unit + (m - off / stripe.unit % stripe.n + stripe.n) % stripe.n;
+				u * stripe.unit < off + (off_t) len; u += stripe.n) {
+			lo = (u * stripe.unit > off) ? u * stripe.unit : off;
+			hi = ((u + 1) * stripe.unit < off + (off_t) len) ? (u + 1) * stripe.unit : off + (off_t) len;
+			iov[cnt].iov_base = (char *) buf + (lo - off);
+			iov[cnt].iov_len = hi - lo;
+			++cnt;
+			++job[m].cnt;
+		}
+
+		if (first == NULL) {
+			first = &job[m];
+		} else {
+			++pending;
+		}
+	}
+
+	if (pending > 0) {
+		pthread_mutex_lock(&stripe.lock);
+
+		for (m = 0; m < stripe.n; ++m) {
+			if ((job[m].cnt > 0) && (&job[m] != first)) {
+				job[m].next = stripe.queue[m];
+				stripe.queue[m] = &job[m];
+			}
+		}
+
+		pthread_cond_broadcast(&stripe.work);
+		pthread_mutex_unlock(&stripe.lock);
+	}
+
+	ok = vec_io(first->fd, op, first->iov, first->cnt, first->off);
+
+	if (pending > 0) {
+		pthread_mutex_lock(&stripe.lock);
+
+		while (pending > 0) {
+			pthread_cond_wait(&stripe.done, &stripe.lock);
+		}
+
+		pthread_mutex_unlock(&stripe.lock);
+
+		for (m = 0; m < stripe.n; ++m) {
+			ok = ok && ((job[m].cnt == 0) || job[m].ok);
+		}
+	}
+
+	free(iov);
+
+	return ok;
+}
+
+/**
+ * Makes what was written to the image files durable, syncing all of them at the same time.
+ */
+void image_sync(FILE *p)
+{
+	int m;
+	int pending;
+	struct stripe_job job[STRIPE_MAX];
+
+	if (stripe.n <= 1) {
+		fdatasync(fileno(p));
+
+		return;
+	}
+
+	pending = stripe.n - 1;
+	pthread_mutex_lock(&stripe.lock);
+
+	for (m = 1; m < stripe.n; ++m) {
+		job[m].op = STRIPE_SYNC;
+		job[m].fd = stripe.fd[m];
+		job[m].pending = &pending;
+		job[m].next = stripe.queue[m];
+		stripe.queue[m] = &job[m];
+	}
+
+	pthread_cond_broadcast(&stripe.work);
+	pthread_mutex_unlock(&stripe.lock);
+
+	fdatasync(stripe.fd[0]);
+
+	pthread_mutex_lock(&stripe.lock);
+
+	while (pending > 0) {
+		pthread_cond_wait(&stripe.done, &stripe.lock);
+	}
+
+	pthread_mutex_unlock(&stripe.lock);
+
+	return;
+}
+
+/**
+ * posix_fadvise() for len bytes at off of the image, len 0 for all of it.
+ */
+void image_advise(FILE *p, off_t off, off_t len, int advice)
+{
+	int m;
+	off_t start;
+	off_t end;
+
+	if (stripe.n <= 1) {
+		posix_fadvise(fileno(p), off, len, advice);
+
+		return;
+	}
+
+	for (m = 0; m < stripe.n; ++m) {
+		if (len == 0) {
+			posix_fadvise(stripe.fd[m], 0, 0, advice);
+		} else if (stripe_span(off, len, m, &start, &end)) {
+			posix_fadvise(stripe.fd[m], start, end - start, advice);
+		}
+	}
+
+	return;
+}
+
+/**
+ * Finds the bytes of file m of a striped image among the len bytes at off of the image.
+ * They follow one another in the file, from start to end. Returns false if there are none.
+ */
+bool stripe_span(off_t off, size_t len, int m, off_t *start, off_t *end)
+{
+	off_t u0;
+	off_t u1;
+	off_t uf;
+	off_t ul;
+
+	if (len == 0) {
+		return false;
+	}
+
+	u0 = off / stripe.unit;
+	u1 = (off + (off_t) len - 1) / stripe.unit;
+	uf = u0 + (m - u0 % stripe.n + stripe.n) % stripe.n;
+	ul = u1 - (u1 % stripe.n - m + stripe.n) % stripe.n;
+
+	if (uf > u1) {
+		return false;
+	}
+
+	*start = (uf / stripe.n) * stripe.unit + ((uf == u0) ? off % stripe.unit : 0);
+	*end = (ul / stripe.n) * stripe.unit + ((ul == u1) ? (off + (off_t) len - 1) % stripe.unit + 1 : stripe.unit);
+
+	return true;
+}
+
+/**
+ * preadv() or pwritev() of cnt pieces at off of fd, repeated until all bytes are moved.
+ * iov is changed on the way. Returns false on errors and at the end of the file.
+ */
+bool vec_io(int fd, int op, struct iovec *iov, int cnt, off_t off)
+{
+	ssize_t n;
+
+	while (cnt > 0) {
+		if (op == STRIPE_READ) {
+			n = preadv(fd, iov, (cnt < IOV_MAX) ? cnt : IOV_MAX, off);
+		} else {
+			n = pwritev(fd, iov, (cnt < IOV_MAX) ? cnt : IOV_MAX, off);
+		}
+
+		if (n <= 0) {
+			return false;
+		}
+
+		off += n;
+
+		while ((cnt > 0) && ((size_t) n >= iov->iov_len)) {
+			n -= iov->iov_len;
+			++iov;
+			--cnt;
+		}
+
+		if (cnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * I/O thread of file m of a striped image, running the jobs queued for it.
+ */
+void *stripe_worker(void *arg)
+{
+	int m;
+	struct stripe_job *job;
+
+	m = (int) (long) arg;
+	pthread_mutex_lock(&stripe.lock);
+
+	while (true) {
+		while ((stripe.queue[m] == NULL) && !stripe.stop) {
+			pthread_cond_wait(&stripe.work, &stripe.lock);
+		}
+
+		if (stripe.queue[m] == NULL) {
+			break;
+		}
+
+		job = stripe.queue[m];
+		stripe.queue[m] = job->next;
+		pthread_mutex_unlock(&stripe.lock);
+
+		if (job->op == STRIPE_SYNC) {
+			job->ok = (fdatasync(job->fd) == 0);
+		} else {
+			job->ok = vec_io(job->fd, job->op, job->iov, job->cnt, job->off);
+		}
+
+		pthread_mutex_lock(&stripe.lock);
+		--*job->pending;
+		pthread_cond_broadcast(&stripe.done);
+	}
+
+	pthread_mutex_unlock(&stripe.lock);
+
+	return NULL;
+}
+
+/**
+ * Opens the n files of an image striped in units of unit bytes: the image name itself,
+ * then name.1 to name.<n - 1>. With create, missing or smaller files are made as large as
+ * the image, sparse. *size is set to the bytes of the image that fit in all of them.
+ * Returns false if a file can not be opened.
+ */
+bool stripe_open(char *name, int n, off_t unit, bool create, off_t *size)
+{
+	int m;
+	off_t min;
+	off_t end;
+	char path[PATH_MAX];
+
+	stripe_close();
+	min = -1;
+
+	for (m = 0; m < n; ++m) {
+		if (m == 0) {
+			snprintf(path, sizeof(path), "%s", name);
+		} else {
+			snprintf(path, sizeof(path), "%s.%d", name, m);
+		}
+
+		stripe.fd[m] = open(path, O_RDWR | ((create && (m > 0)) ? O_CREAT : 0), 0644);
+
+		if (stripe.fd[m] == -1) {
+			printf("\nCan not open %s, file %d of the %d the image is striped over.", path, m, n);
+
+			while (--m >= 0) {
+				close(stripe.fd[m]);
+			}
+
+			return false;
+		}
+
+		end = lseek(stripe.fd[m], 0, SEEK_END);
+
+		if (create && (m > 0) && (end < min) && (ftruncate(stripe.fd[m], min) == 0)) {
+			end = min;
+		}
+
+		min = ((min == -1) || (end < min)) ? end : min;
+	}
+
+	stripe.n = n;
+	stripe.unit = unit;
+	stripe.stop = false;
+	*size = (min / unit) * unit * n;
+
+	for (m = 0; m < n; ++m) {
+		stripe.queue[m] = NULL;
+		pthread_create(&stripe.io[m], NULL, stripe_worker, (void *) (long) m);
+	}
+
+	return true;
+}
+
+/**
+ * Stops the I/O threads and closes the files of a striped image, which is then used as
+ * one file again.
+ */
+void stripe_close()
+{
+	int m;
+
+	if (stripe.n <= 1) {
+		return;
+	}
+
+	pthread_mutex_lock(&stripe.lock);
+	stripe.stop = true;
+	pthread_cond_broadcast(&stripe.work);
+	pthread_mutex_unlock(&stripe.lock);
+
+	for (m = 0; m < stripe.n; ++m) {
+		pthread_join(stripe.io[m], NULL);
+		close(stripe.fd[m]);
+	}
+
+	stripe.n = 1;
+
+	return;
+}
+
+/**
+ * Writes file contents. They go to the image right away and are not journaled; their
+ * checksums are, like metadata (see set_csums()).
+ */
+void data_write(FILE *p, const void *buf, size_t len, off_t off)
+{
+	disk_write(p, buf, len, off);
+
+	if (__atomic_load_n(&journal.dirty, __ATOMIC_SEQ_CST) > 0) {
+		journal_write(p, buf, len, off, false);
+	}
+
+	if (journal.csum_blocks > 0) {
+		set_csums(p, (const char *) buf, len, off);
+	}
+
+	return;
+}
+
+void init_locks()
+{
+	int i;
+	pthread_rwlockattr_t attr;
+
+	for (i = 0; i < LATCH_BUCKETS; ++i) {
+		pthread_mutex_init(&latch_lock[i], NULL);
+	}
+
+	for (i = 0; i < DIR_LOCKS; ++i) {
+		pthread_mutex_init(&dir_lock[i], NULL);
+	}
+
+	for (i = 0; i < FILE_LOCKS; ++i) {
+		pthread_mutex_init(&file_lock[i], NULL);
+	}
+
+	for (i = 0; i < REF_LOCKS; ++i) {
+		pthread_mutex_init(&ref_lock[i], NULL);
+	}
+
+	for (i = 0; i < DEDUP_LOCKS; ++i) {
+		pthread_mutex_init(&dedup_lock[i], NULL);
+	}
+
+	for (i = 0; i < MAX_OPEN; ++i) {
+		pthread_mutex_init(&oft[i].zlock, NULL);
+	}
+
+	/* writers first, so a waiting commit is not starved by a stream of operations */
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&journal.ops_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	pthread_mutex_init(&journal.commit_lock, NULL);
+	pthread_mutex_init(&journal.flush_lock, NULL);
+	pthread_mutex_init(&journal.free_lock, NULL);
+	pthread_cond_init(&journal.wake, NULL);
+	pthread_mutex_init(&stripe.lock, NULL);
+
+	for (i = 0; i < SHARD_MAX; ++i) {
+		pthread_rwlock_init(&shards[i].latch, NULL);
+		pthread_mutex_init(&shards[i].lock, NULL);
+	}
+
+	pthread_cond_init(&stripe.work, NULL);
+	pthread_cond_init(&stripe.done, NULL);
+	stripe.n = 1;
+
+	for (i = 0; i < JOURNAL_BUCKETS; ++i) {
+		pthread_mutex_init(&journal.lock[i], NULL);
+	}
+
+	return;
+}
+
+/**
+ * Starts an operation: its metadata writes go into one commit together. Nests, and
+ * only the outermost call waits for a running commit.
+ */
+void begin_op()
+{
+	if ((op_depth++ == 0) && journal.on) {
+		pthread_rwlock_rdlock(&journal.ops_lock);
+	}
+
+	return;
+}
+
+/**
+ * Ends an operation. Operations are committed in groups by the flusher, which is woken
+ * when one is due. An operation that leaves half of limit dirty commits itself, so
+ * writers are held back when the flusher falls behind.
+ */
+void end_op(FILE *p)
+{
+	if ((--op_depth > 0) || !journal.on) {
+		return;
+	}
+
+	pthread_rwlock_unlock(&journal.ops_lock);
+
+	__atomic_add_fetch(&journal.ops, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&journal.dirty, __ATOMIC_SEQ_CST) >= journal.limit / 2) {
+		journal_commit(p, true);
+	} else if (flush_due()) {
+		pthread_cond_signal(&journal.wake);
+	}
+
+	return;
+}
+
+/**
+ * Background flusher of the image arg: every FLUSH_INTERVAL_MS, or when woken by end_op(),
+ * commits the journal if flush_due().
+ */
+void *flusher(void *arg)
+{
+	FILE *p;
+	struct timespec t;
+
+	p = (FILE *) arg;
+	pthread_mutex_lock(&journal.flush_lock);
+
+	while (!journal.stop) {
+		clock_gettime(CLOCK_REALTIME, &t);
+		t.tv_nsec += FLUSH_INTERVAL_MS * 1000000L;
+		t.tv_sec += t.tv_nsec / 1000000000L;
+		t.tv_nsec %= 1000000000L;
+
+		pthread_cond_timedwait(&journal.wake, &journal.flush_lock, &t);
+
+		if (!journal.stop && flush_due()) {
+			pthread_mutex_unlock(&journal.flush_lock);
+			journal_commit(p, true);
+			pthread_mutex_lock(&journal.flush_lock);
+		}
+	}
+
+	pthread_mutex_unlock(&journal.flush_lock);
+
+	return NULL;
+}
+
+/**
+ * A commit is due when a quarter of limit is dirty, JOURNAL_BATCH operations wait for
+ * it, or the oldest dirty block is FLUSH_AGE_MS old.
+ */
+bool flush_due()
+{
+	int dirty;
+
+	dirty = __atomic_load_n(&journal.dirty, __ATOMIC_SEQ_CST);
+
+	return (dirty >= journal.limit / 4) || (__atomic_load_n(&journal.ops, __ATOMIC_SEQ_CST) >= JOURNAL_BATCH)
+		|| ((dirty > 0) && (now_ms() - __atomic_load_n(&journal.first, __ATOMIC_SEQ_CST) >= FLUSH_AGE_MS));
+}
+
+long long now_ms()
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (long long) t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+/**
+ * Copies the journaled versions of the blocks in byte range off, len over buf.
+ */
+void journal_read(void *buf, size_t len, off_t off)
+{
+	off_t b;
+	off_t from;
+	off_t to;
+	struct jblock *e;
+	pthread_mutex_t *l;
+
+	for (b = off / journal.bs; b <= (off + (off_t) len - 1) / journal.bs; ++b) {
+		l = &journal.lock[b % JOURNAL_BUCKETS];
+		pthread_mutex_lock(l);
+
+		for (e = journal.bucket[b % JOURNAL_BUCKETS]; (e != NULL) && (e->blk != b); e = e->next)
+			;
+
+		if (e != NULL) {
+			from = (b * journal.bs > off) ? b * journal.bs : off;
+			to = ((b + 1) * journal.bs < off + (off_t) len) ? (b + 1) * journal.bs : off + (off_t) len;
+			memcpy((char *) buf + (from - off), e->data + (from - b * journal.bs), to - from);
+		}
+
+		pthread_mutex_unlock(l);
+	}
+
+	return;
+}
+
+/**
+ * Writes byte range off, len into the journaled copies of its blocks. Blocks without a
+ * copy get one read from the image if add is set, and are skipped otherwise.
+ */
+void journal_write(FILE *p, const void *buf, size_t len, off_t off, bool add)
+{
+	off_t b;
+	off_t from;
+	off_t to;
+	struct jblock *e;
+	pthread_mutex_t *l;
+
+	for (b = off / journal.bs; b <= (off + (off_t) len - 1) / journal.bs; ++b) {
+		l = &journal.lock[b % JOURNAL_BUCKETS];
+		pthread_mutex_lock(l);
+
+		for (e = journal.bucket[b % JOURNAL_BUCKETS]; (e != NULL) && (e->blk != b); e = e->next)
+			;
+
+		if ((e == NULL) && add) {
+			e = (struct jblock *) malloc(sizeof(struct jblock));
+			e->blk = b;
+			e->version = 0;
+			e->data = (char *) malloc(journal.bs);
+
+			if (!disk_read(p, e->data, journal.bs, b * journal.bs)) {
+				memset(e->data, 0, journal.bs);
+			}
+
+			e->next = journal.bucket[b % JOURNAL_BUCKETS];
+			journal.bucket[b % JOURNAL_BUCKETS] = e;
+
+			if (__atomic_add_fetch(&journal.dirty, 1, __ATOMIC_SEQ_CST) == 1) {
+				__atomic_store_n(&journal.first, now_ms(), __ATOMIC_SEQ_CST);
+			}
+		}
+
+		if (e != NULL) {
+			from = (b * journal.bs > off) ? b * journal.bs : off;
+			to = ((b + 1) * journal.bs < off + (off_t) len) ? (b + 1) * journal.bs : off + (off_t) len;
+			memcpy(e->data + (from - b * journal.bs), (const char *) buf + (from - off), to - from);
+			++e->version;
+		}
+
+		pthread_mutex_unlock(l);
+	}
+
+	return;
+}
+
+/**
+ * Commits all journaled blocks: waits for running operations to end and copies the
+ * blocks, then lets operations go on while the copies are written to the journal, synced
+ * and written to their places. With wait false, returns at once if another commit is
+ * running. Returns the number of blocks committed.
+ *
+ * A commit larger than the whole journal can not be atomic; it is written in place
+ * between two syncs, and so is every commit on images without a journal.
+ */
+int journal_commit(FILE *p, bool wait)
+{
+	int i;
+	int k;
+	int n;
+	int max;
+	int cap;
+	int need;
+	int pos;
+	int bs;
+	int n_freed;
+	int *blk;
+	int *freed;
+	unsigned int *version;
+	unsigned int *desc;
+	unsigned int sum;
+	char *data;
+	struct superblock *fsb;
+	struct jblock *e;
+	struct jblock **pe;
+	pthread_mutex_t *l;
+
+	if (!journal.on) {
+		return 0;
+	}
+
+	if (wait) {
+		pthread_mutex_lock(&journal.commit_lock);
+	} else if (pthread_mutex_trylock(&journal.commit_lock) != 0) {
+		return 0;
+	}
+
+	bs = journal.bs;
+
+	pthread_rwlock_wrlock(&journal.ops_lock);
+
+	n = 0;
+	max = __atomic_load_n(&journal.dirty, __ATOMIC_SEQ_CST) + 16;
+	blk = (int *) malloc(max * sizeof(int));
+	version = (unsigned int *) malloc(max * sizeof(unsigned int));
+	data = (char *) malloc((size_t) max * bs);
+
+	for (i = 0; i < JOURNAL_BUCKETS; ++i) {
+		pthread_mutex_lock(&journal.lock[i]);
+
+		for (e = journal.bucket[i]; e != NULL; e = e->next, ++n) {
+			if (n == max) {
+				max *= 2;
+				blk = (int *) realloc(blk, max * sizeof(int));
+				version = (unsigned int *) realloc(version, max * sizeof(unsigned int));
+				data = (char *) realloc(data, (size_t) max * bs);
+			}
+
+			blk[n] = e->blk;
+			version[n] = e->version;
+			memcpy(data + (size_t) n * bs, e->data, bs);
+		}
+
+		pthread_mutex_unlock(&journal.lock[i]);
+	}
+
+	__atomic_store_n(&journal.ops, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&journal.first, now_ms(), __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&journal.free_lock);
+	freed = journal.freed;
+	n_freed = journal.n_freed;
+	fsb = journal.fsb;
+	journal.freed = NULL;
+	journal.n_freed = 0;
+	journal.cap_freed = 0;
+	pthread_mutex_unlock(&journal.free_lock);
+
+	pthread_rwlock_unlock(&journal.ops_lock);
+
+	cap = bs / sizeof(int) - 3;
+	need = n + (n + cap - 1) / cap + 1;
+
+	if (n == 0) {
+		/* nothing to commit */
+	} else if (need > journal.blocks - 1) {
+		image_sync(p);
+
+		for (i = 0; i < n; ++i) {
+			disk_write(p, data + (size_t) i * bs, bs, (off_t) blk[i] * bs);
+		}
+
+		image_sync(p);
+	} else {
+		if (journal.head + need > journal.blocks) {
+			journal_checkpoint(p);
+		}
+
+		desc = (unsigned int *) calloc(1, bs);
+		pos = journal.start + journal.head;
+		sum = jsum(0, NULL, 0);
+
+		for (i = 0; i < n; i += k) {
+			k = (n - i < cap) ? n - i : cap;
+
+			memset(desc, 0, bs);
+			desc[0] = JOURNAL_DESC;
+			desc[1] = journal.seq;
+			desc[2] = k;
+			memcpy(desc + 3, blk + i, k * sizeof(int));
+
+			disk_write(p, desc, bs, (off_t) pos * bs);
+			disk_write(p, data + (size_t) i * bs, (size_t) k * bs, (off_t) (pos + 1) * bs);
+			sum = jsum(sum, (const char *) (blk + i), k * sizeof(int));
+			sum = jsum(sum, data + (size_t) i * bs, (size_t) k * bs);
+			pos += 1 + k;
+		}
+
+		memset(desc, 0, bs);
+		desc[0] = JOURNAL_COMMIT;
+		desc[1] = journal.seq;
+		desc[2] = n;
+		desc[3] = sum;
+		disk_write(p, desc, bs, (off_t) pos * bs);
+		free(desc);
+
+		image_sync(p);
+
+		journal.head = pos + 1 - journal.start;
+		++journal.seq;
+
+		for (i = 0; i < n; ++i) {
+			disk_write(p, data + (size_t) i * bs, bs, (off_t) blk[i] * bs);
+		}
+	}
+
+	for (i = 0; i < n; ++i) {
+		l = &journal.lock[blk[i] % JOURNAL_BUCKETS];
+		pthread_mutex_lock(l);
+
+		for (pe = &journal.bucket[blk[i] % JOURNAL_BUCKETS]; (*pe != NULL) && ((*pe)->blk != blk[i]); pe = &(*pe)->next)
+			;
+
+		e = *pe;
+
+		if ((e != NULL) && (e->version == version[i])) {
+			*pe = e->next;
+			__atomic_add_fetch(&journal.gen, 1, __ATOMIC_SEQ_CST);
+			__atomic_sub_fetch(&journal.dirty, 1, __ATOMIC_SEQ_CST);
+			free(e->data);
+			free(e);
+		}
+
+		pthread_mutex_unlock(l);
+	}
+
+	/* nothing committed points to them any more; the next commit records them as free */
+	for (i = 0; i < n_freed; ++i) {
+		free_block(p, fsb, freed[i]);
+	}
+
+	free(freed);
+	free(blk);
+	free(version);
+	free(data);
+
+	pthread_mutex_unlock(&journal.commit_lock);
+
+	return n;
+}
+
+/**
+ * Syncs the blocks of all commits to their places and starts the journal over. Called
+ * with journal.commit_lock held.
+ */
+void journal_checkpoint(FILE *p)
+{
+	struct journal_header *h;
+
+	if (journal.blocks == 0) {
+		return;
+	}
+
+	h = (struct journal_header *) calloc(1, journal.bs);
+	memcpy(h->magic, JOURNAL_MAGIC, 8);
+	h->seq = journal.seq;
+
+	image_sync(p);
+	disk_write(p, h, journal.bs, (off_t) journal.start * journal.bs);
+	image_sync(p);
+
+	journal.head = 1;
+	free(h);
+
+	return;
+}
+
+/**
+ * Reserves the journal region of a new filesystem, sized 1/64 of the image within
+ * JOURNAL_MIN blocks and JOURNAL_MAX_BYTES, and writes an empty journal to it.
+ */
+void init_journal(FILE *p, struct superblock *sb)
+{
+	int i;
+	struct journal_header *h;
+
+	sb->journal = 2 + sb->freeblocksmap + (sb->n_inodes + sb->inodes - 1) / sb->inodes;
+	sb->journal_blocks = sb->blocks / 64;
+
+	if (sb->journal_blocks > JOURNAL_MAX_BYTES / sb->blocksize) {
+		sb->journal_blocks = JOURNAL_MAX_BYTES / sb->blocksize;
+	}
+
+	if (sb->journal_blocks < JOURNAL_MIN) {
+		sb->journal_blocks = JOURNAL_MIN;
+	}
+
+	for (i = 0; i < sb->journal_blocks; ++i) {
+		use_block(p, sb, sb->journal + i);
+	}
+
+	h = (struct journal_header *) calloc(2, sb->blocksize);
+	memcpy(h->magic, JOURNAL_MAGIC, 8);
+	h->seq = 1;
+	disk_write(p, h, 2 * sb->blocksize, BLOCK_OFF(sb, sb->journal));
+	free(h);
+
+	return;
+}
+
+/**
+ * Writes the blocks of every complete commit in the journal of sb to their places, in
+ * order, and advances the header past them. A commit whose checksum does not match, or
+ * that logs a block outside the image, in the journal, or a superblock that is not one,
+ * ends the replay. Returns the number of commits replayed.
+ */
+int journal_replay(FILE *p, struct superblock *sb)
+{
+	int i;
+	int k;
+	int n;
+	int pos;
+	int from;
+	int total;
+	int cap;
+	int bs;
+	unsigned int seq;
+	unsigned int sum;
+	unsigned int *desc;
+	char *block;
+	struct journal_header *h;
+
+	if (sb->journal_blocks == 0) {
+		return 0;
+	}
+
+	bs = sb->blocksize;
+	cap = bs / sizeof(int) - 3;
+	desc = (unsigned int *) malloc(bs);
+	block = (char *) malloc(bs);
+	h = (struct journal_header *) calloc(1, bs);
+
+	dread(p, h, bs, BLOCK_OFF(sb, sb->journal));
+
+	if (comp_str(h->magic, JOURNAL_MAGIC, 8) != 0) {
+		free(desc);
+		free(block);
+		free(h);
+
+		return 0;
+	}
+
+	seq = h->seq;
+	pos = 1;
+
+	for (n = 0; ; ++n) {
+		/* check that the commit is complete before writing any of it */
+		from = pos;
+		total = 0;
+		sum = jsum(0, NULL, 0);
+
+		while (pos < sb->journal_blocks) {
+			dread(p, desc, bs, BLOCK_OFF(sb, sb->journal + pos));
+			k = (int) desc[2];
+
+			if ((desc[0] != JOURNAL_DESC) || (desc[1] != seq) || (k < 1) || (k > cap)
+					|| (pos + 1 + k > sb->journal_blocks)) {
+				break;
+			}
+
+			sum = jsum(sum, (const char *) (desc + 3), k * sizeof(int));
+
+			for (i = 0; i < k; ++i) {
+				dread(p, block, bs, BLOCK_OFF(sb, sb->journal + pos + 1 + i));
+				sum = jsum(sum, block, bs);
+
+				/* update_sb() logs the superblocks too, but only ever as superblocks */
+				if ((desc[3 + i] >= (unsigned) sb->blocks) || ((desc[3 + i] >= (unsigned) sb->journal)
+						&& (desc[3 + i] < (unsigned) (sb->journal + sb->journal_blocks)))
+						|| ((desc[3 + i] < 2) && (comp_str(block, MAGIC, 8) != 0))) {
+					break;
+				}
+			}
+
+			if (i < k) {
+				break;
+			}
+
+			total += k;
+			pos += 1 + k;
+		}
+
+		if ((pos >= sb->journal_blocks) || (desc[0] != JOURNAL_COMMIT) || (desc[1] != seq) || ((int) desc[2] != total)
+				|| (desc[3] != sum) || (total == 0)) {
+			break;
+		}
+
+		for (pos = from; pos < from + total + (total + cap - 1) / cap; pos += 1 + k) {
+			dread(p, desc, bs, BLOCK_OFF(sb, sb->journal + pos));
+			k = (int) desc[2];
+
+			for (i = 0; i < k; ++i) {
+				dread(p, block, bs, BLOCK_OFF(sb, sb->journal + pos + 1 + i));
+				disk_write(p, block, bs, BLOCK_OFF(sb, desc[3 + i]));
+			}
+		}
+
+		++pos;
+		++seq;
+	}
+
+	if (n > 0) {
+		image_sync(p);
+		h->seq = seq;
+		disk_write(p, h, bs, BLOCK_OFF(sb, sb->journal));
+		image_sync(p);
+
+		printf("\nReplayed %d journal commits.\n", n);
+	}
+
+	free(desc);
+	free(block);
+	free(h);
+
+	return n;
+}
+
+/**
+ * Starts journaling and caching metadata writes to the image of sb, after
+ * journal_replay(), and starts the flusher.
+ */
+void journal_open(FILE *p, struct superblock *sb)
+{
+	struct journal_header h;
+
+	journal.p = p;
+	journal.bs = sb->blocksize;
+	journal.start = sb->journal;
+	journal.blocks = sb->journal_blocks;
+	journal.limit = (journal.blocks > 0) ? journal.blocks : CACHE_BLOCKS;
+	journal.seq = 1;
+	__atomic_store_n(&journal.dirty, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&journal.ops, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&journal.first, now_ms(), __ATOMIC_SEQ_CST);
+	journal.stop = false;
+	journal.csum = sb->csum;
+	journal.csum_blocks = sb->csum_blocks;
+
+	if (journal.blocks > 0) {
+		dread(p, &h, sizeof(h), BLOCK_OFF(sb, sb->journal));
+
+		if (comp_str(h.magic, JOURNAL_MAGIC, 8) == 0) {
+			journal.seq = h.seq + 1;
+		}
+	}
+
+	/* commits left in the region, torn ones included, are all older than seq now */
+	pthread_mutex_lock(&journal.commit_lock);
+	journal_checkpoint(p);
+	pthread_mutex_unlock(&journal.commit_lock);
+
+	journal.on = true;
+	pthread_create(&journal.flusher, NULL, flusher, p);
+
+	return;
+}
+
+/**
+ * Stops the flusher, commits what is left and checkpoints, so the image is complete
+ * without the journal. Called when unmounting, before makefs and remount.
+ */
+void journal_close(FILE *p)
+{
+	if (!journal.on) {
+		return;
+	}
+
+	pthread_mutex_lock(&journal.flush_lock);
+	journal.stop = true;
+	pthread_cond_signal(&journal.wake);
+	pthread_mutex_unlock(&journal.flush_lock);
+	pthread_join(journal.flusher, NULL);
+
+	/* the second commit writes the frees of blocks released before the first */
+	journal_commit(p, true);
+	journal_commit(p, true);
+
+	pthread_mutex_lock(&journal.commit_lock);
+	journal_checkpoint(p);
+	pthread_mutex_unlock(&journal.commit_lock);
+
+	journal.on = false;
+
+	return;
+}
+
+/**
+ * FNV-1a hash of buf, continuing from h; jsum(0, NULL, 0) gives the start value.
+ */
+unsigned int jsum(unsigned int h, const char *buf, size_t len)
+{
+	size_t i;
+
+	if (buf == NULL) {
+		return 2166136261u;
+	}
+
+	for (i = 0; i < len; ++i) {
+		h = (h ^ (unsigned char) buf[i]) * 16777619u;
+	}
+
+	return h;
+}
+
+/**
+ * returns number of blocks reserved for freeblocks map
+ */
+int init_freemap(FILE *p, struct superblock *sb)
+{
+	char *freemap;
+	int freeblocks;
+	int i;
+
+	freeblocks = sb->blocks / (8 * sb->blocksize);
+
+	if ((sb->blocks % (8 * sb->blocksize)) != 0) {
+		++freeblocks;
+	}
+
+	freemap = (char *) calloc(1, sb->blocksize);
+
+	for (i = 0; i < freeblocks; ++i) {
+		dwrite(p, freemap, sb->blocksize, BLOCK_OFF(sb, 2 + i));
+	}
+	free(freemap);
+
+	i = 0;
+	while (i < (freeblocks + 2)) {
+		use_block(p, sb, i);
+		++i;
+	}
+
+	return freeblocks;
+}
+
+/**
+ * Sets i'th block's entry in freemap.
+ * One block holds 8 * blocksize bits.
+ * For i'th block:
+ * 	b: block number
+ * 	m: byte within b'th block number
+ * 	x: bit within m'th byte of b'th block number
+ * 	loc: byte location to be read and written back to
+ */
+void use_block(FILE *p, struct superblock *sb, int i)
+{
+	int b;
+	int m;
+	int x;
+	off_t loc;
+	char a;
+	int tmp; 
+
+	b = i / (8 * sb->blocksize) + 2;
+	m = (i % (8 * sb->blocksize)) / 8;
+	x = (i % (8 * sb->blocksize)) % 8;
+
+	loc = BLOCK_OFF(sb, b) + m;
+
+	dread(p, &a, sizeof(char), loc);
+
+	a ^= (1 << x);
+
+	dwrite(p, &a, sizeof(char), loc);
+
+	tmp = (a >> x) && 1;
+
+	if (DEBUG)
+		printf("\nToggled block %d, byte %d, index %d, byte location: %ld, to %d", b, m, x, (long) loc, tmp);
+
+	return;
+}
+
+/**
+ * use_block(FILE *, int) basically toggles bit using XOR operation, so, freeing a 
+ * used block needs only toggling bit from 1 to 0, which is achieved by using the 
+ * same function. The checksum of the block is cleared.
+ * */
+void free_block(FILE *p, struct superblock *sb, int i)
+{
+	unsigned int c;
+	struct alloc_group *ag;
+
+	ag = &groups[block_group(i)];
+
+	pthread_mutex_lock(&ag->lock);
+	use_block(p, sb, i);
+	if (ag->free_blocks != -1) {
+		++ag->free_blocks;
+	}
+	pthread_mutex_unlock(&ag->lock);
+
+	if (sb->csum_blocks > 0) {
+		c = 0;
+		dwrite(p, &c, sizeof(c), BLOCK_OFF(sb, sb->csum) + (off_t) i * sizeof(c));
+	}
+
+	return;
+}
+
+/**
+ * Drops an owner of data block b, which its block map no longer points to. A block
+ * left without owners is freed after the next commit: until then the block map on disk
+ * still points to it, and a new owner could overwrite it in place (see data_write()).
+ */
+void release_block(FILE *p, struct superblock *sb, int b)
+{
+	int r;
+	pthread_mutex_t *rl;
+
+	rl = &ref_lock[b % REF_LOCKS];
+
+	pthread_mutex_lock(rl);
+	r = get_ref(p, sb, b);
+
+	if (r > 0) {
+		--r;
+		dwrite(p, &r, sizeof(int), BLOCK_OFF(sb, sb->refmap) + (off_t) b * sizeof(int));
+		pthread_mutex_unlock(rl);
+
+		return;
+	}
+
+	pthread_mutex_unlock(rl);
+
+	if (!journal.on) {
+		free_block(p, sb, b);
+
+		return;
+	}
+
+	pthread_mutex_lock(&journal.free_lock);
+
+	if (journal.n_freed == journal.cap_freed) {
+		journal.cap_freed = (journal.cap_freed == 0) ? 64 : journal.cap_freed * 2;
+		journal.freed = (int *) realloc(journal.freed, journal.cap_freed * sizeof(int));
+	}
+
+	journal.freed[journal.n_freed++] = b;
+	journal.fsb = sb;
+	pthread_mutex_unlock(&journal.free_lock);
+
+	return;
+}
+
+/**
+ * Reserves the reference count map of a new filesystem after the journal and zeroes it.
+ * It holds an int for every block, followed by one for every inode (at INODE_REF()),
+ * counting the owners of the block or inode beyond the first.
+ *
+ * Copy-on-write: a snapshot adds an owner to the root node only. Whatever hangs below a
+ * shared node or inode is shared as well, whatever its own count says, so counts are
+ * only exact along a path whose nodes are all private, and are pushed down one level
+ * whenever a shared node, inode or indirect block is copied: the copy owns the same
+ * children, so each of them gains an owner and the original loses one. The live tree
+ * copies the path it changes from the root down (shadow_node(), cow_item(), cow_data()),
+ * and never writes to a block or inode whose count is not 0.
+ */
+void init_refmap(FILE *p, struct superblock *sb)
+{
+	int i;
+	char *zero;
+
+	sb->refmap = sb->journal + sb->journal_blocks;
+	sb->refmap_blocks = ((off_t) sb->blocks + sb->n_inodes) * sizeof(int) / sb->blocksize + 1;
+
+	zero = (char *) calloc(1, sb->blocksize);
+
+	for (i = 0; i < sb->refmap_blocks; ++i) {
+		use_block(p, sb, sb->refmap + i);
+		dwrite(p, zero, sb->blocksize, BLOCK_OFF(sb, sb->refmap + i));
+	}
+
+	free(zero);
+
+	return;
+}
+
+/**
+ * Reserves the dedup index of a new filesystem after the reference count map, one block
+ * for every 1024 blocks, and zeroes it.
+ */
+void init_dedup(FILE *p, struct superblock *sb)
+{
+	int i;
+	char *zero;
+
+	sb->dedup = sb->refmap + sb->refmap_blocks;
+	sb->dedup_blocks = sb->blocks / 1024 + 1;
+
+	zero = (char *) calloc(1, sb->blocksize);
+
+	for (i = 0; i < sb->dedup_blocks; ++i) {
+		use_block(p, sb, sb->dedup + i);
+		dwrite(p, zero, sb->blocksize, BLOCK_OFF(sb, sb->dedup + i));
+	}
+
+	free(zero);
+
+	return;
+}
+
+/**
+ * Reserves the checksum map of a new filesystem after the dedup index and zeroes it. It
+ * holds the CRC32C of every data block (see block_csum()), indexed by block number, set
+ * whenever data_write() writes the block and cleared when it is freed. 0 stands for no
+ * checksum: metadata, free blocks and holes are not checked.
+ */
+void init_csum(FILE *p, struct superblock *sb)
+{
+	int i;
+	char *zero;
+
+	sb->csum = sb->dedup + sb->dedup_blocks;
+	sb->csum_blocks = (off_t) sb->blocks * sizeof(unsigned int) / sb->blocksize + 1;
+
+	zero = (char *) calloc(1, sb->blocksize);
+
+	for (i = 0; i < sb->csum_blocks; ++i) {
+		use_block(p, sb, sb->csum + i);
+		dwrite(p, zero, sb->blocksize, BLOCK_OFF(sb, sb->csum + i));
+	}
+
+	free(zero);
+
+	return;
+}
+
+/**
+ * Fills the table of the portable CRC32C and checks for the SSE4.2 crc32 instruction and
+ * the SHA extensions.
+ */
+void init_hashes()
+{
+	int i;
+	int k;
+	unsigned int c;
+
+	for (i = 0; i < 256; ++i) {
+		c = i;
+
+		for (k = 0; k < 8; ++k) {
+			c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		}
+
+		crc32c_table[i] = c;
+	}
+
+#if defined(__x86_64__)
+	crc32c_hw = __builtin_cpu_supports("sse4.2");
+	sha256_hw = __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+#endif
+
+	return;
+}
+
+/**
+ * CRC32C (Castagnoli) of len bytes, with the crc32 instruction when the CPU has it.
+ */
+unsigned int crc32c(const char *buf, size_t len)
+{
+#if defined(__x86_64__)
+	if (crc32c_hw) {
+		return crc32c_sse42(buf, len);
+	}
+#endif
+
+	return crc32c_sw(buf, len);
+}
+
+unsigned int crc32c_sw(const char *buf, size_t len)
+{
+	size_t i;
+	unsigned int c;
+
+	c = 0xFFFFFFFF;
+
+	for (i = 0; i < len; ++i) {
+		c = crc32c_table[(c ^ (unsigned char) buf[i]) & 0xFF] ^ (c >> 8);
+	}
+
+	return ~c;
+}
+
+#if defined(__x86_64__)
+/**
+ * Eight bytes per crc32 instruction. Compiled for SSE4.2 whatever the build flags, and
+ * only called if the CPU has it.
+ */
+__attribute__((target("sse4.2")))
+unsigned int crc32c_sse42(const char *buf, size_t len)
+{
+	size_t i;
+	unsigned long long w;
+	unsigned long long c;
+
+	c = 0xFFFFFFFF;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&w, buf + i, 8);
+		c = _mm_crc32_u64(c, w);
+	}
+
+	for (; i < len; ++i) {
+		c = _mm_crc32_u8((unsigned int) c, (unsigned char) buf[i]);
+	}
+
+	return ~(unsigned int) c;
+}
+#else
+unsigned int crc32c_sse42(const char *buf, size_t len)
+{
+	return crc32c_sw(buf, len);
+}
+#endif
+
+/**
+ * Checksum of a data block as kept in the checksum map: its CRC32C, never 0, which marks
+ * blocks without one.
+ */
+unsigned int block_csum(const char *block, int bs)
+{
+	unsigned int c;
+
+	c = crc32c(block, bs);
+
+	return (c == 0) ? 0xFFFFFFFF : c;
+}
+
+/**
+ * Updates the checksums of the blocks data_write() wrote len bytes of buf to at off. The
+ * blocks it only wrote part of are read back whole.
+ */
+void set_csums(FILE *p, const char *buf, size_t len, off_t off)
+{
+	off_t b;
+	off_t at;
+	unsigned int c;
+	char block[MAX_BS];
+
+	if (len == 0) {
+		return;
+	}
+
+	for (b = off / journal.bs; b <= (off + (off_t) len - 1) / journal.bs; ++b) {
+		at = b * journal.bs;
+
+		if ((at >= off) && (at + journal.bs <= off + (off_t) len)) {
+			c = block_csum(buf + (at - off), journal.bs);
+		} else {
+			dread(p, block, journal.bs, at);
+			c = block_csum(block, journal.bs);
+		}
+
+		dwrite(p, &c, sizeof(c), (off_t) journal.csum * journal.bs + b * sizeof(c));
+	}
+
+	return;
+}
+
+/**
+ * Returns false if data block b, whose contents were read into block, does not match its
+ * checksum. Blocks without one, and all blocks of images without a checksum map, match.
+ */
+bool check_csum(FILE *p, int b, const char *block)
+{
+	unsigned int c;
+
+	if (journal.csum_blocks == 0) {
+		return true;
+	}
+
+	dread(p, &c, sizeof(c), (off_t) journal.csum * journal.bs + (off_t) b * sizeof(c));
+
+	return (c == 0) || (c == block_csum(block, journal.bs));
+}
+
+void sha256_init(struct sha256 *s)
+{
+	static const unsigned int iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(s->h, iv, sizeof(iv));
+	s->n = 0;
+	s->len = 0;
+
+	return;
+}
+
+/**
+ * Adds len bytes to the hash. Whole 64 byte blocks are hashed straight from buf, only
+ * the bytes left over are buffered.
+ */
+void sha256_update(struct sha256 *s, const void *buf, size_t len)
+{
+	size_t k;
+	const unsigned char *d;
+
+	d = (const unsigned char *) buf;
+	s->len += len;
+
+	if (s->n > 0) {
+		k = (len < (size_t) (64 - s->n)) ? len : (size_t) (64 - s->n);
+		memcpy(s->buf + s->n, d, k);
+		s->n += k;
+		d += k;
+		len -= k;
+
+		if (s->n < 64) {
+			return;
+		}
+
+		sha256_blocks(s->h, s->buf, 1);
+		s->n = 0;
+	}
+
+	if (len >= 64) {
+		sha256_blocks(s->h, d, len / 64);
+		d += len & ~(size_t) 63;
+		len &= 63;
+	}
+
+	memcpy(s->buf, d, len);
+	s->n = len;
+
+	return;
+}
+
+/**
+ * Pads the stream and writes the 32 byte digest to out.
+ */
+void sha256_final(struct sha256 *s, unsigned char *out)
+{
+	int i;
+	unsigned long long bits;
+
+	bits = s->len * 8;
+	s->buf[s->n++] = 0x80;
+
+	if (s->n > 56) {
+		memset(s->buf + s->n, 0, 64 - s->n);
+		sha256_blocks(s->h, s->buf, 1);
+		s->n = 0;
+	}
+
+	memset(s->buf + s->n, 0, 56 - s->n);
+
+	for (i = 0; i < 8; ++i) {
+		s->buf[56 + i] = bits >> (56 - 8 * i);
+	}
+
+	sha256_blocks(s->h, s->buf, 1);
+
+	for (i = 0; i < 32; ++i) {
+		out[i] = s->h[i / 4] >> (24 - 8 * (i % 4));
+	}
+
+	return;
+}
+
+/**
+ * Hashes n 64 byte blocks into h, with the SHA extensions when the CPU has them.
+ */
+void sha256_blocks(unsigned int *h, const unsigned char *data, size_t n)
+{
+#if defined(__x86_64__)
+	if (sha256_hw) {
+		sha256_blocks_shani(h, data, n);
+
+		return;
+	}
+#endif
+
+	sha256_blocks_sw(h, data, n);
+
+	return;
+}
+
+void sha256_blocks_sw(unsigned int *h, const unsigned char *data, size_t n)
+{
+	int i;
+	unsigned int a, b, c, d, e, f, g, hh;
+	unsigned int t1;
+	unsigned int t2;
+	unsigned int w[64];
+
+	for (; n > 0; --n, data += 64) {
+		for (i = 0; i < 16; ++i) {
+			w[i] = ((unsigned int) data[4 * i] << 24) | (data[4 * i + 1] << 16) | (data[4 * i + 2] << 8) | data[4 * i + 3];
+		}
+
+		for (i = 16; i < 64; ++i) {
+			t1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			t2 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			w[i] = w[i - 16] + t2 + w[i - 7] + t1;
+		}
+
+		a = h[0];
+		b = h[1];
+		c = h[2];
+		d = h[3];
+		e = h[4];
+		f = h[5];
+		g = h[6];
+		hh = h[7];
+
+		for (i = 0; i < 64; ++i) {
+			t1 = hh + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+			t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			hh = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+		h[4] += e;
+		h[5] += f;
+		h[6] += g;
+		h[7] += hh;
+	}
+
+	return;
+}
+
+#if defined(__x86_64__)
+/**
+ * Four rounds per step with the SHA extensions. The state is kept as ABEF and CDGH, the
+ * order sha256rnds2 takes it in, and the message schedule in a ring of the last four
+ * groups of four words. Compiled for them whatever the build flags, and only called if
+ * the CPU has them.
+ */
+__attribute__((target("sha,sse4.1")))
+void sha256_blocks_shani(unsigned int *h, const unsigned char *data, size_t n)
+{
+	int i;
+	__m128i t;
+	__m128i s0;
+	__m128i s1;
+	__m128i msg;
+	__m128i save0;
+	__m128i save1;
+	__m128i w[4];
+	const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+	t = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &h[0]), 0xB1);
+	s1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &h[4]), 0x1B);
+	s0 = _mm_alignr_epi8(t, s1, 8);
+	s1 = _mm_blend_epi16(s1, t, 0xF0);
+
+	for (; n > 0; --n, data += 64) {
+		save0 = s0;
+		save1 = s1;
+
+		for (i = 0; i < 16; ++i) {
+			if (i < 4) {
+				w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16 * i)), swap);
+			} else {
+				t = _mm_add_epi32(_mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]),
+						_mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+				w[i & 3] = _mm_sha256msg2_epu32(t, w[(i + 3) & 3]);
+			}
+
+			msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i *) &sha256_k[4 * i]));
+			s1 = _mm_sha256rnds2_epu32(s1, s0, msg);
+			s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(msg, 0x0E));
+		}
+
+		s0 = _mm_add_epi32(s0, save0);
+		s1 = _mm_add_epi32(s1, save1);
+	}
+
+	t = _mm_shuffle_epi32(s0, 0x1B);
+	s1 = _mm_shuffle_epi32(s1, 0xB1);
+	s0 = _mm_blend_epi16(t, s1, 0xF0);
+	s1 = _mm_alignr_epi8(s1, t, 8);
+
+	_mm_storeu_si128((__m128i *) &h[0], s0);
+	_mm_storeu_si128((__m128i *) &h[4], s1);
+
+	return;
+}
+#else
+void sha256_blocks_shani(unsigned int *h, const unsigned char *data, size_t n)
+{
+	sha256_blocks_sw(h, data, n);
+
+	return;
+}
+#endif
+
+/**
+ * Derives len bytes of key from a passphrase with PBKDF2-HMAC-SHA256 (RFC 8018). The
+ * inner and outer HMAC states after the padded key are computed once and copied for every
+ * iteration, so each one costs two compressions.
+ */
+void pbkdf2_sha256(const char *pass, const unsigned char *salt, int salt_len, int iter, unsigned char *out, int len)
+{
+	int i;
+	int j;
+	int c;
+	int n;
+	unsigned char key[64];
+	unsigned char pad[64];
+	unsigned char be[4];
+	unsigned char u[32];
+	unsigned char t[32];
+	struct sha256 inner;
+	struct sha256 outer;
+	struct sha256 h;
+
+	memset(key, 0, sizeof(key));
+
+	if (strlen(pass) > 64) {
+		sha256_init(&h);
+		sha256_update(&h, pass, strlen(pass));
+		sha256_final(&h, key);
+	} else {
+		memcpy(key, pass, strlen(pass));
+	}
+
+	for (j = 0; j < 64; ++j) {
+		pad[j] = key[j] ^ 0x36;
+	}
+
+	sha256_init(&inner);
+	sha256_update(&inner, pad, 64);
+
+	for (j = 0; j < 64; ++j) {
+		pad[j] = key[j] ^ 0x5c;
+	}
+
+	sha256_init(&outer);
+	sha256_update(&outer, pad, 64);
+
+	for (i = 1; len > 0; ++i) {
+		be[0] = i >> 24;
+		be[1] = i >> 16;
+		be[2] = i >> 8;
+		be[3] = i;
+
+		h = inner;
+		sha256_update(&h, salt, salt_len);
+		sha256_update(&h, be, 4);
+		sha256_final(&h, u);
+		h = outer;
+		sha256_update(&h, u, 32);
+		sha256_final(&h, u);
+		memcpy(t, u, 32);
+
+		for (c = 1; c < iter; ++c) {
+			h = inner;
+			sha256_update(&h, u, 32);
+			sha256_final(&h, u);
+			h = outer;
+			sha256_update(&h, u, 32);
+			sha256_final(&h, u);
+
+			for (j = 0; j < 32; ++j) {
+				t[j] ^= u[j];
+			}
+		}
+
+		n = (len < 32) ? len : 32;
+		memcpy(out, t, n);
+		out += n;
+		len -= n;
+	}
+
+	return;
+}
+
+/**
+ * Multiplies a in GF(2^8) by b, for the AES tables.
+ */
+unsigned char gf_mul(unsigned char a, unsigned char b)
+{
+	unsigned char r;
+
+	for (r = 0; b != 0; b >>= 1) {
+		if (b & 1) {
+			r ^= a;
+		}
+
+		a = (a << 1) ^ ((a & 0x80) ? 0x1B : 0);
+	}
+
+	return r;
+}
+
+/**
+ * Builds the AES S-boxes, walking GF(2^8) by powers of 3 and its inverses by powers of
+ * 1/3, and the round tables of the portable implementation from them, and picks the
+ * implementation: VAES, AES-NI or portable.
+ */
+void init_aes()
+{
+	int i;
+	unsigned char p;
+	unsigned char q;
+	unsigned char x;
+	unsigned char v;
+
+	p = 1;
+	q = 1;
+
+	do {
+		p = p ^ (p << 1) ^ ((p & 0x80) ? 0x1B : 0);
+		q ^= q << 1;
+		q ^= q << 2;
+		q ^= q << 4;
+		q ^= (q & 0x80) ? 0x09 : 0;
+		x = q ^ ((q << 1) | (q >> 7)) ^ ((q << 2) | (q >> 6)) ^ ((q << 3) | (q >> 5)) ^ ((q << 4) | (q >> 4));
+		aes_sbox[p] = x ^ 0x63;
+	} while (p != 1);
+
+	aes_sbox[0] = 0x63;
+
+	for (i = 0; i < 256; ++i) {
+		aes_inv_sbox[aes_sbox[i]] = i;
+	}
+
+	for (i = 0; i < 256; ++i) {
+		v = aes_sbox[i];
+		aes_te[i] = ((unsigned int) gf_mul(v, 2) << 24) | (v << 16) | (v << 8) | gf_mul(v, 3);
+		v = aes_inv_sbox[i];
+		aes_td[i] = ((unsigned int) gf_mul(v, 14) << 24) | (gf_mul(v, 9) << 16) | (gf_mul(v, 13) << 8) | gf_mul(v, 11);
+	}
+
+	for (i = 0; i < 256; ++i) {
+		xts_red[i] = 0;
+
+		for (p = 0; p < 8; ++p) {
+			if (i & (1 << p)) {
+				xts_red[i] ^= 0x87 << p;
+			}
+		}
+	}
+
+	cipher.impl = CIPHER_SW;
+
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("aes") && __builtin_cpu_supports("sse4.1")) {
+		cipher.impl = CIPHER_AESNI;
+
+		if (__builtin_cpu_supports("vaes") && __builtin_cpu_supports("avx2")) {
+			cipher.impl = CIPHER_VAES;
+		}
+	}
+#endif
+
+	return;
+}
+
+/**
+ * Expands a 16 byte AES-128 key into the 11 round keys of ek and, unless dk is NULL, the
+ * round keys of the equivalent inverse cipher into dk: in reverse order, with
+ * InvMixColumns applied to the inner ones, as both aes_block() and aesdec take them.
+ */
+void aes_expand(const unsigned char *key, unsigned char *ek, unsigned char *dk)
+{
+	int i;
+	int j;
+	int r;
+	unsigned char rcon;
+	unsigned char t[4];
+	const unsigned char *c;
+
+	memcpy(ek, key, 16);
+	rcon = 1;
+
+	for (i = 16; i < 176; i += 4) {
+		memcpy(t, ek + i - 4, 4);
+
+		if (i % 16 == 0) {
+			t[0] = aes_sbox[ek[i - 3]] ^ rcon;
+			t[1] = aes_sbox[ek[i - 2]];
+			t[2] = aes_sbox[ek[i - 1]];
+			t[3] = aes_sbox[ek[i - 4]];
+			rcon = gf_mul(rcon, 2);
+		}
+
+		for (j = 0; j < 4; ++j) {
+			ek[i + j] = ek[i - 16 + j] ^ t[j];
+		}
+	}
+
+	if (dk == NULL) {
+		return;
+	}
+
+	memcpy(dk, ek + 160, 16);
+	memcpy(dk + 160, ek, 16);
+
+	for (r = 1; r < 10; ++r) {
+		for (j = 0; j < 16; j += 4) {
+			c = ek + 16 * (10 - r) + j;
+			dk[16 * r + j] = gf_mul(c[0], 14) ^ gf_mul(c[1], 11) ^ gf_mul(c[2], 13) ^ gf_mul(c[3], 9);
+			dk[16 * r + j + 1] = gf_mul(c[0], 9) ^ gf_mul(c[1], 14) ^ gf_mul(c[2], 11) ^ gf_mul(c[3], 13);
+			dk[16 * r + j + 2] = gf_mul(c[0], 13) ^ gf_mul(c[1], 9) ^ gf_mul(c[2], 14) ^ gf_mul(c[3], 11);
+			dk[16 * r + j + 3] = gf_mul(c[0], 11) ^ gf_mul(c[1], 13) ^ gf_mul(c[2], 9) ^ gf_mul(c[3], 14);
+		}
+	}
+
+	return;
+}
+
+/**
+ * Portable AES-128 of one 16 byte block with round tables, encrypting with the round keys
+ * rk of aes_expand() if enc is set and decrypting with its inverse round keys otherwise.
+ * in and out may be the same.
+ */
+void aes_block(const unsigned char *rk, bool enc, const unsigned char *in, unsigned char *out)
+{
+	int c;
+	int r;
+	int x;
+	int y;
+	unsigned int s[4];
+	unsigned int t[4];
+	const unsigned int *tab;
+	const unsigned char *box;
+
+	tab = enc ? aes_te : aes_td;
+	box = enc ? aes_sbox : aes_inv_sbox;
+
+	/* columns 1 and 3 ahead swap places when decrypting (InvShiftRows) */
+	x = enc ? 1 : 3;
+	y = enc ? 3 : 1;
+
+	for (c = 0; c < 4; ++c) {
+		s[c] = (((unsigned int) in[4 * c] << 24) | (in[4 * c + 1] << 16) | (in[4 * c + 2] << 8) | in[4 * c + 3]) ^
+				(((unsigned int) rk[4 * c] << 24) | (rk[4 * c + 1] << 16) | (rk[4 * c + 2] << 8) | rk[4 * c + 3]);
+	}
+
+	for (r = 1; r < 10; ++r) {
+		for (c = 0; c < 4; ++c) {
+			t[c] = tab[s[c] >> 24] ^ ROR(tab[(s[(c + x) & 3] >> 16) & 0xFF], 8) ^
+					ROR(tab[(s[(c + 2) & 3] >> 8) & 0xFF], 16) ^ ROR(tab[s[(c + y) & 3] & 0xFF], 24) ^
+					(((unsigned int) rk[16 * r + 4 * c] << 24) | (rk[16 * r + 4 * c + 1] << 16) |
+					(rk[16 * r + 4 * c + 2] << 8) | rk[16 * r + 4 * c + 3]);
+		}
+
+		memcpy(s, t, sizeof(s));
+	}
+
+	for (c = 0; c < 4; ++c) {
+		out[4 * c] = box[s[c] >> 24] ^ rk[160 + 4 * c];
+		out[4 * c + 1] = box[(s[(c + x) & 3] >> 16) & 0xFF] ^ rk[160 + 4 * c + 1];
+		out[4 * c + 2] = box[(s[(c + 2) & 3] >> 8) & 0xFF] ^ rk[160 + 4 * c + 2];
+		out[4 * c + 3] = box[s[(c + y) & 3] & 0xFF] ^ rk[160 + 4 * c + 3];
+	}
+
+	return;
+}
+
+/**
+ * Moves XTS tweak t on by n units, multiplying it by x^n in GF(2^128), a byte at a time:
+ * x^8 times t is t shifted by 8 bits, with the byte shifted out reduced through
+ * xts_red[]. The tweak is little endian (IEEE 1619).
+ */
+void xts_skip(unsigned char *t, int n)
+{
+	int i;
+	unsigned long long lo;
+	unsigned long long hi;
+
+	lo = 0;
+	hi = 0;
+
+	for (i = 7; i >= 0; --i) {
+		lo = (lo << 8) | t[i];
+		hi = (hi << 8) | t[8 + i];
+	}
+
+	for (; n >= 8; n -= 8) {
+		i = hi >> 56;
+		hi = (hi << 8) | (lo >> 56);
+		lo = (lo << 8) ^ xts_red[i];
+	}
+
+	for (; n > 0; --n) {
+		i = hi >> 63;
+		hi = (hi << 1) | (lo >> 63);
+		lo = (lo << 1) ^ (i ? 0x87 : 0);
+	}
+
+	for (i = 0; i < 8; ++i) {
+		t[i] = lo >> (8 * i);
+		t[8 + i] = hi >> (8 * i);
+	}
+
+	return;
+}
+
+/**
+ * Encrypts (enc) or decrypts n 16 byte units of buf in place with XTS, the first one with
+ * tweak t, which is moved on past them.
+ */
+void xts_units(bool enc, unsigned char *buf, int n, unsigned char *t)
+{
+	int i;
+	int j;
+
+#if defined(__x86_64__)
+	if ((cipher.impl == CIPHER_VAES) && (n >= 16)) {
+		xts_units_vaes(enc, buf, n, t);
+
+		return;
+	}
+
+	if (cipher.impl != CIPHER_SW) {
+		xts_units_aesni(enc, buf, n, t);
+
+		return;
+	}
+#endif
+
+	for (i = 0; i < n; ++i, buf += 16) {
+		for (j = 0; j < 16; ++j) {
+			buf[j] ^= t[j];
+		}
+
+		aes_block(enc ? cipher.ek : cipher.dk, enc, buf, buf);
+
+		for (j = 0; j < 16; ++j) {
+			buf[j] ^= t[j];
+		}
+
+		xts_skip(t, 1);
+	}
+
+	return;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("aes,sse4.1")))
+void aes_block_aesni(const unsigned char *rk, const unsigned char *in, unsigned char *out)
+{
+	int r;
+	__m128i x;
+
+	x = _mm_xor_si128(_mm_loadu_si128((const __m128i *) in), _mm_loadu_si128((const __m128i *) rk));
+
+	for (r = 1; r < 10; ++r) {
+		x = _mm_aesenc_si128(x, _mm_loadu_si128((const __m128i *) (rk + 16 * r)));
+	}
+
+	x = _mm_aesenclast_si128(x, _mm_loadu_si128((const __m128i *) (rk + 160)));
+	_mm_storeu_si128((__m128i *) out, x);
+
+	return;
+}
+
+/**
+ * xts_units() with AES-NI, eight units at a time so the rounds of different units
+ * overlap in the pipeline. The tweak is kept as two 64-bit halves.
+ */
+__attribute__((target("aes,sse4.1")))
+void xts_units_aesni(bool enc, unsigned char *buf, int n, unsigned char *t)
+{
+	int i;
+	int j;
+	int m;
+	int r;
+	unsigned long long lo;
+	unsigned long long hi;
+	__m128i k[11];
+	__m128i x[8];
+	__m128i tw[8];
+
+	for (r = 0; r < 11; ++r) {
+		k[r] = _mm_loadu_si128((const __m128i *) ((enc ? cipher.ek : cipher.dk) + 16 * r));
+	}
+
+	memcpy(&lo, t, 8);
+	memcpy(&hi, t + 8, 8);
+
+	for (i = 0; i < n; i += m) {
+		m = (n - i < 8) ? n - i : 8;
+
+		for (j = 0; j < m; ++j) {
+			tw[j] = _mm_set_epi64x(hi, lo);
+			x[j] = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i *) (buf + 16 * (i + j))), tw[j]), k[0]);
+			r = hi >> 63;
+			hi = (hi << 1) | (lo >> 63);
+			lo = (lo << 1) ^ (r ? 0x87 : 0);
+		}
+
+		for (r = 1; r < 10; ++r) {
+			for (j = 0; j < m; ++j) {
+				x[j] = enc ? _mm_aesenc_si128(x[j], k[r]) : _mm_aesdec_si128(x[j], k[r]);
+			}
+		}
+
+		for (j = 0; j < m; ++j) {
+			x[j] = enc ? _mm_aesenclast_si128(x[j], k[10]) : _mm_aesdeclast_si128(x[j], k[10]);
+			_mm_storeu_si128((__m128i *) (buf + 16 * (i + j)), _mm_xor_si128(x[j], tw[j]));
+		}
+	}
+
+	memcpy(t, &lo, 8);
+	memcpy(t + 8, &hi, 8);
+
+	return;
+}
+
+/**
+ * xts_units() with VAES, two units per 256-bit register and sixteen at a time. The units
+ * left over go through xts_units_aesni().
+ */
+__attribute__((target("vaes,avx2,aes,sse4.1")))
+void xts_units_vaes(bool enc, unsigned char *buf, int n, unsigned char *t)
+{
+	int i;
+	int j;
+	int r;
+	unsigned long long lo;
+	unsigned long long hi;
+	unsigned long long tws[32];
+	__m256i k[11];
+	__m256i x[8];
+	__m256i tw[8];
+
+	for (r = 0; r < 11; ++r) {
+		k[r] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) ((enc ? cipher.ek : cipher.dk) + 16 * r)));
+	}
+
+	memcpy(&lo, t, 8);
+	memcpy(&hi, t + 8, 8);
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		for (j = 0; j < 16; ++j) {
+			tws[2 * j] = lo;
+			tws[2 * j + 1] = hi;
+			r = hi >> 63;
+			hi = (hi << 1) | (lo >> 63);
+			lo = (lo << 1) ^ (r ? 0x87 : 0);
+		}
+
+		for (j = 0; j < 8; ++j) {
+			tw[j] = _mm256_loadu_si256((const __m256i *) &tws[4 * j]);
+			x[j] = _mm256_xor_si256(_mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (buf + 16 * i + 32 * j)), tw[j]), k[0]);
+		}
+
+		for (r = 1; r < 10; ++r) {
+			for (j = 0; j < 8; ++j) {
+				x[j] = enc ? _mm256_aesenc_epi128(x[j], k[r]) : _mm256_aesdec_epi128(x[j], k[r]);
+			}
+		}
+
+		for (j = 0; j < 8; ++j) {
+			x[j] = enc ? _mm256_aesenclast_epi128(x[j], k[10]) : _mm256_aesdeclast_epi128(x[j], k[10]);
+			_mm256_storeu_si256((__m256i *) (buf + 16 * i + 32 * j), _mm256_xor_si256(x[j], tw[j]));
+		}
+	}
+
+	memcpy(t, &lo, 8);
+	memcpy(t + 8, &hi, 8);
+
+	if (i < n) {
+		xts_units_aesni(enc, buf + 16 * i, n - i, t);
+	}
+
+	return;
+}
+#else
+void aes_block_aesni(const unsigned char *rk, const unsigned char *in, unsigned char *out)
+{
+	aes_block(rk, true, in, out);
+
+	return;
+}
+
+/* xts_units() takes the portable path on its own here */
+void xts_units_aesni(bool enc, unsigned char *buf, int n, unsigned char *t)
+{
+	xts_units(enc, buf, n, t);
+
+	return;
+}
+
+void xts_units_vaes(bool enc, unsigned char *buf, int n, unsigned char *t)
+{
+	xts_units(enc, buf, n, t);
+
+	return;
+}
+#endif
+
+/**
+ * Encrypts (enc) or decrypts in place len bytes of buf, which sit at byte off of the
+ * image; off and len are multiples of 16. Every block is an XTS data unit whose tweak is
+ * its block number, so any 16 byte unit of it can be encrypted or decrypted on its own.
+ * Blocks 0 and 1, the superblocks, are left in the clear. Units that are all zeroes on
+ * disk were never written (sparse images, the tails of partly written blocks) and are
+ * read as zeroes, as without encryption.
+ */
+void crypt_range(bool enc, char *buf, size_t len, off_t off)
+{
+	int i;
+	int j;
+	int k;
+	int n;
+	int from;
+	off_t b;
+	size_t pos;
+	unsigned long long *u;
+	unsigned char t[16];
+
+	for (pos = 0; pos < len; pos += (size_t) n * 16) {
+		b = (off + (off_t) pos) / cipher.bs;
+		from = ((off + (off_t) pos) % cipher.bs) / 16;
+		n = cipher.bs / 16 - from;
+
+		if ((size_t) n * 16 > len - pos) {
+			n = (len - pos) / 16;
+		}
+
+		if (b < 2) {
+			continue;
+		}
+
+		memset(t, 0, sizeof(t));
+
+		for (i = 0; i < 8; ++i) {
+			t[i] = b >> (8 * i);
+		}
+
+		if (cipher.impl == CIPHER_SW) {
+			aes_block(cipher.tk, true, t, t);
+		} else {
+			aes_block_aesni(cipher.tk, t, t);
+		}
+
+		xts_skip(t, from);
+
+		for (j = 0; j < n; j += k) {
+			u = (unsigned long long *) (buf + pos + 16 * j);
+
+			if (!enc && (u[0] == 0) && (u[1] == 0)) {
+				xts_skip(t, 1);
+				k = 1;
+
+				continue;
+			}
+
+			for (k = 1; (j + k < n) && (enc || (u[2 * k] != 0) || (u[2 * k + 1] != 0)); ++k)
+				;
+
+			xts_units(enc, (unsigned char *) buf + pos + 16 * j, k, t);
+		}
+	}
+
+	return;
+}
+
+/**
+ * Makes sb an encrypted filesystem with the keys derived from pass and a new random salt,
+ * and starts encrypting with them. Returns false if no salt could be had.
+ */
+bool cipher_create(struct superblock *sb, const char *pass)
+{
+	unsigned char key[48];
+
+	if (getrandom(sb->kdf_salt, sizeof(sb->kdf_salt), 0) != sizeof(sb->kdf_salt)) {
+		printf("\nCan not get random bytes for the key.");
+
+		return false;
+	}
+
+	sb->cipher = 1;
+	sb->kdf_iter = KDF_ITER;
+	pbkdf2_sha256(pass, sb->kdf_salt, sizeof(sb->kdf_salt), sb->kdf_iter, key, sizeof(key));
+	memcpy(sb->key_check, key + 32, 16);
+
+	cipher.bs = sb->blocksize;
+	aes_expand(key, cipher.ek, cipher.dk);
+	aes_expand(key + 16, cipher.tk, NULL);
+	cipher.on = true;
+
+	return true;
+}
+
+/**
+ * Sets up the encryption of the image of sb at mount, with the passphrase in the
+ * environment variable FS1_KEY. Returns false if the image is encrypted and the
+ * passphrase is missing or wrong.
+ */
+bool cipher_open(struct superblock *sb)
+{
+	char *pass;
+	unsigned char key[48];
+
+	cipher.on = false;
+
+	if (sb->cipher == 0) {
+		return true;
+	}
+
+	pass = getenv("FS1_KEY");
+
+	if (pass == NULL) {
+		printf("\nThe image is encrypted. Set FS1_KEY to its passphrase.");
+
+		return false;
+	}
+
+	pbkdf2_sha256(pass, sb->kdf_salt, sizeof(sb->kdf_salt), sb->kdf_iter, key, sizeof(key));
+
+	if (memcmp(key + 32, sb->key_check, 16) != 0) {
+		printf("\nWrong passphrase for the image.");
+
+		return false;
+	}
+
+	cipher.bs = sb->blocksize;
+	aes_expand(key, cipher.ek, cipher.dk);
+	aes_expand(key + 16, cipher.tk, NULL);
+	cipher.on = true;
+
+	return true;
+}
+
+/**
+ * Returns the owners beyond the first of block i, or of inode i - sb->blocks. Always 0
+ * before the first snapshot.
+ */
+int get_ref(FILE *p, struct superblock *sb, int i)
+{
+	int r;
+
+	if (sb->shared == 0) {
+		return 0;
+	}
+
+	dread(p, &r, sizeof(int), BLOCK_OFF(sb, sb->refmap) + (off_t) i * sizeof(int));
+
+	return r;
+}
+
+void add_ref(FILE *p, struct superblock *sb, int i, int delta)
+{
+	int r;
+	off_t off;
+	pthread_mutex_t *rl;
+
+	off = BLOCK_OFF(sb, sb->refmap) + (off_t) i * sizeof(int);
+	rl = &ref_lock[i % REF_LOCKS];
+
+	pthread_mutex_lock(rl);
+	dread(p, &r, sizeof(int), off);
+	r += delta;
+	dwrite(p, &r, sizeof(int), off);
+	pthread_mutex_unlock(rl);
+
+	return;
+}
+
+int get_node(FILE *p, struct superblock *sb)
+{
+	int fb;
+	int i;
+	struct node nn;
+
+	fb = alloc_block(p, sb, home_group());
+
+	if (fb == -1) {
+		return -1;
+	}
+
+	nn.parent = -1;
+	nn.isLeaf = 0;
+	nn.size = 0;
+	nn.left = -1;
+	nn.right = -1;
+
+	for (i = 0; i < NODE_KEYS(sb->blocksize); ++i) {
+		nn.key[i].dir_id = -1;
+		nn.key[i].id = -1;
+		nn.link[i] = -1;
+	}
+
+	nn.link[NODE_KEYS(sb->blocksize)] = -1;
+
+	write_node(p, sb, fb, &nn);
+
+	return fb;
+}
+
+/**
+ * Node reader and writer for one block size. Key count and link offset are compile time
+ * constants in each generated function, and for MAX_BS the block is struct node itself.
+ */
+#define DEFINE_NODE_IO(BSZ)								\
+void read_node_##BSZ(FILE *p, int loc, struct node *n)					\
+{											\
+	char buf[BSZ];									\
+											\
+	if (BSZ == MAX_BS) {								\
+		dread(p, n, sizeof(struct node), (off_t) loc * BSZ);			\
+											\
+		return;									\
+	}										\
+											\
+	dread(p, buf, BSZ, (off_t) loc * BSZ);						\
+	memcpy(n, buf, 12 + NODE_KEYS(BSZ) * sizeof(struct Key));			\
+	memcpy(n->link, buf + NODE_LINKS_AT(BSZ), (NODE_KEYS(BSZ) + 1) * sizeof(int));	\
+	memcpy(&n->left, buf + NODE_LINKS_AT(BSZ) + (NODE_KEYS(BSZ) + 1) * sizeof(int),	\
+			2 * sizeof(int));						\
+}											\
+											\
+void write_node_##BSZ(FILE *p, int loc, struct node *n)				\
+{											\
+	char buf[BSZ];									\
+											\
+	if (BSZ == MAX_BS) {								\
+		dwrite(p, n, sizeof(struct node), (off_t) loc * BSZ);			\
+											\
+		return;									\
+	}										\
+											\
+	memset(buf, 0, BSZ);								\
+	memcpy(buf, n, 12 + NODE_KEYS(BSZ) * sizeof(struct Key));			\
+	memcpy(buf + NODE_LINKS_AT(BSZ), n->link, (NODE_KEYS(BSZ) + 1) * sizeof(int));	\
+	memcpy(buf + NODE_LINKS_AT(BSZ) + (NODE_KEYS(BSZ) + 1) * sizeof(int), &n->left,	\
+			2 * sizeof(int));						\
+	dwrite(p, buf, BSZ, (off_t) loc * BSZ);						\
+}
+
+DEFINE_NODE_IO(4096)
+DEFINE_NODE_IO(16384)
+DEFINE_NODE_IO(65536)
+
+void read_node(FILE *p, struct superblock *sb, int loc, struct node *n)
+{
+	switch (sb->blocksize) {
+		case 4096: read_node_4096(p, loc, n);
+			break;
+		case 16384: read_node_16384(p, loc, n);
+			break;
+		default: read_node_65536(p, loc, n);
+			break;
+	};
+
+	return;
+}
+
+void write_node(FILE *p, struct superblock *sb, int loc, struct node *n)
+{
+	switch (sb->blocksize) {
+		case 4096: write_node_4096(p, loc, n);
+			break;
+		case 16384: write_node_16384(p, loc, n);
+			break;
+		default: write_node_65536(p, loc, n);
+			break;
+	};
+
+	return;
+}
+
+/**
+ * Takes the latch of node blk, for writing if write is 1, else for reading.
+ */
+struct latch *latch(int blk, int write)
+{
+	int b;
+	struct latch *l;
+
+	b = blk % LATCH_BUCKETS;
+
+	pthread_mutex_lock(&latch_lock[b]);
+
+	for (l = latches[b]; l != NULL; l = l->next) {
+		if (l->blk == blk) {
+			break;
+		}
+	}
+
+	if (l == NULL) {
+		l = (struct latch *) malloc(sizeof(struct latch));
+		l->blk = blk;
+		l->users = 0;
+		pthread_rwlock_init(&l->rw, NULL);
+		l->next = latches[b];
+		latches[b] = l;
+	}
+
+	++l->users;
+
+	pthread_mutex_unlock(&latch_lock[b]);
+
+	if (write == 1) {
+		pthread_rwlock_wrlock(&l->rw);
+	} else {
+		pthread_rwlock_rdlock(&l->rw);
+	}
+
+	return l;
+}
+
+void unlatch(struct latch *l)
+{
+	int b;
+	struct latch **pp;
+
+	b = l->blk % LATCH_BUCKETS;
+
+	pthread_rwlock_unlock(&l->rw);
+
+	pthread_mutex_lock(&latch_lock[b]);
+
+	if (--l->users == 0) {
+		for (pp = &latches[b]; *pp != l; pp = &(*pp)->next)
+			;
+		*pp = l->next;
+		pthread_rwlock_destroy(&l->rw);
+		free(l);
+	}
+
+	pthread_mutex_unlock(&latch_lock[b]);
+
+	return;
+}
+
+/**
+ * Inserts key (dir_id, id) pointing to inode block into the B+ tree.
+ * The first attempt is optimistic: internal nodes are only read latched, and the key goes in
+ * if the leaf has room. Otherwise it is retried pessimistically, write latching the path.
+ */
+void insert(FILE *p, int id, int dir_id, int block, struct superblock *sb)
+{
+	struct Key k;
+
+	k.dir_id = dir_id;
+	k.id = id;
+
+	if (insert_optimistic(p, sb, k, block) == false) {
+		insert_pessimistic(p, sb, k, block);
+	}
+
+	return;
+}
+
+/**
+ * Returns index of the child of internal node n which covers key k.
+ */
+int child_index(struct node *n, struct Key *k)
+{
+	int i;
+
+	for (i = 0; i < n->size; ++i) {
+		if (comparator((void *)k, (void *)&n->key[i]) < 0) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+/**
+ * Puts k and its link into leaf n, which must have room for it.
+ */
+void leaf_put(struct node *n, struct Key k, int block)
+{
+	int i;
+	int j;
+
+	for (i = 0; i < n->size; ++i) {
+		if (comparator((void *)&k, (void *)&n->key[i]) < 0) {
+			break;
+		}
+	}
+
+	for (j = n->size; j > i; --j) {
+		n->key[j] = n->key[j-1];
+		n->link[j] = n->link[j-1];
+	}
+
+	n->key[i] = k;
+	n->link[i] = block;
+	++n->size;
+
+	return;
+}
+
+/**
+ * Descends with read latches, each released once the child is latched (latch crabbing).
+ * The leaf is latched for writing while its parent (or the shard latch) is still read latched,
+ * so no split can move k out of it meanwhile. Returns false, with nothing changed, if the
+ * tree is empty, the leaf is full or a node on the path is shared with a snapshot, in
+ * which case the caller has to go pessimistic.
+ */
+bool insert_optimistic(FILE *p, struct superblock *sb, struct Key k, int block)
+{
+	int curr;
+	struct node n;
+	struct latch *parent;
+	struct latch *l;
+	struct shard *sh;
+
+	sh = dir_shard(k.dir_id);
+	pthread_rwlock_rdlock(&sh->latch);
+
+	if (*shard_root(sb, sh) == -1) {
+		pthread_rwlock_unlock(&sh->latch);
+
+		return false;
+	}
+
+	parent = NULL;
+	curr = *shard_root(sb, sh);
+
+	while (1) {
+		l = latch(curr, 0);
+		read_node(p, sb, curr, &n);
+
+		if (n.isLeaf == 1) {
+			unlatch(l);
+			l = latch(curr, 1);
+			read_node(p, sb, curr, &n);
+		}
+
+		if (parent == NULL) {
+			pthread_rwlock_unlock(&sh->latch);
+		} else {
+			unlatch(parent);
+		}
+
+		if (get_ref(p, sb, curr) > 0) {
+			unlatch(l);
+
+			return false;
+		}
+
+		if (n.isLeaf == 1) {
+			break;
+		}
+
+		parent = l;
+		curr = n.link[child_index(&n, &k)];
+	}
+
+	if (n.size >= NODE_KEYS(sb->blocksize)) {
+		unlatch(l);
+
+		return false;
+	}
+
+	leaf_put(&n, k, block);
+	write_node(p, sb, curr, &n);
+	unlatch(l);
+
+	if (DEBUG)
+		printf("\nIncremented size to %d", n.size);
+
+	return true;
+}
+
+/**
+ * Descends with write latches. Whenever a node has room for one more key, no split can
+ * propagate above it, so the latches of its ancestors (and the shard latch) are released.
+ * The latches still held when the leaf is reached cover every node the split touches.
+ * Nodes shared with a snapshot are shadowed on the way down, while the latch of their
+ * parent (or the shard latch) is still held, as that is where the copy gets linked.
+ */
+void insert_pessimistic(FILE *p, struct superblock *sb, struct Key k, int block)
+{
+	int i;
+	int depth;
+	int curr;
+	int top;
+	int r;
+	int copy;
+	bool root_held;
+	int path[MAX_DEPTH];
+	struct latch *held[MAX_DEPTH];
+	struct node n;
+	struct Key sep;
+	struct shard *sh;
+
+	sh = dir_shard(k.dir_id);
+	pthread_rwlock_wrlock(&sh->latch);
+	root_held = true;
+
+	if (*shard_root(sb, sh) == -1) {
+		curr = get_node(p, sb);
+
+		if (curr == -1) {
+			err_noblocks();
+			pthread_rwlock_unlock(&sh->latch);
+
+			return;
+		}
+
+		read_node(p, sb, curr, &n);
+
+		n.parent = -1;
+		n.isLeaf = 1;
+		n.size = 1;
+		n.key[0] = k;
+		n.link[0] = block;
+		n.left = -1;
+		n.right = -1;
+
+		write_node(p, sb, curr, &n);
+
+		set_root(p, sb, sh, curr);
+
+		pthread_rwlock_unlock(&sh->latch);
+
+		return;
+	}
+
+	curr = *shard_root(sb, sh);
+	depth = 0;
+	top = 0;
+
+	while (1) {
+		if (DEBUG) {
+			printf("\n\tSearching for leaf...");
+		}
+
+		held[depth] = latch(curr, 1);
+		path[depth] = curr;
+		read_node(p, sb, curr, &n);
+
+		if (get_ref(p, sb, curr) > 0) {
+			copy = shadow_node(p, sb, curr, &n);
+
+			if (copy == -1) {
+				for (i = top; i <= depth; ++i) {
+					unlatch(held[i]);
+				}
+
+				if (root_held) {
+					pthread_rwlock_unlock(&sh->latch);
+				}
+
+				return;
+			}
+
+			relink(p, sb, (depth == 0) ? -1 : path[depth - 1], curr, copy);
+			unlatch(held[depth]);
+			held[depth] = latch(copy, 1);
+			path[depth] = copy;
+			curr = copy;
+		}
+
+		++depth;
+
+		if (n.size < NODE_KEYS(sb->blocksize)) {
+			for (i = top; i < depth - 1; ++i) {
+				unlatch(held[i]);
+			}
+			top = depth - 1;
+
+			if (root_held) {
+				pthread_rwlock_unlock(&sh->latch);
+				root_held = false;
+			}
+		}
+
+		if ((n.isLeaf == 1) || (depth == MAX_DEPTH)) {
+			break;
+		}
+
+		curr = n.link[child_index(&n, &k)];
+	}
+
+	if (n.size < NODE_KEYS(sb->blocksize)) {
+		leaf_put(&n, k, block);
+		write_node(p, sb, curr, &n);
+	} else {
+		r = split_leaf(p, sb, curr, &n, k, block, &sep);
+
+		if (r != -1) {
+			promote(sep, r, path, depth - 1, p, sb);
+		}
+	}
+
+	for (i = top; i < depth; ++i) {
+		unlatch(held[i]);
+	}
+
+	if (root_held) {
+		pthread_rwlock_unlock(&sh->latch);
+	}
+
+	return;
+}
+
+/**
+ * Splits full leaf n at block curr while adding k to it. n keeps the lower half in place and
+ * a new right sibling gets the upper half. The old right sibling may be shared with a
+ * snapshot, so it is not written, and its left link goes stale. Returns the new sibling and
+ * its first key in sep, or -1 if no block was left.
+ */
+int split_leaf(FILE *p, struct superblock *sb, int curr, struct node *n, struct Key k, int block, struct Key *sep)
+{
+	int i;
+	int j;
+	int r;
+	int half;
+	int total;
+	struct Key *keys;
+	int *links;
+	struct node tmp;
+
+	r = get_node(p, sb);
+
+	if (r == -1) {
+		err_noblocks();
+
+		return -1;
+	}
+
+	read_node(p, sb, r, &tmp);
+
+	/* n is full, so the merged keys can not be put into n itself */
+	keys = (struct Key *) malloc((n->size + 1) * sizeof(struct Key));
+	links = (int *) malloc((n->size + 1) * sizeof(int));
+
+	for (i = 0, j = 0; i < n->size; ++i, ++j) {
+		if ((i == j) && (comparator((void *)&k, (void *)&n->key[i]) < 0)) {
+			keys[j] = k;
+			links[j] = block;
+			++j;
+		}
+		keys[j] = n->key[i];
+		links[j] = n->link[i];
+	}
+
+	if (i == j) {
+		keys[j] = k;
+		links[j] = block;
+	}
+
+	total = n->size + 1;
+	half = total / 2;
+
+	for (i = 0; i < half; ++i) {
+		n->key[i] = keys[i];
+		n->link[i] = links[i];
+	}
+
+	for (i = half, j = 0; i < total; ++i, ++j) {
+		tmp.key[j] = keys[i];
+		tmp.link[j] = links[i];
+	}
+
+	free(keys);
+	free(links);
+
+	tmp.size = j;
+	tmp.isLeaf = 1;
+	tmp.parent = n->parent;
+	tmp.left = curr;
+	tmp.right = n->right;
+	n->size = half;
+	n->right = r;
+
+	write_node(p, sb, r, &tmp);
+	write_node(p, sb, curr, n);
+
+	if (DEBUG) {
+		inorder(p, sb, curr);
+		inorder(p, sb, r);
+	}
+
+	*sep = tmp.key[0];
+
+	return r;
+}
+
+/**
+ * Copies shared node n, read from block curr, to a new block the live tree can change.
+ * The copy owns the children (or the inodes) of n as well, so each of them gains an owner,
+ * and curr loses one. Returns the new block, or -1 if none was left; the caller links it
+ * in place of curr with relink().
+ */
+int shadow_node(FILE *p, struct superblock *sb, int curr, struct node *n)
+{
+	int i;
+	int copy;
+
+	copy = alloc_block(p, sb, home_group());
+
+	if (copy == -1) {
+		err_noblocks();
+
+		return -1;
+	}
+
+	if (n->isLeaf == 1) {
+		for (i = 0; i < n->size; ++i) {
+			add_ref(p, sb, INODE_REF(sb, n->link[i]), 1);
+		}
+	} else {
+		for (i = 0; i <= n->size; ++i) {
+			add_ref(p, sb, n->link[i], 1);
+		}
+	}
+
+	add_ref(p, sb, curr, -1);
+	write_node(p, sb, copy, n);
+
+	return copy;
+}
+
+/**
+ * Replaces the link to node old in node parent by copy, or the root of the tree old is the
+ * root of if parent is -1. parent, or the latch of that shard, has to be write latched.
+ */
+void relink(FILE *p, struct superblock *sb, int parent, int old, int copy)
+{
+	int i;
+	struct node n;
+
+	if (parent == -1) {
+		for (i = 0; (i < n_shards - 1) && (*shard_root(sb, &shards[i]) != old); ++i)
+			;
+
+		set_root(p, sb, &shards[i], copy);
+
+		return;
+	}
+
+	read_node(p, sb, parent, &n);
+
+	for (i = 0; (i < n.size) && (n.link[i] != old); ++i)
+		;
+
+	n.link[i] = copy;
+	write_node(p, sb, parent, &n);
+
+	return;
+}
+
+/**
+ * Descends to the leaf that holds key k with write latches, each released once the child
+ * is private, shadowing the shared nodes on the way. Returns the write latch of the leaf,
+ * with its block number in loc and its contents in n, or NULL if the tree is empty or no
+ * block was left for a copy.
+ */
+struct latch *cow_leaf(FILE *p, struct superblock *sb, struct Key k, int *loc, struct node *n)
+{
+	int curr;
+	int parent;
+	int copy;
+	struct latch *l;
+	struct latch *pl;
+	struct shard *sh;
+
+	sh = dir_shard(k.dir_id);
+	pthread_rwlock_wrlock(&sh->latch);
+
+	curr = *shard_root(sb, sh);
+	parent = -1;
+	pl = NULL;
+
+	while (curr != -1) {
+		l = latch(curr, 1);
+		read_node(p, sb, curr, n);
+
+		if (get_ref(p, sb, curr) > 0) {
+			copy = shadow_node(p, sb, curr, n);
+
+			if (copy != -1) {
+				relink(p, sb, parent, curr, copy);
+			}
+
+			unlatch(l);
+			l = (copy == -1) ? NULL : latch(copy, 1);
+			curr = copy;
+		}
+
+		if (pl == NULL) {
+			pthread_rwlock_unlock(&sh->latch);
+		} else {
+			unlatch(pl);
+		}
+
+		if ((l == NULL) || (n->isLeaf == 1)) {
+			*loc = curr;
+
+			return l;
+		}
+
+		parent = curr;
+		pl = l;
+		curr = n->link[child_index(n, &k)];
+	}
+
+	pthread_rwlock_unlock(&sh->latch);
+
+	return NULL;
+}
+
+/**
+ * Makes the file or directory whose inode is inode_loc private to the live tree before it
+ * is changed: the path to its leaf is shadowed, and a shared inode is replaced by a copy
+ * with a copy of the stat block, whose block pointers gain an owner each. Returns the
+ * inode of the item in the live tree now, which differs from inode_loc if it was copied
+ * (here or by another thread), or -1 if the item is gone or no space was left.
+ */
+int cow_item(FILE *p, struct superblock *sb, int inode_loc)
+{
+	int i;
+	int j;
+	int curr;
+	int copy;
+	int stat_loc;
+	struct inode in;
+	struct item_stat s;
+	struct node n;
+	struct latch *l;
+
+	if (sb->shared == 0) {
+		return inode_loc;
+	}
+
+	dread(p, &in, sizeof(struct inode), INODE_OFF(sb, inode_loc));
+	dread(p, &s, sizeof(struct item_stat), BLOCK_OFF(sb, in.f[0]));
+
+	l = cow_leaf(p, sb, s.k, &curr, &n);
+
+	if (l == NULL) {
+		return -1;
+	}
+
+	for (i = 0; (i < n.size) && (comparator((void *)&n.key[i], (void *)&s.k) != 0); ++i)
+		;
+
+	if ((i == n.size) || (n.link[i] != inode_loc) || (get_ref(p, sb, INODE_REF(sb, inode_loc)) == 0)) {
+		copy = (i == n.size) ? -1 : n.link[i];
+		unlatch(l);
+
+		return copy;
+	}
+
+	copy = get_inode(p, sb, inode_group(inode_loc));
+	stat_loc = (copy == -1) ? -1 : alloc_block(p, sb, inode_group(copy));
+
+	if (stat_loc == -1) {
+		if (copy != -1) {
+			memset(&in, -1, sizeof(struct inode));
+			dwrite(p, &in, sizeof(struct inode), INODE_OFF(sb, copy));
+		}
+
+		err_noblocks();
+		unlatch(l);
+
+		return -1;
+	}
+
+	s.inode = copy;
+	dwrite(p, &s, sizeof(struct item_stat), BLOCK_OFF(sb, stat_loc));
+
+	in.f[0] = stat_loc;
+
+	for (j = 1; j < 16; ++j) {
+		if (in.f[j] >= 0) {
+			add_ref(p, sb, in.f[j], 1);
+		}
+	}
+
+	dwrite(p, &in, sizeof(struct inode), INODE_OFF(sb, copy));
+	add_ref(p, sb, INODE_REF(sb, inode_loc), -1);
+
+	n.link[i] = copy;
+	write_node(p, sb, curr, &n);
+	unlatch(l);
+
+	return copy;
+}
+
+/**
+ * Takes key k out of the B+ tree. Returns the inode it pointed to, or -1 if k is not in
+ * the tree or no block was left for a copy. Like insert_pessimistic(), the path is write
+ * latched from the shard latch down and shared nodes are shadowed on the way, but every
+ * latch is kept to the end, as a node left empty takes its parent along. Leaves are not
+ * merged and may run low on keys; only an empty one is unlinked (see drop_node()), so
+ * scans never meet a leaf without keys.
+ */
+int remove_key(FILE *p, struct superblock *sb, struct Key k)
+{
+	int i;
+	int depth;
+	int curr;
+	int copy;
+	int ret;
+	int path[MAX_DEPTH];
+	struct latch *held[MAX_DEPTH];
+	struct node n;
+	struct shard *sh;
+
+	sh = dir_shard(k.dir_id);
+	pthread_rwlock_wrlock(&sh->latch);
+
+	curr = *shard_root(sb, sh);
+	depth = 0;
+	ret = -1;
+
+	while (curr != -1) {
+		held[depth] = latch(curr, 1);
+		path[depth] = curr;
+		read_node(p, sb, curr, &n);
+		++depth;
+
+		if (get_ref(p, sb, curr) > 0) {
+			copy = shadow_node(p, sb, curr, &n);
+
+			if (copy == -1) {
+				curr = -1;
+
+				break;
+			}
+
+			relink(p, sb, (depth == 1) ? -1 : path[depth - 2], curr, copy);
+			unlatch(held[depth - 1]);
+			held[depth - 1] = latch(copy, 1);
+			path[depth - 1] = copy;
+			curr = copy;
+		}
+
+		if ((n.isLeaf == 1) || (depth == MAX_DEPTH)) {
+			break;
+		}
+
+		curr = n.link[child_index(&n, &k)];
+	}
+
+	if ((curr != -1) && (n.isLeaf == 1)) {
+		for (i = 0; (i < n.size) && (comparator((void *)&n.key[i], (void *)&k) != 0); ++i)
+			;
+
+		if (i < n.size) {
+			ret = n.link[i];
+
+			for (; i < n.size - 1; ++i) {
+				n.key[i] = n.key[i + 1];
+				n.link[i] = n.link[i + 1];
+			}
+
+			if (--n.size == 0) {
+				drop_node(p, sb, k, path, depth - 1);
+			} else {
+				write_node(p, sb, curr, &n);
+			}
+		}
+	}
+
+	for (i = 0; i < depth; ++i) {
+		unlatch(held[i]);
+	}
+
+	pthread_rwlock_unlock(&sh->latch);
+
+	return ret;
+}
+
+/**
+ * Unlinks node path[depth] of the tree of key k, a leaf without keys or an internal node
+ * without children, from its parent and frees it once the change is committed. A parent
+ * left without children goes the same way, and a root left with one child is replaced by
+ * it. path holds private nodes from the root down, all write latched with the shard latch.
+ */
+void drop_node(FILE *p, struct superblock *sb, struct Key k, int *path, int depth)
+{
+	int i;
+	struct node n;
+
+	release_block(p, sb, path[depth]);
+
+	if (depth == 0) {
+		set_root(p, sb, dir_shard(k.dir_id), -1);
+
+		return;
+	}
+
+	read_node(p, sb, path[depth - 1], &n);
+
+	if (n.size == 0) {
+		drop_node(p, sb, k, path, depth - 1);
+
+		return;
+	}
+
+	for (i = 0; (i < n.size) && (n.link[i] != path[depth]); ++i)
+		;
+
+	/* the keys of the children on either side of it still fall between their separators */
+	for (; i < n.size; ++i) {
+		n.key[(i == 0) ? 0 : i - 1] = n.key[i];
+		n.link[i] = n.link[i + 1];
+	}
+
+	--n.size;
+
+	if ((depth == 1) && (n.size == 0)) {
+		release_block(p, sb, path[0]);
+		set_root(p, sb, dir_shard(k.dir_id), n.link[0]);
+
+		return;
+	}
+
+	write_node(p, sb, path[depth - 1], &n);
+
+	return;
+}
+
+/**
+ * Takes every key of directory dir_id out of the tree in one pass over the leaves that
+ * hold them (see prune()), and adds the inodes they pointed to to rs. The shard latch is
+ * write locked meanwhile. Afterwards a root left with a single child is replaced by it.
+ */
+void remove_range(FILE *p, struct superblock *sb, unsigned dir_id, struct rm_state *rs)
+{
+	int root;
+	struct node n;
+	struct shard *sh;
+
+	sh = dir_shard(dir_id);
+	pthread_rwlock_wrlock(&sh->latch);
+
+	root = *shard_root(sb, sh);
+
+	if ((root != -1) && (prune(p, sb, dir_id, -1, &root, rs) == 0)) {
+		set_root(p, sb, sh, -1);
+	} else if (root != -1) {
+		read_node(p, sb, root, &n);
+
+		/* only a private root; a shared one still owns its child for the live tree */
+		while ((n.isLeaf == 0) && (n.size == 0) && (get_ref(p, sb, root) == 0)) {
+			release_block(p, sb, root);
+			root = n.link[0];
+			set_root(p, sb, sh, root);
+			read_node(p, sb, root, &n);
+		}
+	}
+
+	pthread_rwlock_unlock(&sh->latch);
+
+	return;
+}
+
+/**
+ * Takes the keys of directory dir_id out of the subtree of node *loc, whose parent is
+ * parent (-1 for a root), and adds the inodes they pointed to to rs. Keys of a directory
+ * are next to each other, so only the children whose separators let them hold dir_id
+ * are visited, and the leaves between the first and the last one are dropped whole.
+ * Visited nodes are write latched, and shadowed (with *loc set to the copy) if shared
+ * with a snapshot. Children left empty are unlinked, and the leaves around the cut are
+ * merged where they fit in one, once all keys are out. Returns the keys (of a leaf) or
+ * the children (of an internal node) left; a node left with none is freed, and the
+ * caller unlinks it.
+ */
+int prune(FILE *p, struct superblock *sb, unsigned dir_id, int parent, int *loc, struct rm_state *rs)
+{
+	int i;
+	int j;
+	int lo;
+	int hi;
+	int first;
+	int last;
+	int copy;
+	int *left;
+	struct node n;
+	struct latch *l;
+
+	l = latch(*loc, 1);
+	read_node(p, sb, *loc, &n);
+
+	if (get_ref(p, sb, *loc) > 0) {
+		copy = shadow_node(p, sb, *loc, &n);
+
+		if (copy == -1) {
+			unlatch(l);
+
+			return (n.isLeaf == 1) ? n.size : n.size + 1;
+		}
+
+		relink(p, sb, parent, *loc, copy);
+		unlatch(l);
+		l = latch(copy, 1);
+		*loc = copy;
+	}
+
+	if (n.isLeaf == 1) {
+		for (i = 0, j = 0; i < n.size; ++i) {
+			if (n.key[i].dir_id == dir_id) {
+				list_add(&rs->items, &rs->n_items, &rs->cap_items, n.link[i]);
+			} else {
+				n.key[j] = n.key[i];
+				n.link[j] = n.link[i];
+				++j;
+			}
+		}
+
+		if (j == 0) {
+			release_block(p, sb, *loc);
+		} else if (j < n.size) {
+			n.size = j;
+			write_node(p, sb, *loc, &n);
+		}
+
+		unlatch(l);
+
+		return j;
+	}
+
+	for (first = 0; (first < n.size) && (n.key[first].dir_id < dir_id); ++first)
+		;
+
+	for (last = first; (last < n.size) && (n.key[last].dir_id <= dir_id); ++last)
+		;
+
+	left = (int *) malloc((n.size + 1) * sizeof(int));
+
+	for (i = first; i <= last; ++i) {
+		left[i] = prune(p, sb, dir_id, *loc, &n.link[i], rs);
+	}
+
+	/* a child left empty goes with the separator on its left, the first one with the one on its right */
+	lo = -1;
+	hi = -1;
+
+	for (i = 0, j = 0; i <= n.size; ++i) {
+		if ((i >= first) && (i <= last) && (left[i] == 0)) {
+			continue;
+		}
+
+		if ((i >= first) && (i <= last)) {
+			lo = (lo == -1) ? j : lo;
+			hi = j;
+		}
+
+		if (j > 0) {
+			n.key[j - 1] = n.key[i - 1];
+		}
+
+		n.link[j++] = n.link[i];
+	}
+
+	free(left);
+
+	if (j == 0) {
+		release_block(p, sb, *loc);
+		unlatch(l);
+
+		return 0;
+	}
+
+	n.size = j - 1;
+
+	for (i = lo; (lo != -1) && (i < hi); ) {
+		if (merge_leaves(p, sb, &n, i)) {
+			--hi;
+		} else {
+			++i;
+		}
+	}
+
+	write_node(p, sb, *loc, &n);
+	unlatch(l);
+
+	return n.size + 1;
+}
+
+/**
+ * Moves the keys of leaf n->link[i + 1] to the end of leaf n->link[i] if they fit there,
+ * and takes the emptied leaf out of n, which is write latched. Leaves still shared with a
+ * snapshot (left so when no block was free for a copy) are not changed. Returns false if
+ * the leaves were left as they are.
+ */
+bool merge_leaves(FILE *p, struct superblock *sb, struct node *n, int i)
+{
+	int j;
+	bool merged;
+	struct node *a;
+	struct node *b;
+	struct latch *la;
+	struct latch *lb;
+
+	a = (struct node *) malloc(sizeof(struct node));
+	b = (struct node *) malloc(sizeof(struct node));
+
+	la = latch(n->link[i], 1);
+	lb = latch(n->link[i + 1], 1);
+	read_node(p, sb, n->link[i], a);
+	read_node(p, sb, n->link[i + 1], b);
+
+	merged = (a->isLeaf == 1) && (b->isLeaf == 1) && (a->size + b->size <= NODE_KEYS(sb->blocksize)) &&
+			(get_ref(p, sb, n->link[i]) == 0) && (get_ref(p, sb, n->link[i + 1]) == 0);
+
+	if (merged) {
+		for (j = 0; j < b->size; ++j) {
+			a->key[a->size + j] = b->key[j];
+			a->link[a->size + j] = b->link[j];
+		}
+
+		a->size += b->size;
+		a->right = b->right;
+		write_node(p, sb, n->link[i], a);
+		release_block(p, sb, n->link[i + 1]);
+
+		for (j = i + 1; j < n->size; ++j) {
+			n->key[j - 1] = n->key[j];
+			n->link[j] = n->link[j + 1];
+		}
+
+		--n->size;
+	}
+
+	unlatch(lb);
+	unlatch(la);
+	free(a);
+	free(b);
+
+	return merged;
+}
+
+void debug_show_filled_blocks(FILE *p)
+{
+	int i;
+	struct superblock sb;
+
+	if (!DEBUG) {
+		printf("Sorry, binary compiled as production, not debug. Set the DEBUG flag in source and compile to access the feature.");
+		return;
+	}
+
+	dread(p, &sb, sizeof(struct superblock), 0);
+
+	printf("\nBlocks in use: ");
+	for (i = 0; i < sb.blocks; ++i) {
+		if (check_block(p, &sb, i) == true) {
+			printf("%d ", i);
+		}
+	}
+
+	return;
+}
+
+/**
+ * returns true if block i is in use, else false
+ */
+bool check_block(FILE *p, struct superblock *sb, int i)
+{
+	int b;
+	int m;
+	int x;
+	off_t loc;
+	char a;
+
+	b = i / (8 * sb->blocksize) + 2;
+	m = (i % (8 * sb->blocksize)) / 8;
+	x = (i % (8 * sb->blocksize)) % 8;
+
+	loc = BLOCK_OFF(sb, b) + m;
+
+	dread(p, &a, sizeof(char), loc);
+
+	if ((a >> x) & 1) {
+		return true;
+	} else {
+		return false;
+	}
+}
+
+/**
+ * Returns the first free block in [from, to), or -1. The freeblocks map is read up to a
+ * block at a time and only bytes other than 0xFF are looked into.
+ */
+int scan_map(FILE *p, struct superblock *sb, int from, int to)
+{
+	int i;
+	int x;
+	int n;
+	int fb;
+	int byte;
+	int last;
+	unsigned char map[MAX_BS];
+
+	byte = from / 8;
+	last = (to - 1) / 8 + 1;
+
+	while (byte < last) {
+		n = last - byte;
+
+		if (n > sb->blocksize) {
+			n = sb->blocksize;
+		}
+
+		dread(p, map, n, BLOCK_OFF(sb, 2) + byte);
+
+		for (i = 0; i < n; ++i) {
+			if (map[i] == 0xFF) {
+				continue;
+			}
+
+			for (x = 0; x < 8; ++x) {
+				fb = (byte + i) * 8 + x;
+
+				if ((fb >= from) && (fb < to) && (((map[i] >> x) & 1) == 0)) {
+					return fb;
+				}
+			}
+		}
+
+		byte += n;
+	}
+
+	return -1;
+}
+
+/**
+ * Returns a free block of group ag, searching from where the last search ended and
+ * wrapping around. Called with the group's lock held, see alloc_block().
+ * */
+int get_free_block(FILE *p, struct superblock *sb, struct alloc_group *ag)
+{
+	int fb;
+
+	fb = scan_map(p, sb, ag->next_block, ag->end);
+
+	if (fb == -1) {
+		fb = scan_map(p, sb, ag->start, ag->next_block);
+	}
+
+	return fb;
+}
+
+/**
+ * Finds a free block and marks it used. Tries group first, then the following groups.
+ */
+int alloc_block(FILE *p, struct superblock *sb, int group)
+{
+	int i;
+	int fb;
+	struct alloc_group *ag;
+
+	for (i = 0; i < n_groups; ++i) {
+		ag = &groups[(group + i) % n_groups];
+
+		pthread_mutex_lock(&ag->lock);
+
+		if (ag->free_blocks == -1) {
+			count_group(p, sb, ag);
+		}
+
+		if (ag->free_blocks > 0) {
+			fb = get_free_block(p, sb, ag);
+
+			if (fb != -1) {
+				use_block(p, sb, fb);
+				--ag->free_blocks;
+				ag->next_block = fb + 1;
+				pthread_mutex_unlock(&ag->lock);
+
+				return fb;
+			}
+		}
+
+		pthread_mutex_unlock(&ag->lock);
+	}
+
+	err_noblocks();
+
+	return -1;
+}
+
+/**
+ * Allocates a run of up to want contiguous blocks, in group group if it has free blocks,
+ * else in the following groups. Returns the first block of the run and stores its length
+ * in *len, or returns -1 if no blocks are left. The run's bits are set with one write.
+ */
+int alloc_run(FILE *p, struct superblock *sb, int group, int want, int *len)
+{
+	int i;
+	int n;
+	int b;
+	int fb;
+	int first;
+	int nbytes;
+	struct alloc_group *ag;
+	unsigned char map[MAX_BS];
+
+	if (want > 8 * (MAX_BS - 1)) {
+		want = 8 * (MAX_BS - 1);
+	}
+
+	for (i = 0; i < n_groups; ++i) {
+		ag = &groups[(group + i) % n_groups];
+
+		pthread_mutex_lock(&ag->lock);
+
+		if (ag->free_blocks == -1) {
+			count_group(p, sb, ag);
+		}
+
+		fb = (ag->free_blocks > 0) ? get_free_block(p, sb, ag) : -1;
+
+		if (fb != -1) {
+			if (want > ag->end - fb) {
+				want = ag->end - fb;
+			}
+
+			first = fb / 8;
+			nbytes = (fb + want - 1) / 8 - first + 1;
+
+			dread(p, map, nbytes, BLOCK_OFF(sb, 2) + first);
+
+			for (n = 0; n < want; ++n) {
+				b = fb + n - first * 8;
+
+				if ((map[b / 8] >> (b % 8)) & 1) {
+					break;
+				}
+
+				map[b / 8] |= 1 << (b % 8);
+			}
+
+			dwrite(p, map, nbytes, BLOCK_OFF(sb, 2) + first);
+
+			ag->free_blocks -= n;
+			ag->next_block = fb + n;
+			pthread_mutex_unlock(&ag->lock);
+
+			*len = n;
+
+			return fb;
+		}
+
+		pthread_mutex_unlock(&ag->lock);
+	}
+
+	err_noblocks();
+
+	return -1;
+}
+
+/**
+ * Sets up the allocation groups of the filesystem described by sb. Images made before
+ * groups existed (agcount 0) are one group.
+ */
+void init_groups(struct superblock *sb)
+{
+	int i;
+	int agblocks;
+	int aginodes;
+
+	for (i = 0; i < n_groups; ++i) {
+		pthread_mutex_destroy(&groups[i].lock);
+	}
+
+	if (sb->agcount == 0) {
+		n_groups = 1;
+		agblocks = sb->blocks;
+		aginodes = sb->n_inodes;
+	} else {
+		n_groups = sb->agcount;
+		agblocks = sb->agblocks;
+		aginodes = sb->aginodes;
+	}
+
+	groups = (struct alloc_group *) realloc(groups, n_groups * sizeof(struct alloc_group));
+
+	for (i = 0; i < n_groups; ++i) {
+		groups[i].start = i * agblocks;
+		groups[i].end = (i == n_groups - 1) ? sb->blocks : (i + 1) * agblocks;
+		groups[i].first_inode = i * aginodes;
+		groups[i].n_inodes = (i == n_groups - 1) ? sb->n_inodes - i * aginodes : aginodes;
+		groups[i].free_blocks = -1;
+		groups[i].free_inodes = -1;
+		groups[i].next_block = groups[i].start;
+		groups[i].next_inode = groups[i].first_inode;
+		pthread_mutex_init(&groups[i].lock, NULL);
+	}
+
+	return;
+}
+
+/**
+ * Counts the free blocks and inodes of group ag. Called with the group's lock held.
+ */
+void count_group(FILE *p, struct superblock *sb, struct alloc_group *ag)
+{
+	int i;
+	int j;
+	int n;
+	int used;
+	int byte;
+	int last;
+	unsigned char map[MAX_BS];
+	struct inode in[MAX_BS / sizeof(struct inode)];
+
+	used = 0;
+	byte = ag->start / 8;
+	last = (ag->end - 1) / 8 + 1;
+
+	while (byte < last) {
+		n = last - byte;
+
+		if (n > sb->blocksize) {
+			n = sb->blocksize;
+		}
+
+		dread(p, map, n, BLOCK_OFF(sb, 2) + byte);
+
+		for (i = 0; i < n; ++i) {
+			used += __builtin_popcount(map[i]);
+		}
+
+		byte += n;
+	}
+
+	/* bits past the last block of the image are never set */
+	ag->free_blocks = (ag->end - ag->start) - used;
+	ag->free_inodes = 0;
+
+	for (i = 0; i < ag->n_inodes; i += sb->inodes) {
+		dread(p, in, sb->blocksize, INODE_OFF(sb, ag->first_inode + i));
+
+		for (j = 0; (j < sb->inodes) && (i + j < ag->n_inodes); ++j) {
+			if (in[j].f[0] == -1) {
+				++ag->free_inodes;
+			}
+		}
+	}
+
+	if (DEBUG) {
+		printf("\nGroup at block %d: %d free blocks, %d free inodes", ag->start, ag->free_blocks, ag->free_inodes);
+	}
+
+	return;
+}
+
+/**
+ * Returns the allocation group of the calling thread.
+ */
+int home_group()
+{
+	if (home == -1) {
+		home = __sync_fetch_and_add(&next_home, 1);
+	}
+
+	return home % n_groups;
+}
+
+/**
+ * Returns the allocation group in which items of directory dir_id are created.
+ */
+int dir_group(int dir_id)
+{
+	return dir_id % n_groups;
+}
+
+/**
+ * Returns the allocation group block number b belongs to.
+ */
+int block_group(int b)
+{
+	int g;
+
+	g = b / (groups[0].end - groups[0].start);
+
+	return (g < n_groups) ? g : n_groups - 1;
+}
+
+/**
+ * Returns the allocation group inode number inode_loc belongs to.
+ */
+int inode_group(int inode_loc)
+{
+	int g;
+
+	g = inode_loc / groups[0].n_inodes;
+
+	return (g < n_groups) ? g : n_groups - 1;
+}
+
+void update_sb(FILE *p, struct superblock *sb)
+{
+	pthread_mutex_lock(&sb_lock);
+
+	dwrite(p, sb, sizeof(struct superblock), 0);
+
+	dwrite(p, sb, sizeof(struct superblock), sb->blocksize);
+
+	pthread_mutex_unlock(&sb_lock);
+
+	return;
+}
+
+int comparator(const void *p, const void *q)
+{
+	if ((((struct Key *)p)->dir_id - ((struct Key *)q)->dir_id) == 0) {
+		return (((struct Key *)p)->id - ((struct Key *)q)->id);
+	} else {
+		return (((struct Key *)p)->dir_id - ((struct Key *)q)->dir_id);
+	}
+}
+
+/**
+ * Inserts separator k, whose right child is r, into node path[depth - 1]; the left child is
+ * already linked there. path holds the blocks visited by insert(), root first, and all of
+ * them from the first one that may split are write latched by the caller. An internal node
+ * that overflows keeps its lower half in place, and its middle key moves up with the new
+ * right half. When the root splits, a new root is made (the shard latch is held in that
+ * case).
+ * parent links are only set on the nodes written here, so they are a hint; the tree is
+ * always navigated through path.
+ */
+int promote(struct Key k, int r, int *path, int depth, FILE *p, struct superblock *sb)
+{
+	int i;
+	int j;
+	int parent;
+	int R;
+	int mid;
+	int total;
+	struct Key *keys;
+	int *links;
+	struct node n;
+	struct node tmp;
+	struct Key up;
+
+	if (depth == 0) {
+		if (DEBUG) {
+			printf("\n\nParent is -1, so creating new root.\n");
+		}
+
+		parent = get_node(p, sb);
+
+		if (parent == -1) {
+			err_noblocks();
+
+			return parent;
+		}
+
+		read_node(p, sb, parent, &n);
+
+		n.parent = -1;
+		n.isLeaf = 0;
+		n.key[0] = k;
+		n.link[0] = path[0];
+		n.link[1] = r;
+		n.left = -1;
+		n.right = -1;
+		n.size = 1;
+
+		write_node(p, sb, parent, &n);
+
+		set_root(p, sb, dir_shard(k.dir_id), parent);
+
+		if (DEBUG) {
+			inorder(p, sb, parent);
+		}
+
+		return parent;
+	}
+
+	parent = path[depth - 1];
+	read_node(p, sb, parent, &n);
+
+	if (n.size < NODE_KEYS(sb->blocksize)) {
+		for (i = 0; i < n.size; ++i) {
+			if (comparator((void *)&k, (void *)&n.key[i]) < 0) {
+				break;
+			}
+		}
+
+		for (j = n.size; j > i; --j) {
+			n.key[j] = n.key[j-1];
+			n.link[j+1] = n.link[j];
+		}
+
+		n.key[i] = k;
+		n.link[i + 1] = r;
+		++n.size;
+
+		write_node(p, sb, parent, &n);
+
+		return parent;
+	}
+
+	R = get_node(p, sb);
+
+	if (R == -1) {
+		err_noblocks();
+
+		return parent;
+	}
+
+	read_node(p, sb, R, &tmp);
+
+	/* merged keys and links, one more of each than a node holds */
+	total = n.size + 1;
+	keys = (struct Key *) malloc(total * sizeof(struct Key));
+	links = (int *) malloc((total + 1) * sizeof(int));
+
+	links[0] = n.link[0];
+	for (i = 0, j = 0; i < n.size; ++i, ++j) {
+		if ((i == j) && (comparator((void *)&k, (void *)&n.key[i]) < 0)) {
+			keys[j] = k;
+			links[j + 1] = r;
+			++j;
+		}
+		keys[j] = n.key[i];
+		links[j + 1] = n.link[i + 1];
+	}
+
+	if (i == j) {
+		keys[j] = k;
+		links[j + 1] = r;
+	}
+
+	mid = total / 2;
+	up = keys[mid];
+
+	for (i = 0; i < mid; ++i) {
+		n.key[i] = keys[i];
+		n.link[i] = links[i];
+	}
+	n.link[mid] = links[mid];
+
+	for (i = mid + 1, j = 0; i < total; ++i, ++j) {
+		tmp.key[j] = keys[i];
+		tmp.link[j] = links[i];
+	}
+	tmp.link[j] = links[i];
+
+	free(keys);
+	free(links);
+
+	tmp.size = j;
+	tmp.isLeaf = 0;
+	tmp.parent = n.parent;
+	n.size = mid;
+
+	write_node(p, sb, R, &tmp);
+	write_node(p, sb, parent, &n);
+
+	promote(up, R, path, depth - 1, p, sb);
+
+	return parent;
+}
+void err_noblocks()
+{
+	printf("\nERROR: No more free blocks in fs!");
+
+	return;
+}
+
+void init_inodes(FILE *p, struct superblock *sb)
+{
+	int i;
+	int inode_blocks;
+	int start;
+	int end;
+	struct inode in[MAX_BS / sizeof(struct inode)];
+
+	for (i = 0; i < sb->inodes; ++i) {
+		in[i].f[0] = -1;
+	}
+
+	inode_blocks = sb->n_inodes / sb->inodes;
+
+	if ((sb->n_inodes % sb->inodes) != 0) {
+		++inode_blocks;
+	}
+
+	start = 2 + sb->freeblocksmap;
+	end = start + inode_blocks;
+
+	for (i = start; i < end; ++i) {
+		dwrite(p, &in, sb->inodes * sizeof(struct inode), BLOCK_OFF(sb, i));
+		use_block(p, sb, i);
+	}
+
+	return;
+}
+
+/**
+ * Returns number of a free inode, looked for in allocation group group first and then in
+ * the following groups, a block of inodes at a time. Its byte location is INODE_OFF(sb, number).
+ * The inode is reserved (f[0] = -2) before the group's lock is released, so no other thread
+ * gets it; the caller either writes it or gives it back with f[0] = -1.
+ * */
+int get_inode(FILE *p, struct superblock *sb, int group)
+{
+	int i;
+	int j;
+	int k;
+	int b;
+	struct alloc_group *ag;
+	struct inode in[MAX_BS / sizeof(struct inode)];
+
+	if (sb->n_inodes == 0) {
+		printf("\nn_inodes is zero!");
+
+		exit(0);
+	}
+
+	for (k = 0; k < n_groups; ++k) {
+		ag = &groups[(group + k) % n_groups];
+
+		pthread_mutex_lock(&ag->lock);
+
+		if (ag->free_inodes == -1) {
+			count_group(p, sb, ag);
+		}
+
+		for (i = 0; (i < ag->n_inodes) && (ag->free_inodes > 0); i += sb->inodes) {
+			b = ag->first_inode + (ag->next_inode - ag->first_inode + i) % ag->n_inodes;
+
+			dread(p, in, sb->blocksize, INODE_OFF(sb, b));
+
+			for (j = 0; (j < sb->inodes) && (b + j < ag->first_inode + ag->n_inodes); ++j) {
+				if (in[j].f[0] == -1) {
+					in[j].f[0] = -2;
+					dwrite(p, &in[j], sizeof(struct inode), INODE_OFF(sb, b + j));
+					--ag->free_inodes;
+					ag->next_inode = b;
+					pthread_mutex_unlock(&ag->lock);
+
+					return b + j;
+				}
+			}
+		}
+
+		pthread_mutex_unlock(&ag->lock);
+	}
+
+	return -1;
+}
+
+/**
+ * Writes the inode and stat block of a new item with key k, without inserting k into
+ * the B+ tree. Returns its inode number, or -1 if no inode or block was left.
+ */
+int make_item(FILE *p, struct superblock *sb, struct Key k, int type, char *name)
+{
+	int i;
+	int inode_loc;
+	int stat_loc;
+	struct inode in;
+	struct item_stat s;
+
+	inode_loc = get_inode(p, sb, dir_group(k.dir_id));
+
+	if (inode_loc == -1) {
+		printf("\nERROR: No more free inodes in fs!");
+
+		return -1;
+	}
+
+	stat_loc = alloc_block(p, sb, inode_group(inode_loc));
+
+	if (stat_loc == -1) {
+		memset(&in, -1, sizeof(struct inode));
+		dwrite(p, &in, sizeof(struct inode), INODE_OFF(sb, inode_loc));
+
+		return -1;
+	}
+
+	if (DEBUG)
+		printf("\nStat Loc: %d, inode loc: %d", stat_loc, inode_loc);
+
+	in.f[0] = stat_loc;
+	for (i = 1; i < 16; ++i) {
+		in.f[i] = -1;
+	}
+
+	init_stat(&s, k, inode_loc, type, name);
+
+	dwrite(p, &in, sizeof(struct inode), INODE_OFF(sb, inode_loc));
+
+	dwrite(p, &s, sizeof(struct item_stat), BLOCK_OFF(sb, stat_loc));
+
+	return inode_loc;
+}
+
+int new_empty_file_dir(FILE *p, struct superblock *sb, char name[], int dir_id, int type)
+{
+	int inode_loc;
+	struct Key k;
+	pthread_mutex_t *dl;
+
+	dl = &dir_lock[dir_id % DIR_LOCKS];
+	pthread_mutex_lock(dl);
+	begin_op();
+
+	if (find(p, sb, dir_id, name, type, 0) != -1) {
+		if (type == 2) {
+			printf("\nDirectory \"%s\" already exists!", name);
+		} else if (type == 4) {
+			printf("\nFile \"%s\" already exists!", name);
+		} else {
+			printf("\nItem \"%s\" already exists!", name);
+		}
+
+		pthread_mutex_unlock(dl);
+		end_op(p);
+
+		return -2;
+	}
+
+	k.id = get_id(name, p, sb, dir_id, type);
+	k.dir_id = dir_id;
+
+	inode_loc = make_item(p, sb, k, type, name);
+
+	if (inode_loc == -1) {
+		pthread_mutex_unlock(dl);
+		end_op(p);
+
+		return -1;
+	}
+
+	if (DEBUG) {
+		printf("\nAbout to insert key.");
+	}
+
+	insert(p, k.id, k.dir_id, inode_loc, sb);
+
+	if (type == 2) {
+		k.dir_id = k.id;
+		k.id = dir_id;
+
+		inode_loc = make_item(p, sb, k, type, "..");
+
+		if (inode_loc == -1) {
+			pthread_mutex_unlock(dl);
+			end_op(p);
+
+			return -1;
+		}
+
+		if (DEBUG) {
+			printf("\nAbout to insert key.");
+		}
+
+		insert(p, k.id, k.dir_id, inode_loc, sb);
+	}
+
+	pthread_mutex_unlock(dl);
+	end_op(p);
+
+	return inode_loc;
+}
+
+/**
+ * Descends to the leftmost leaf that can hold keys of directory dir_id, crabbing read
+ * latches. Returns the read latch of that leaf, with its block number in loc and its
+ * contents in n, or NULL if the tree is empty. Keys of dir_id continue in the following
+ * leaves, see next_leaf(), as long as the last key of a leaf is not past dir_id.
+ */
+struct latch *find_leaf(FILE *p, struct superblock *sb, unsigned dir_id, int *loc, struct node *n)
+{
+	int i;
+	int curr;
+	struct latch *l;
+	struct latch *parent;
+	struct shard *sh;
+
+	sh = dir_shard(dir_id);
+	pthread_rwlock_rdlock(&sh->latch);
+
+	curr = *shard_root(sb, sh);
+
+	if (curr == -1) {
+		pthread_rwlock_unlock(&sh->latch);
+
+		return NULL;
+	}
+
+	parent = NULL;
+
+	while (1) {
+		l = latch(curr, 0);
+
+		if (parent == NULL) {
+			pthread_rwlock_unlock(&sh->latch);
+		} else {
+			unlatch(parent);
+		}
+
+		read_node(p, sb, curr, n);
+
+		if (n->isLeaf == 1) {
+			break;
+		}
+
+		for (i = 0; i < n->size; ++i) {
+			if (n->key[i].dir_id >= dir_id) {
+				break;
+			}
+		}
+
+		if (DEBUG) {
+			printf("\n\tTaking link #%d", i);
+		}
+
+		parent = l;
+		curr = n->link[i];
+	}
+
+	*loc = curr;
+
+	return l;
+}
+
+/**
+ * Moves a leaf scan from leaf n, latched by l, to the next leaf: l is released and the
+ * tree is descended again for the smallest key past the last one of n. Returns the read
+ * latch of the leaf holding it, with its block number in loc, its contents in n and the
+ * index of that key in start, or NULL at the end of the tree. Keys of n that another
+ * thread inserted meanwhile are skipped, while the ones after it are all seen.
+ * Following right links would be quicker, but in a leaf shared with a snapshot the link
+ * goes to the snapshot's copy of the next leaf.
+ */
+struct latch *next_leaf(FILE *p, struct superblock *sb, struct latch *l, int *loc, struct node *n, int *start)
+{
+	int i;
+	int curr;
+	bool bounded;
+	struct Key k;
+	struct Key bound;
+	struct latch *parent;
+	struct shard *sh;
+
+	k = n->key[n->size - 1];
+	sh = dir_shard(k.dir_id);
+	++k.id;
+	unlatch(l);
+
+	while (1) {
+		pthread_rwlock_rdlock(&sh->latch);
+
+		curr = *shard_root(sb, sh);
+		parent = NULL;
+		bounded = false;
+
+		if (curr == -1) {
+			pthread_rwlock_unlock(&sh->latch);
+
+			return NULL;
+		}
+
+		while (1) {
+			l = latch(curr, 0);
+
+			if (parent == NULL) {
+				pthread_rwlock_unlock(&sh->latch);
+			} else {
+				unlatch(parent);
+			}
+
+			read_node(p, sb, curr, n);
+
+			if (n->isLeaf == 1) {
+				break;
+			}
+
+			i = child_index(n, &k);
+
+			/* the first key of the following subtree, in case this one ends before k */
+			if (i < n->size) {
+				bound = n->key[i];
+				bounded = true;
+			}
+
+			parent = l;
+			curr = n->link[i];
+		}
+
+		for (i = 0; (i < n->size) && (comparator((void *)&n->key[i], (void *)&k) < 0); ++i)
+			;
+
+		if (i < n->size) {
+			*loc = curr;
+			*start = i;
+
+			return l;
+		}
+
+		unlatch(l);
+
+		if (!bounded) {
+			return NULL;
+		}
+
+		k = bound;
+	}
+}
+
+void ls(FILE *p, struct superblock *sb, int dir_id)
+{
+	int i;
+	int curr;
+	struct node n;
+	struct inode in;
+	struct item_stat s;
+	int start;
+	struct readahead ra;
+	struct latch *l;
+
+	ra_init(&ra);
+
+	l = find_leaf(p, sb, dir_id, &curr, &n);
+	start = 0;
+
+	while (l != NULL) {
+		if (DEBUG) {
+			printf("\ndir_id: %d, n.size = %d, n.right = %d\n", n.key[0].dir_id, n.size, n.right);
+		}
+
+		ra_leaf(p, sb, &ra, curr, n.right);
+
+		for (i = start; i < n.size; ++i) {
+			if (n.key[i].dir_id == dir_id) {
+				dread(p, &in, sizeof(struct inode), INODE_OFF(sb, n.link[i]));
+				dread(p, &s, sizeof(struct item_stat), BLOCK_OFF(sb, in.f[0]));
+				if (s.type == 4) {
+					printf("f ");
+				} else {
+					printf("D ");
+				}
+				printf("%20s    %25s\n", s.name, s.ltime);
+			}
+		}
+
+		if (n.key[n.size - 1].dir_id > (unsigned) dir_id) {
+			unlatch(l);
+
+			break;
+		}
+
+		l = next_leaf(p, sb, l, &curr, &n, &start);
+	}
+
+	return;
+}
+
+/**
+ * Collects the items of type type (0 for all types) in directory dir_id into *ents,
+ * sorted by name, with one leaf scan like ls(). Returns their number. The caller frees *ents.
+ */
+int scan_dir(FILE *p, struct superblock *sb, int dir_id, int type, struct dir_entry **ents)
+{
+	int i;
+	int count;
+	int cap;
+	int curr;
+	struct node n;
+	struct inode in;
+	struct item_stat s;
+	int start;
+	struct readahead ra;
+	struct latch *l;
+
+	count = 0;
+	cap = 64;
+	*ents = (struct dir_entry *) malloc(cap * sizeof(struct dir_entry));
+
+	ra_init(&ra);
+
+	l = find_leaf(p, sb, dir_id, &curr, &n);
+	start = 0;
+
+	while (l != NULL) {
+		ra_leaf(p, sb, &ra, curr, n.right);
+
+		for (i = start; i < n.size; ++i) {
+			if (n.key[i].dir_id == dir_id) {
+				dread(p, &in, sizeof(struct inode), INODE_OFF(sb, n.link[i]));
+				dread(p, &s, sizeof(struct item_stat), BLOCK_OFF(sb, in.f[0]));
+
+				if ((type != 0) && (s.type != type)) {
+					continue;
+				}
+
+				if (count == cap) {
+					cap *= 2;
+					*ents = (struct dir_entry *) realloc(*ents, cap * sizeof(struct dir_entry));
+				}
+
+				strcpy((*ents)[count].name, s.name);
+				(*ents)[count].type = s.type;
+				(*ents)[count].id = s.k.id;
+				(*ents)[count].inode_loc = n.link[i];
+				(*ents)[count].first = (in.f[1] != -1) ? in.f[1] : in.f[0];
+				++count;
+			}
+		}
+
+		if (n.key[n.size - 1].dir_id > (unsigned) dir_id) {
+			unlatch(l);
+
+			break;
+		}
+
+		l = next_leaf(p, sb, l, &curr, &n, &start);
+	}
+
+	qsort(*ents, count, sizeof(struct dir_entry), cmp_name);
+
+	return count;
+}
+
+void init_stat(struct item_stat *s, struct Key k, int inode_loc, int type, char *name)
+{
+	char t[25];
+
+	get_time(t);
+
+	if (DEBUG) {
+		printf("\nGot time.");
+	}
+
+	s->k = k;
+	s->inode = inode_loc;
+	s->type = type;
+	s->uid = 1000;
+	s->gid = 100;
+	strcpy(s->name, name);
+	s->lastblock = -1;
+	s->lastblockbytes = 0;
+	s->blocks = 0;
+
+	if (DEBUG) {
+		printf("\nCopied name.");
+	}
+
+	strcpy(s->ctime, t);
+	strcpy(s->ltime, t);
+	strcpy(s->mtime, t);
+
+	s->perm[0] = 7;
+	s->perm[1] = 5;
+	s->perm[2] = 5;
+
+	if (DEBUG) {
+		printf("\nStats generated successfully.");
+	}
+
+	return;
+}
+
+/**
+ * Writes the current local time to t, in the 24 characters of asctime() without its
+ * newline. t has room for 25. Safe to call from many threads at once.
+ */
+void get_time(char *t)
+{
+	time_t currtime;
+	struct tm loc_time;
+
+	currtime = time(NULL);
+	localtime_r(&currtime, &loc_time);
+	strftime(t, 25, "%a %b %e %H:%M:%S %Y", &loc_time);
+
+	return;
+}
+
+/**
+ * Gives out a new item id. A directory made in / starts a subtree, and is given an id of
+ * the next shard round robin, so its items go to that shard's tree; everything else gets
+ * an id of the shard of its directory, keeping subtrees in one tree. A full shard gives
+ * ids of the following one, which only moves the items of the new directory elsewhere.
+ * Returns -1 if no ids are left.
+ */
+int get_id(char *name, FILE *p, struct superblock *sb, int dir_id, int type)
+{
+	int i;
+	int id;
+	struct shard *sh;
+
+	if (strcmp(name, "/") == 0) {
+		return 1;
+	}
+
+	if ((dir_id == 1) && (type == 2) && (n_shards > 1)) {
+		sh = &shards[__atomic_fetch_add(&next_shard, 1, __ATOMIC_SEQ_CST) % n_shards];
+	} else {
+		sh = dir_shard(dir_id);
+	}
+
+	for (i = 0; i < n_shards; ++i, sh = &shards[(sh - shards + 1) % n_shards]) {
+		if (sh == &shards[0]) {
+			pthread_mutex_lock(&sb_lock);
+			id = sb->idcounter;
+
+			if ((n_shards > 1) && (id >= SHARD_IDS)) {
+				pthread_mutex_unlock(&sb_lock);
+
+				continue;
+			}
+
+			++sb->idcounter;
+			pthread_mutex_unlock(&sb_lock);
+
+			update_sb(p, sb);
+
+			return id;
+		}
+
+		pthread_mutex_lock(&sh->lock);
+		id = sh->idcounter;
+
+		if ((long long) id >= (long long) SHARD_IDS * (sh - shards + 1)) {
+			pthread_mutex_unlock(&sh->lock);
+
+			continue;
+		}
+
+		++sh->idcounter;
+		write_shard(p, sb, sh);
+		pthread_mutex_unlock(&sh->lock);
+
+		return id;
+	}
+
+	printf("\nNo item ids are left.");
+
+	return -1;
+}
+
+/**
+ * Splits the namespace of a new image into n trees (shards): reserves the blocks of the
+ * roots and id counters of trees 1 to n - 1 after the checksum map, with the trees empty.
+ */
+void init_shards(FILE *p, struct superblock *sb, int n)
+{
+	int i;
+	struct shard_head h;
+
+	sb->shards = n;
+	sb->shard = sb->csum + sb->csum_blocks;
+
+	for (i = 1; i < n; ++i) {
+		h.root = -1;
+		h.idcounter = (unsigned) SHARD_IDS * i;
+		use_block(p, sb, sb->shard + i - 1);
+		dwrite(p, &h, sizeof(h), BLOCK_OFF(sb, sb->shard + i - 1));
+	}
+
+	return;
+}
+
+/**
+ * Reads the roots and id counters of the shards of sb, at mount.
+ */
+void load_shards(FILE *p, struct superblock *sb)
+{
+	int i;
+	struct shard_head h;
+
+	n_shards = (sb->shards > 1) ? sb->shards : 1;
+	next_shard = 0;
+	shards[0].root = -1;
+	shards[0].head = -1;
+
+	for (i = 1; i < n_shards; ++i) {
+		dread(p, &h, sizeof(h), BLOCK_OFF(sb, sb->shard + i - 1));
+		shards[i].root = h.root;
+		shards[i].idcounter = h.idcounter;
+		shards[i].head = sb->shard + i - 1;
+	}
+
+	return;
+}
+
+/**
+ * Returns the shard whose tree holds the items of directory dir_id: the one whose range
+ * of ids dir_id was given from (see get_id()).
+ */
+struct shard *dir_shard(unsigned dir_id)
+{
+	return &shards[(dir_id / SHARD_IDS < (unsigned) n_shards) ? dir_id / SHARD_IDS : 0];
+}
+
+/**
+ * Returns where the root of the tree of shard sh is kept. sb may be the copy of the
+ * superblock a snapshot is mounted with, whose root is the one of the snapshot.
+ */
+int *shard_root(struct superblock *sb, struct shard *sh)
+{
+	return (sh == &shards[0]) ? &sb->root : &sh->root;
+}
+
+/**
+ * Makes root the root of the tree of shard sh. The shard latch is write locked.
+ */
+void set_root(FILE *p, struct superblock *sb, struct shard *sh, int root)
+{
+	if (sh == &shards[0]) {
+		pthread_mutex_lock(&sb_lock);
+		sb->root = root;
+		pthread_mutex_unlock(&sb_lock);
+		update_sb(p, sb);
+
+		return;
+	}
+
+	pthread_mutex_lock(&sh->lock);
+	sh->root = root;
+	write_shard(p, sb, sh);
+	pthread_mutex_unlock(&sh->lock);
+
+	return;
+}
+
+/**
+ * Writes the root and id counter of shard sh (not shard 0) to its block. sh->lock is held.
+ */
+void write_shard(FILE *p, struct superblock *sb, struct shard *sh)
+{
+	struct shard_head h;
+
+	h.root = sh->root;
+	h.idcounter = sh->idcounter;
+	dwrite(p, &h, sizeof(h), BLOCK_OFF(sb, sh->head));
+
+	return;
+}
+
+void debug_showroot(FILE *p, struct superblock *sb)
+{
+	int i;
+	struct node n;
+
+	if (!DEBUG) {
+		printf("\n\tNOT compiled as debug.\n");
+
+		return;
+	}
+
+	read_node(p, sb, sb->root, &n);
+
+	printf("\nRoot location: %d. Root node contents: ", sb->root);
+
+	for (i = 0; i < n.size; ++i) {
+		printf("\ndir_id = %d, id = %d", n.key[i].dir_id, n.key[i].id);
+		printf(", link: %d", n.link[i]);
+	}
+
+	return;
+}
+
+void batch_create_files(FILE *p, struct superblock *sb, int n, int dir_id)
+{
+	int i;
+	int tmp;
+	char fname[256];
+
+	for (i = 0; i < n; ++i) {
+		sprintf(fname, "batch_file_%d", i);
+		tmp = new_empty_file_dir(p, sb, fname, dir_id, 4);
+		if (tmp == -2) {
+			++n;
+		}
+	}
+
+	return;
+}
+
+void inorder(FILE *p, struct superblock *sb, int root)
+{
+	int i;
+	struct node n;
+
+	if (!DEBUG) {
+		printf("\nNOT in debug mode!");
+
+		return;
+	}
+
+	if (root == -1) {
+		return;
+	}
+
+	read_node(p, sb, root, &n);
+
+	if (n.isLeaf == 1) {
+		for (i = 0; i < n.size; ++i) {
+			printf("%d ", n.key[i].id);
+		}
+	} else {
+		for (i = 0; i < n.size; ++i) {
+			inorder(p, sb, n.link[i]);
+		}
+		inorder(p, sb, n.link[i]);
+	}
+
+	return;
+}
+
+/**
+ * Looks up item name of type type (0 for any type) in directory dir_id. Returns its id,
+ * or its inode if id_or_loc is 1, or -1 if there is none.
+ */
+int find(FILE *p, struct superblock *sb, int dir_id, char name[], int type, int id_or_loc)
+{
+	int i;
+	int curr;
+	int ret;
+	struct node n;
+	struct inode in;
+	struct item_stat s;
+	int start;
+	struct readahead ra;
+	struct latch *l;
+
+	ra_init(&ra);
+
+	l = find_leaf(p, sb, dir_id, &curr, &n);
+	start = 0;
+	ret = -1;
+
+	while (l != NULL) {
+		if (DEBUG) {
+			printf("\ndir_id: %d, n.size = %d, n.right = %d\n", n.key[0].dir_id, n.size, n.right);
+		}
+		ra_leaf(p, sb, &ra, curr, n.right);
+		for (i = start; i < n.size; ++i) {
+			if (n.key[i].dir_id == dir_id) {
+				dread(p, &in, sizeof(struct inode), INODE_OFF(sb, n.link[i]));
+				dread(p, &s, sizeof(struct item_stat), BLOCK_OFF(sb, in.f[0]));
+				if (strcmp(s.name, name) == 0 && ((type == 0) || (s.type == type))) {
+					if (DEBUG) {
+						printf("\nFound key at key index: %d", i);
+					}
+					if (id_or_loc == 0) {
+						ret = s.k.id;
+					} else {
+						ret = n.link[i];
+					}
+					break;
+				}
+			}
+		}
+
+		if ((ret != -1) || (n.key[n.size - 1].dir_id > (unsigned) dir_id)) {
+			unlatch(l);
+
+			break;
+		}
+
+		if (DEBUG) {
+			printf("\n\tGoing right from this node because it also has the same dir_id");
+		}
+		l = next_leaf(p, sb, l, &curr, &n, &start);
+	}
+
+	return ret;
+}
+
+/**
+ * Returns the id of the directory at path, relative to directory dir_id or to / if it
+ * starts with a /, with its names separated by / (. and .. included), or -1 if one of
+ * them is not a directory.
+ */
+int find_dir(FILE *p, struct superblock *sb, int dir_id, char *path)
+{
+	char *name;
+	char *save;
+	char buf[PATH_MAX];
+
+	snprintf(buf, sizeof(buf), "%s", path);
+
+	if (buf[0] == '/') {
+		dir_id = 1;
+	}
+
+	for (name = strtok_r(buf, "/", &save); (name != NULL) && (dir_id != -1); name = strtok_r(NULL, "/", &save)) {
+		if (strcmp(name, ".") != 0) {
+			dir_id = find(p, sb, dir_id, name, 2, 0);
+		}
+	}
+
+	return dir_id;
+}
+
+/**
+ * Imports local file path as file name of directory dir_id. With IMPORT_DEDUP in flags,
+ * every block is looked up in the dedup index first and shared if an equal block is
+ * already stored (see dedup_block()). With IMPORT_COMPRESS, the file is compressed a
+ * cluster at a time (see import_cluster()). Either way the savings and the throughput
+ * are reported. If the image fills up, the part imported is removed again. Returns 0,
+ * or -1 if the file was not imported.
+ */
+int import(FILE *p, struct superblock *sb, char path[], int dir_id, char name[], int flags)
+{
+	FILE *f;
+	int i;
+	int j;
+	double secs;
+	off_t size;
+	int inode_loc;
+	int freeblock;
+	int lastblock;
+	int lastblockbytes;
+	int blocks_req;
+	int count;
+	int used;
+	int d_used;
+	struct inode in;
+	struct item_stat s;
+	struct hole_scan hs;
+	struct import_state is;
+	struct timespec start;
+	struct timespec end;
+	char block[MAX_BS];
+	int d_indirect[PTRS(MAX_BS)];
+	int indirect[PTRS(MAX_BS)];
+
+	memset(block, 0, sb->blocksize);
+	count = 0;
+	lastblock = -1;
+	memset(&is, 0, sizeof(is));
+	is.dedup = ((flags & IMPORT_DEDUP) != 0);
+	is.compress = ((flags & IMPORT_COMPRESS) != 0);
+
+	if (is.dedup && (sb->dedup_blocks == 0)) {
+		printf("\nThis image was made before the dedup index existed. Run makefs to deduplicate.");
+		is.dedup = false;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if ((f = fopen(path, "rb")) == NULL) {
+		printf("\nCan not open %s", path);
+
+		return -1;
+	}
+
+	fseeko(f, 0, SEEK_END);
+	size = ftello(f);
+	blocks_req = size / sb->blocksize;
+	is.total = (size + sb->blocksize - 1) / sb->blocksize;
+
+	if (is.compress) {
+		is.zin = (char *) malloc((size_t) CLUSTER * sb->blocksize);
+		is.zout = (char *) malloc((size_t) CLUSTER * sb->blocksize);
+	}
+
+	is.run = (char *) malloc(IMPORT_CHUNK);
+
+	if (size % sb->blocksize != 0) {
+		++blocks_req;
+		lastblockbytes = size % sb->blocksize;
+	} else {
+		lastblockbytes = sb->blocksize;
+	}
+	inode_loc = new_empty_file_dir(p, sb, name, dir_id, 4);
+
+	if (inode_loc < 0) {
+		fclose(f);
+		free(is.zin);
+		free(is.zout);
+		free(is.run);
+
+		return -1;
+	}
+
+	begin_op();
+
+	/* indexed blocks are owned by the index too, so their files copy them before writing */
+	if (is.dedup && (sb->shared == 0)) {
+		pthread_mutex_lock(&sb_lock);
+		sb->shared = 1;
+		pthread_mutex_unlock(&sb_lock);
+		update_sb(p, sb);
+	}
+
+	if (!batch) {
+		printf("\nBlock size for reading file: %lu", sizeof(block));
+	}
+
+	dread(p, &in, sizeof(struct inode), INODE_OFF(sb, inode_loc));
+
+	for (i = 1; i < 16; ++i) {
+		in.f[i] = -1;
+	}
+
+	hs.fd = fileno(f);
+	hs.data = 0;
+	hs.hole = 0;
+	hs.size = size;
+
+	for (i = 1, count = 0; (i < 14) && (count < blocks_req) && !is.full; ++i) {
+		if (DEBUG) {
+			printf("\n\n\tDirect block #%d", i);
+		}
+		freeblock = import_block(p, sb, f, &hs, count, block, &is);
+
+		in.f[i] = freeblock;
+		++count;
+		lastblock = freeblock;
+	}
+
+	if ((count < blocks_req) && !is.full) {
+		used = 0;
+
+		for (i = 0; i < PTRS(sb->blocksize); ++i) {
+			indirect[i] = -1;
+		}
+
+		for (i = 0; (i < PTRS(sb->blocksize)) && (count < blocks_req) && !is.full; ++i) {
+			freeblock = import_block(p, sb, f, &hs, count, block, &is);
+			indirect[i] = freeblock;
+			++count;
+			lastblock = freeblock;
+
+			if (freeblock != -1) {
+				++used;
+			}
+		}
+
+		if (used > 0) {
+			freeblock = alloc_block(p, sb, home_group());
+
+			if (freeblock == -1) {
+				is.full = true;
+				release_ptrs(p, sb, indirect, PTRS(sb->blocksize));
+			} else {
+				in.f[14] = freeblock;
+				dwrite(p, indirect, sb->blocksize, BLOCK_OFF(sb, freeblock));
+			}
+		}
+	}
+
+	if ((count < blocks_req) && !is.full) {
+		d_used = 0;
+
+		for (i = 0; i < PTRS(sb->blocksize); ++i) {
+			d_indirect[i] = -1;
+		}
+
+		for (i = 0; (i < PTRS(sb->blocksize)) && (count < blocks_req) && !is.full; ++i) {
+			used = 0;
+
+			for (j = 0; j < PTRS(sb->blocksize); ++j) {
+				indirect[j] = -1;
+			}
+
+			for(j = 0; (j < PTRS(sb->blocksize)) && (count < blocks_req) && !is.full; ++j) {
+				freeblock = import_block(p, sb, f, &hs, count, block, &is);
+				indirect[j] = freeblock;
+				++count;
+				lastblock = freeblock;
+
+				if (freeblock != -1) {
+					++used;
+				}
+			}
+
+			if (used > 0) {
+				freeblock = alloc_block(p, sb, home_group());
+
+				if (freeblock == -1) {
+					is.full = true;
+					release_ptrs(p, sb, indirect, PTRS(sb->blocksize));
+				} else {
+					d_indirect[i] = freeblock;
+					++d_used;
+					dwrite(p, indirect, sb->blocksize, BLOCK_OFF(sb, freeblock));
+				}
+			}
+		}
+
+		if (d_used > 0) {
+			freeblock = alloc_block(p, sb, home_group());
+
+			if (freeblock == -1) {
+				is.full = true;
+
+				for (i = 0; i < PTRS(sb->blocksize); ++i) {
+					if (d_indirect[i] != -1) {
+						read_ptr_block(p, sb->blocksize, d_indirect[i], indirect);
+						release_ptrs(p, sb, indirect, PTRS(sb->blocksize));
+						release_block(p, sb, d_indirect[i]);
+					}
+				}
+			} else {
+				in.f[15] = freeblock;
+				dwrite(p, d_indirect, sb->blocksize, BLOCK_OFF(sb, freeblock));
+			}
+		}
+	}
+
+	import_flush(p, sb, &is);
+	fclose(f);
+	free(is.zin);
+	free(is.zout);
+	free(is.run);
+	
+	dread(p, &s, sizeof(struct item_stat), BLOCK_OFF(sb, in.f[0]));
+	s.lastblock = lastblock;
+	s.lastblockbytes = lastblockbytes;
+	s.blocks = blocks_req;
+	dwrite(p, &s, sizeof(struct item_stat), BLOCK_OFF(sb, in.f[0]));
+
+	dwrite(p, &in, sizeof(struct inode), INODE_OFF(sb, inode_loc));
+
+	invalidate_map(inode_loc);
+	end_op(p);
+
+	/* the blocks stored so far are in its block map, and go with it */
+	if (is.full) {
+		printf("\nERROR: The image is full, %s was not imported.", path);
+		remove_item(p, sb, dir_id, name, false, dir_id);
+
+		return -1;
+	}
+
+	if (DEBUG) {
+		printf("\nLast block: %d, last block bytes: %d, blocks: %d", lastblock, s.lastblockbytes, s.blocks);
+	}
+
+	if (!batch) {
+		printf("\nWrote one file successfully. File size = %ld Bytes", (long) size);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	if (is.dedup) {
+		/* ratio of blocks imported to blocks written, all of them shared counts as one written */
+		printf("\nDeduplicated %lld of %lld blocks, dedup ratio %.2f", is.shared, is.blocks,
+				(is.blocks > is.shared) ? (double) is.blocks / (is.blocks - is.shared) : (double) ((is.blocks > 0) ? is.blocks : 1));
+	}
+
+	if (is.compress) {
+		printf("\nCompressed %lld of %d blocks into %lld, ratio %.2f", is.packed, is.total, is.stored,
+				(is.stored > 0) ? (double) is.packed / is.stored : 1);
+	}
+
+	if (is.dedup || is.compress) {
+		printf(", %.1f MB/s", (secs > 0) ? size / secs / (1 << 20) : 0);
+	}
+
+	return 0;
+}
+
+/**
+ * Drops an owner of each of the n blocks at ptr, which an import could not link to the
+ * file for want of a pointer block. Holes and compressed lengths are skipped.
+ */
+void release_ptrs(FILE *p, struct superblock *sb, int *ptr, int n)
+{
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		if (ptr[i] >= 0) {
+			release_block(p, sb, ptr[i]);
+		}
+	}
+
+	return;
+}
+
+void extract(FILE *p, struct superblock *sb, int dir_id, char *name, char *fname)
+{
+	int inode_loc;
+
+	inode_loc = find(p, sb, dir_id, name, 4, 1);
+
+	if (inode_loc == -1) {
+		return;
+	}
+/*
+	if (access(fname, F_OK) != 1) {
+		printf("\nFile with name %s already exists in local folder. Please choose another name.", fname);
+
+		return;
+	}
+*/
+	export_file(p, sb, inode_loc, fname);
+
+	return;
+}
+
+/**
+ * Writes the file whose inode is at inode_loc to host file fname, recreating its holes.
+ * Blocks that follow one another in the image are read up to EXPORT_RUN bytes at a time.
+ * Compressed clusters are decompressed as they are reached, and blocks that do not match
+ * their checksums are reported. Returns the file size, or -1
+ * if fname could not be created.
+ */
+off_t export_file(FILE *p, struct superblock *sb, int inode_loc, char *fname)
+{
+	FILE *f;
+	int i;
+	int j;
+	int n;
+	int loc;
+	int lbb;
+	int max;
+	int blocks;
+	off_t size;
+	char *zbuf;
+	char *run;
+	char *block;
+	struct open_file *of;
+	struct readahead ra;
+
+	f = fopen(fname, "wb");
+
+	if (f == NULL) {
+		printf("\nCan not create %s", fname);
+
+		return -1;
+	}
+
+	of = open_file(p, sb, inode_loc);
+
+	blocks = of->blocks;
+	size = of->size;
+	lbb = of->size - (off_t) (blocks - 1) * sb->blocksize;
+	max = EXPORT_RUN / sb->blocksize;
+	zbuf = NULL;
+	run = (char *) malloc(EXPORT_RUN);
+	ra_init(&ra);
+
+	for (i = 0; i < blocks; i += n) {
+		if (DEBUG) {
+			printf("\nReading block #%d", i);
+		}
+
+		loc = map_block(of, i);
+		ra_file(p, of, &ra, i);
+		n = 1;
+
+		if (cluster_packed(of, i)) {
+			if (zbuf == NULL) {
+				zbuf = (char *) malloc((size_t) CLUSTER * sb->blocksize);
+			}
+
+			if ((i % CLUSTER == 0) && (read_cluster(p, of, i / CLUSTER, zbuf) == -1)) {
+				memset(zbuf, 0, (size_t) CLUSTER * sb->blocksize);
+			}
+
+			block = zbuf + (size_t) (i % CLUSTER) * sb->blocksize;
+		} else if (loc == -1) {
+			fseek(f, (i == blocks - 1) ? lbb : sb->blocksize, SEEK_CUR);
+
+			continue;
+		} else {
+			for (; (i + n < blocks) && (n < max) && (map_block(of, i + n) == loc + n) &&
+					(((i + n) % CLUSTER != 0) || !cluster_packed(of, i + n)); ++n) {
+				ra_file(p, of, &ra, i + n);
+			}
+
+			dread(p, run, (size_t) n * sb->blocksize, BLOCK_OFF(sb, loc));
+			block = run;
+
+			for (j = 0; j < n; ++j) {
+				if (!check_csum(p, loc + j, run + (size_t) j * sb->blocksize)) {
+					printf("\nERROR: Block %d of %s (block %d of the image) does not match its checksum.", i + j, fname, loc + j);
+				}
+			}
+		}
+
+		if (i + n == blocks) {
+			fwrite(block, (size_t) (n - 1) * sb->blocksize + lbb, 1, f);
+		} else {
+			fwrite(block, (size_t) n * sb->blocksize, 1, f);
+		}
+	}
+
+	close_file(of);
+	free(zbuf);
+	free(run);
+
+	fflush(f);
+	ftruncate(fileno(f), size);
+	fclose(f);
+
+	return size;
+}
+
+/**
+ * Prints the SHA-256 of file name of directory dir_id, like sha256sum, and the speed it
+ * was read at. With stored set, prints its block digest instead (see digest_file()).
+ */
+void digest(FILE *p, struct superblock *sb, int dir_id, char *name, bool stored)
+{
+	int i;
+	int inode_loc;
+	off_t size;
+	double secs;
+	char hex[65];
+	unsigned char out[32];
+	struct timespec start;
+	struct timespec end;
+
+	inode_loc = find(p, sb, dir_id, name, 4, 1);
+
+	if (inode_loc == -1) {
+		printf("\nNo file by the name %s", name);
+
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	size = digest_file(p, sb, inode_loc, stored, out);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	for (i = 0; i < 32; ++i) {
+		sprintf(hex + 2 * i, "%02x", out[i]);
+	}
+
+	printf("\n%s  %s%s", hex, name, stored ? " (block digest)" : "");
+
+	if (!batch) {
+		printf("\n%lld bytes in %.3f s: %.1f MB/s", (long long) size, secs, size / secs / (1 << 20));
+	}
+
+	return;
+}
+
+/**
+ * Computes the SHA-256 of the file whose inode is at inode_loc into out, streaming it
+ * from the image: runs of contiguous blocks are read up to DIGEST_RUN bytes at a time
+ * behind the readahead of ra_file(), holes are hashed as zeroes without reading anything
+ * and compressed clusters are decompressed. Blocks that do not match their checksums are
+ * reported. Returns the size of the file.
+ *
+ * With stored set, it computes the block digest instead: the SHA-256 of the file size
+ * followed by the CRC32C of every block (see block_csum()), the last one padded with
+ * zeroes. The checksums are taken from the checksum map, so runs of blocks that have
+ * them are not read at all. It is the same for files with the same contents however they
+ * are stored, so files can be compared by it, but it is not the SHA-256 of the file.
+ */
+off_t digest_file(FILE *p, struct superblock *sb, int inode_loc, bool stored, unsigned char *out)
+{
+	int i;
+	int j;
+	int n;
+	int bs;
+	int max;
+	int loc;
+	int lbb;
+	int blocks;
+	bool have;
+	off_t size;
+	char *buf;
+	unsigned int zcrc;
+	unsigned int *sums;
+	struct sha256 h;
+	struct open_file *of;
+	struct readahead ra;
+
+	of = open_file(p, sb, inode_loc);
+
+	bs = sb->blocksize;
+	max = DIGEST_RUN / bs;
+	blocks = of->blocks;
+	size = of->size;
+	lbb = size - (off_t) (blocks - 1) * bs;
+	buf = (char *) calloc(1, DIGEST_RUN);
+	sums = (unsigned int *) malloc(max * sizeof(unsigned int));
+	zcrc = block_csum(buf, bs);
+	sha256_init(&h);
+	ra_init(&ra);
+
+	if (stored) {
+		sha256_update(&h, &size, sizeof(size));
+	}
+
+	for (i = 0; i < blocks; i += n) {
+		loc = map_block(of, i);
+		have = true;
+
+		if (cluster_packed(of, i)) {
+			n = (blocks - i < CLUSTER) ? blocks - i : CLUSTER;
+
+			for (j = 0; j < n; ++j) {
+				ra_file(p, of, &ra, i + j);
+				sums[j] = 0;
+			}
+
+			if (read_cluster(p, of, i / CLUSTER, buf) == -1) {
+				memset(buf, 0, (size_t) n * bs);
+			}
+		} else if (loc == -1) {
+			for (n = 1; (i + n < blocks) && (n < max) && (map_block(of, i + n) == -1); ++n)
+				;
+
+			memset(buf, 0, (size_t) n * bs);
+
+			for (j = 0; j < n; ++j) {
+				sums[j] = zcrc;
+			}
+		} else {
+			for (n = 1; (i + n < blocks) && (n < max) && (map_block(of, i + n) == loc + n) &&
+					(((i + n) % CLUSTER != 0) || !cluster_packed(of, i + n)); ++n)
+				;
+
+			if (journal.csum_blocks > 0) {
+				dread(p, sums, n * sizeof(unsigned int), BLOCK_OFF(sb, sb->csum) + (off_t) loc * sizeof(unsigned int));
+			} else {
+				memset(sums, 0, n * sizeof(unsigned int));
+			}
+
+			have = !stored || (i + n == blocks);
+
+			for (j = 0; (j < n) && !have; ++j) {
+				have = (sums[j] == 0);
+			}
+
+			if (have) {
+				for (j = 0; j < n; ++j) {
+					ra_file(p, of, &ra, i + j);
+				}
+
+				dread(p, buf, (size_t) n * bs, BLOCK_OFF(sb, loc));
+
+				for (j = 0; j < n; ++j) {
+					if ((sums[j] != 0) && (sums[j] != block_csum(buf + (size_t) j * bs, bs))) {
+						printf("\nERROR: Block %d of inode %d (block %d of the image) does not match its checksum.",
+								i + j, inode_loc, loc + j);
+					}
+				}
+			}
+		}
+
+		if (!stored) {
+			sha256_update(&h, buf, (size_t) (n - 1) * bs + ((i + n == blocks) ? lbb : bs));
+
+			continue;
+		}
+
+		if (i + n == blocks) {
+			memset(buf + (size_t) (n - 1) * bs + lbb, 0, bs - lbb);
+		}
+
+		for (j = 0; j < n; ++j) {
+			if (have) {
+				sums[j] = block_csum(buf + (size_t) j * bs, bs);
+			}
+
+			sha256_update(&h, &sums[j], sizeof(unsigned int));
+		}
+	}
+
+	sha256_final(&h, out);
+
+	close_file(of);
+	free(buf);
+	free(sums);
+
+	return size;
+}
+
+/**
+ * Exports directory dir_id and everything below it into host directory path. The tree is
+ * walked breadth first, one leaf range scan per directory, creating the host directories
+ * on the way. The files are then sorted by the block number of their first data block
+ * and exported in that order by threads workers, so the image is read mostly front to back.
+ */
+void export_tree(FILE *p, struct superblock *sb, int dir_id, char *path, int threads)
+{
+	int i;
+	int d;
+	int n;
+	int n_dirs;
+	int cap_dirs;
+	int cap_jobs;
+	double secs;
+	char child[PATH_MAX];
+	pthread_t *tid;
+	struct dir_entry *ents;
+	struct export_job *dirs;
+	struct export_batch b;
+	struct timespec start;
+	struct timespec end;
+
+	if (threads < 1) {
+		threads = 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* inode_loc of a dirs entry holds the directory id */
+	n_dirs = 1;
+	cap_dirs = 16;
+	dirs = (struct export_job *) malloc(cap_dirs * sizeof(struct export_job));
+	dirs[0].inode_loc = dir_id;
+	snprintf(dirs[0].path, PATH_MAX, "%s", path);
+
+	b.n_jobs = 0;
+	cap_jobs = 64;
+	b.jobs = (struct export_job *) malloc(cap_jobs * sizeof(struct export_job));
+
+	if ((mkdir(path, 0755) != 0) && (access(path, W_OK) != 0)) {
+		printf("\nCan not create directory %s", path);
+		free(dirs);
+		free(b.jobs);
+
+		return;
+	}
+
+	for (d = 0; d < n_dirs; ++d) {
+		n = scan_dir(p, sb, dirs[d].inode_loc, 0, &ents);
+
+		for (i = 0; i < n; ++i) {
+			if (strcmp(ents[i].name, "..") == 0) {
+				continue;
+			}
+
+			if (snprintf(child, PATH_MAX, "%s/%s", dirs[d].path, ents[i].name) >= PATH_MAX) {
+				printf("\nPath of %s is too long, skipped", ents[i].name);
+				continue;
+			}
+
+			if (ents[i].type == 2) {
+				if (n_dirs == cap_dirs) {
+					cap_dirs *= 2;
+					dirs = (struct export_job *) realloc(dirs, cap_dirs * sizeof(struct export_job));
+				}
+
+				dirs[n_dirs].inode_loc = ents[i].id;
+				strcpy(dirs[n_dirs].path, child);
+				mkdir(dirs[n_dirs].path, 0755);
+				++n_dirs;
+			} else {
+				if (b.n_jobs == cap_jobs) {
+					cap_jobs *= 2;
+					b.jobs = (struct export_job *) realloc(b.jobs, cap_jobs * sizeof(struct export_job));
+				}
+
+				b.jobs[b.n_jobs].inode_loc = ents[i].inode_loc;
+				b.jobs[b.n_jobs].first = ents[i].first;
+				strcpy(b.jobs[b.n_jobs].path, child);
+				++b.n_jobs;
+			}
+		}
+
+		free(ents);
+	}
+
+	qsort(b.jobs, b.n_jobs, sizeof(struct export_job), cmp_export_job);
+
+	b.p = p;
+	b.sb = sb;
+	b.next = 0;
+	b.bytes = 0;
+
+	tid = (pthread_t *) malloc(threads * sizeof(pthread_t));
+
+	for (i = 0; i < threads; ++i) {
+		pthread_create(&tid[i], NULL, export_worker, &b);
+	}
+
+	for (i = 0; i < threads; ++i) {
+		pthread_join(tid[i], NULL);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("\nExported %d directories, %d files, %lld bytes in %.3f s: %.1f MB/s (%d workers)",
+			n_dirs, b.n_jobs, b.bytes, secs, b.bytes / secs / (1 << 20), threads);
+
+	free(tid);
+	free(dirs);
+	free(b.jobs);
+
+	return;
+}
+
+void *export_worker(void *arg)
+{
+	int i;
+	off_t size;
+	struct export_batch *b;
+
+	b = (struct export_batch *) arg;
+
+	while ((i = __sync_fetch_and_add(&b->next, 1)) < b->n_jobs) {
+		size = export_file(b->p, b->sb, b->jobs[i].inode_loc, b->jobs[i].path);
+
+		if (size > 0) {
+			__sync_fetch_and_add(&b->bytes, (long long) size);
+		}
+	}
+
+	return NULL;
+}
+
+int cmp_export_job(const void *a, const void *b)
+{
+	return ((const struct export_job *) a)->first - ((const struct export_job *) b)->first;
+}
+
+int cmp_int(const void *a, const void *b)
+{
+	return *(const int *) a - *(const int *) b;
+}
+
+/**
+ * Verifies every data block of the image against its checksum with threads workers, and
+ * reports the blocks that do not match. The image is read in order, in SCRUB_CHUNK reads
+ * that skip the start and end of chunks without checksums, and chunks without any are not
+ * read at all.
+ */
+void scrub(FILE *p, struct superblock *sb, int threads)
+{
+	int i;
+	double secs;
+	pthread_t *tid;
+	struct scrub_batch b;
+	struct timespec start;
+	struct timespec end;
+
+	if (sb->csum_blocks == 0) {
+		printf("\nThis image was made before checksums existed and can not be scrubbed. Run makefs to format it again.");
+
+		return;
+	}
+
+	if (threads < 1) {
+		threads = 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	image_advise(p, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	b.p = p;
+	b.sb = sb;
+	b.per = SCRUB_CHUNK / sb->blocksize;
+	b.chunks = (sb->blocks - 1) / b.per + 1;
+	b.next = 0;
+	b.checked = 0;
+	b.bad = 0;
+	b.bytes = 0;
+
+	tid = (pthread_t *) malloc(threads * sizeof(pthread_t));
+
+	for (i = 0; i < threads; ++i) {
+		pthread_create(&tid[i], NULL, scrub_worker, &b);
+	}
+
+	for (i = 0; i < threads; ++i) {
+		pthread_join(tid[i], NULL);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("\nScrubbed %lld blocks, %lld bytes in %.3f s: %.1f MB/s, %lld bad (%d workers)",
+			b.checked, b.bytes, secs, b.bytes / secs / (1 << 20), b.bad, threads);
+
+	free(tid);
+
+	return;
+}
+
+void *scrub_worker(void *arg)
+{
+	int c;
+	int i;
+	int n;
+	int lo;
+	int hi;
+	int first;
+	int bs;
+	long long bad;
+	long long checked;
+	char *buf;
+	unsigned int *sums;
+	struct scrub_batch *b;
+
+	b = (struct scrub_batch *) arg;
+	bs = b->sb->blocksize;
+	buf = (char *) malloc(SCRUB_CHUNK);
+	sums = (unsigned int *) malloc(b->per * sizeof(unsigned int));
+
+	while ((c = __sync_fetch_and_add(&b->next, 1)) < b->chunks) {
+		first = c * b->per;
+		n = (b->sb->blocks - first < b->per) ? b->sb->blocks - first : b->per;
+
+		dread(b->p, sums, n * sizeof(unsigned int), BLOCK_OFF(b->sb, b->sb->csum) + (off_t) first * sizeof(unsigned int));
+
+		for (lo = 0; (lo < n) && (sums[lo] == 0); ++lo)
+			;
+
+		if (lo == n) {
+			continue;
+		}
+
+		for (hi = n; sums[hi - 1] == 0; --hi)
+			;
+
+		dread(b->p, buf, (size_t) (hi - lo) * bs, BLOCK_OFF(b->sb, first + lo));
+
+		bad = 0;
+		checked = 0;
+
+		for (i = lo; i < hi; ++i) {
+			if (sums[i] == 0) {
+				continue;
+			}
+
+			++checked;
+
+			if (block_csum(buf + (size_t) (i - lo) * bs, bs) != sums[i]) {
+				printf("\nERROR: Block %d does not match its checksum.", first + i);
+				++bad;
+			}
+		}
+
+		__sync_fetch_and_add(&b->checked, checked);
+		__sync_fetch_and_add(&b->bad, bad);
+		__sync_fetch_and_add(&b->bytes, (long long) (hi - lo) * bs);
+	}
+
+	free(buf);
+	free(sums);
+
+	return NULL;
+}
+
+/**
+ * Returns byte location of the pointer slot for logical block index (0-based) of a file.
+ * index 0-12 live in the inode itself (f[1-13]), the next PTRS(blocksize) in the single
+ * indirect block and the rest in the double indirect blocks. Missing indirect blocks are allocated,
+ * initialised to -1 and linked in on the way, so the caller only has to write the pointer.
+ * Indirect blocks shared with a snapshot are copied on the way as well, so the inode has
+ * to be private (see cow_item()). Returns -1 if index is beyond the maximum file size or
+ * no blocks are left.
+ */
+off_t block_slot(FILE *p, struct superblock *sb, int inode_loc, struct inode *in, int index)
+{
+	int i;
+	int fb;
+	int loc;
+	int indirect[PTRS(MAX_BS)];
+
+	if (index < 13) {
+		return INODE_OFF(sb, inode_loc) + (index + 1) * sizeof(int);
+	}
+
+	index -= 13;
+
+	for (i = 0; i < PTRS(sb->blocksize); ++i) {
+		indirect[i] = -1;
+	}
+
+	if (index < PTRS(sb->blocksize)) {
+		if (in->f[14] == -1) {
+			fb = alloc_block(p, sb, home_group());
+
+			if (fb == -1) {
+				return -1;
+			}
+
+			dwrite(p, indirect, sb->blocksize, BLOCK_OFF(sb, fb));
+
+			in->f[14] = fb;
+			dwrite(p, &in->f[14], sizeof(int), INODE_OFF(sb, inode_loc) + 14 * sizeof(int));
+		}
+
+		fb = cow_ptr_block(p, sb, in->f[14]);
+
+		if (fb == -1) {
+			return -1;
+		} else if (fb != in->f[14]) {
+			in->f[14] = fb;
+			dwrite(p, &in->f[14], sizeof(int), INODE_OFF(sb, inode_loc) + 14 * sizeof(int));
+		}
+
+		return BLOCK_OFF(sb, in->f[14]) + index * sizeof(int);
+	}
+
+	index -= PTRS(sb->blocksize);
+
+	if (index >= PTRS(sb->blocksize) * PTRS(sb->blocksize)) {
+		return -1;
+	}
+
+	if (in->f[15] == -1) {
+		fb = alloc_block(p, sb, home_group());
+
+		if (fb == -1) {
+			return -1;
+		}
+
+		dwrite(p, indirect, sb->blocksize, BLOCK_OFF(sb, fb));
+
+		in->f[15] = fb;
+		dwrite(p, &in->f[15], sizeof(int), INODE_OFF(sb, inode_loc) + 15 * sizeof(int));
+	}
+
+	fb = cow_ptr_block(p, sb, in->f[15]);
+
+	if (fb == -1) {
+		return -1;
+	} else if (fb != in->f[15]) {
+		in->f[15] = fb;
+		dwrite(p, &in->f[15], sizeof(int), INODE_OFF(sb, inode_loc) + 15 * sizeof(int));
+	}
+
+	dread(p, &loc, sizeof(int), BLOCK_OFF(sb, in->f[15]) + (index / PTRS(sb->blocksize)) * sizeof(int));
+
+	if (loc != -1) {
+		fb = cow_ptr_block(p, sb, loc);
+
+		if (fb == -1) {
+			return -1;
+		} else if (fb != loc) {
+			loc = fb;
+			dwrite(p, &loc, sizeof(int), BLOCK_OFF(sb, in->f[15]) + (index / PTRS(sb->blocksize)) * sizeof(int));
+		}
+	}
+
+	if (loc == -1) {
+		fb = alloc_block(p, sb, home_group());
+
+		if (fb == -1) {
+			return -1;
+		}
+
+		dwrite(p, indirect, sb->blocksize, BLOCK_OFF(sb, fb));
+
+		loc = fb;
+		dwrite(p, &loc, sizeof(int), BLOCK_OFF(sb, in->f[15]) + (index / PTRS(sb->blocksize)) * sizeof(int));
+	}
+
+	return BLOCK_OFF(sb, loc) + (index % PTRS(sb->blocksize)) * sizeof(int);
+}
+
+/**
+ * Returns indirect block b, or a copy of it if it is shared with a snapshot. The blocks
+ * it points to gain an owner, the copy, and b loses one. Returns -1 if no block was left.
+ */
+int cow_ptr_block(FILE *p, struct superblock *sb, int b)
+{
+	int i;
+	int fb;
+	int ptr[PTRS(MAX_BS)];
+
+	if (get_ref(p, sb, b) == 0) {
+		return b;
+	}
+
+	fb = alloc_block(p, sb, home_group());
+
+	if (fb == -1) {
+		err_noblocks();
+
+		return -1;
+	}
+
+	dread(p, ptr, sb->blocksize, BLOCK_OFF(sb, b));
+
+	for (i = 0; i < PTRS(sb->blocksize); ++i) {
+		if (ptr[i] >= 0) {
+			add_ref(p, sb, ptr[i], 1);
+		}
+	}
+
+	dwrite(p, ptr, sb->blocksize, BLOCK_OFF(sb, fb));
+	add_ref(p, sb, b, -1);
+
+	return fb;
+}
+
+/**
+ * Makes the data block whose pointer is at byte location slot (from block_slot()) private
+ * before it is written: a block shared with a snapshot is copied to a new block, which
+ * the pointer is changed to. Returns the block to write to, -1 for a hole or if no block
+ * was left.
+ */
+int cow_data(FILE *p, struct superblock *sb, off_t slot)
+{
+	int loc;
+	int fb;
+	char block[MAX_BS];
+
+	dread(p, &loc, sizeof(int), slot);
+
+	if ((loc < 0) || (get_ref(p, sb, loc) == 0)) {
+		return loc;
+	}
+
+	fb = alloc_block(p, sb, home_group());
+
+	if (fb == -1) {
+		err_noblocks();
+
+		return -1;
+	}
+
+	dread(p, block, sb->blocksize, BLOCK_OFF(sb, loc));
+	data_write(p, block, sb->blocksize, BLOCK_OFF(sb, fb));
+	dwrite(p, &fb, sizeof(int), slot);
+	add_ref(p, sb, loc, -1);
+
+	return fb;
+}
+
+/**
+ * Stores the compressed clusters holding logical blocks from to to of a file as plain
+ * blocks again, before they are written to, and releases their compressed data (see
+ * release_block()). The inode has to be private (see cow_item()). s->lastblock is
+ * updated if the last block moves. All new blocks of a cluster are allocated before its
+ * map is changed, so it is never left half plain. Returns false if no blocks were left
+ * or a cluster is damaged.
+ */
+bool unpack_clusters(FILE *p, struct superblock *sb, int inode_loc, struct inode *in, struct item_stat *s, int from, int to)
+{
+	int c;
+	int i;
+	int n;
+	int lb;
+	int fb[CLUSTER];
+	int old[CLUSTER];
+	bool ok;
+	bool changed;
+	off_t slot;
+	char *buf;
+	struct open_file *of;
+
+	of = open_file(p, sb, inode_loc);
+	buf = NULL;
+	ok = true;
+	changed = false;
+
+	for (c = from / CLUSTER; ok && (c <= to / CLUSTER) && (c * CLUSTER < of->blocks); ++c) {
+		if (!cluster_packed(of, c * CLUSTER)) {
+			continue;
+		}
+
+		if (buf == NULL) {
+			buf = (char *) malloc((size_t) CLUSTER * sb->blocksize);
+		}
+
+		if (read_cluster(p, of, c, buf) == -1) {
+			ok = false;
+
+			break;
+		}
+
+		n = (of->blocks - c * CLUSTER < CLUSTER) ? of->blocks - c * CLUSTER : CLUSTER;
+
+		for (i = 0; i < n; ++i) {
+			old[i] = map_block(of, c * CLUSTER + i);
+			fb[i] = -1;
+
+			if (zero_block(buf + (size_t) i * sb->blocksize, sb->blocksize)) {
+				continue;
+			}
+
+			fb[i] = alloc_block(p, sb, home_group());
+
+			if (fb[i] == -1) {
+				ok = false;
+
+				break;
+			}
+
+			data_write(p, buf + (size_t) i * sb->blocksize, sb->blocksize, BLOCK_OFF(sb, fb[i]));
+		}
+
+		if (!ok) {
+			/* never linked, so nothing committed can point to them */
+			while (--i >= 0) {
+				if (fb[i] != -1) {
+					free_block(p, sb, fb[i]);
+				}
+			}
+
+			break;
+		}
+
+		for (i = 0; i < n; ++i) {
+			lb = c * CLUSTER + i;
+			slot = block_slot(p, sb, inode_loc, in, lb);
+
+			if (slot == -1) {
+				ok = false;
+
+				break;
+			}
+
+			dwrite(p, &fb[i], sizeof(int), slot);
+
+			if (old[i] >= 0) {
+				release_block(p, sb, old[i]);
+			}
+
+			if (lb == s->blocks - 1) {
+				s->lastblock = fb[i];
+			}
+		}
+
+		changed = true;
+	}
+
+	close_file(of);
+	free(buf);
+
+	if (changed) {
+		invalidate_map(inode_loc);
+	}
+
+	return ok;
+}
+
+/**
+ * Appends the contents of local file path to the end of an existing file.
+ * The partially used last block (s.lastblock) is filled first, after which new blocks
+ * are linked into slot s.blocks onwards, so the cost depends only on the bytes appended.
+ * A last block that is a hole gets a zeroed block before it is filled, and one shared
+ * with a snapshot a copy. A compressed last cluster is stored plain first.
+ */
+void append(FILE *p, struct superblock *sb, char path[], int dir_id, char name[])
+{
+	FILE *f;
+	int n;
+	off_t size;
+	off_t remaining;
+	int inode_loc;
+	off_t slot;
+	int freeblock;
+	char block[MAX_BS];
+	struct inode in;
+	struct item_stat s;
+
+	inode_loc = find(p, sb, dir_id, name, 4, 1);
+
+	if (inode_loc == -1) {
+		printf("\nNo file by the name %s", name);
+
+		return;
+	}
+
+	f = fopen(path, "rb");
+
+	if (f == NULL) {
+		printf("\nCould not open local file %s", path);
+
+		return;
+	}
+
+	fseeko(f, 0, SEEK_END);
+	size = ftello(f);
+	fseek(f, 0, SEEK_SET);
+	remaining = size;
+
+	begin_op();
+
+	inode_loc = cow_item(p, sb, inode_loc);
+
+	if (inode_loc == -1) {
+		fclose(f);
+		end_op(p);
+
+		return;
+	}
+
+	dread(p, &in, sizeof(struct inode), INODE_OFF(sb, inode_loc));
+	dread(p, &s, sizeof(struct item_stat), BLOCK_OFF(sb, in.f[0]));
+
+	if ((s.blocks > 0) && (remaining > 0) && !unpack_clusters(p, sb, inode_loc, &in, &s, s.blocks - 1, s.blocks - 1)) {
+		fclose(f);
+		end_op(p);
+
+		return;
+	}
+
+	if ((sb->shared != 0) && (s.lastblock != -1) && (s.lastblockbytes < sb->blocksize) && (remaining > 0)) {
+		slot = block_slot(p, sb, inode_loc, &in, s.blocks - 1);
+		s.lastblock = (slot == -1) ? -1 : cow_data(p, sb, slot);
+
+		if (s.lastblock == -1) {
+			fclose(f);
+			end_op(p);
+
+			return;
+		}
+	}
+
+	if ((s.blocks > 0) && (s.lastblockbytes < sb->blocksize) && (remaining > 0) && (s.lastblock == -1)) {
+		slot = block_slot(p, sb, inode_loc, &in, s.blocks - 1);
+		freeblock = alloc_block(p, sb, home_group());
+
+		if ((slot == -1) || (freeblock == -1)) {
+			fclose(f);
+			end_op(p);
+
+			return;
+		}
+
+		memset(block, 0, sb->blocksize);
+		data_write(p, block, sb->blocksize, BLOCK_OFF(sb, freeblock));
+
+		dwrite(p, &freeblock, sizeof(int), slot);
+
+		s.lastblock = freeblock;
+	}
+
+	if ((s.blocks > 0) && (s.lastblockbytes < sb->blocksize) && (remaining > 0)) {
+		n = sb->blocksize - s.lastblockbytes;
+		if (n > remaining) {
+			n = remaining;
+		}
+
+		fread(block, n, 1, f);
+		data_write(p, block, n, BLOCK_OFF(sb, s.lastblock) + s.lastblockbytes);
+
+		s.lastblockbytes += n;
+		remaining -= n;
+	}
+
+	while (remaining > 0) {
+		slot = block_slot(p, sb, inode_loc, &in, s.blocks);
+
+		if (slot == -1) {
+			printf("\nERROR: File %s cannot grow any further.", name);
+
+			break;
+		}
+
+		freeblock = alloc_block(p, sb, home_group());
+
+		if (freeblock == -1) {
+			break;
+		}
+
+		n = (remaining < sb->blocksize) ? remaining : sb->blocksize;
+		memset(block, 0, sb->blocksize);
+		fread(block, n, 1, f);
+
+		data_write(p, block, sb->blocksize, BLOCK_OFF(sb, freeblock));
+
+		dwrite(p, &freeblock, sizeof(int), slot);
+
+		s.lastblock = freeblock;
+		s.lastblockbytes = n;
+		++s.blocks;
+		remaining -= n;
+	}
+
+	fclose(f);
+
+	get_time(s.mtime);
+	dwrite(p, &s, sizeof(struct item_stat), BLOCK_OFF(sb, in.f[0]));
+
+	invalidate_map(inode_loc);
+	end_op(p);
+
+	if (DEBUG) {
+		printf("\nLast block: %d, last block bytes: %d, blocks: %d", s.lastblock, s.lastblockbytes, s.blocks);
+	}
+
+	if (!batch) {
+		printf("\nAppended %ld Bytes to %s", (long) (size - remaining), name);
+	}
+
+	return;
+}
+
+/**
+ * Copies file from of directory dir_id to a new file to in the same directory, without
+ * copying its data: the new inode points to the same data and indirect blocks, which gain
+ * an owner each, and whichever file writes to a shared block later gets a copy of it (see
+ * cow_data()). The source is file locked, so no write to it is half copied. Returns the
+ * number of blocks shared, or -1 if the copy could not be made.
+ */
+int copy_file(FILE *p, struct superblock *sb, int dir_id, char *from, char *to)
+{
+	int i;
+	int src;
+	int inode_loc;
+	struct Key k;
+	struct inode in;
+	struct inode cp;
+	struct item_stat s;
+	struct item_stat cs;
+	pthread_mutex_t *dl;
+	pthread_mutex_t *fl;
+
+	if (sb->refmap_blocks == 0) {
+		printf("\nThis image was made before shared blocks existed. Run makefs to copy files.");
+
+		return -1;
+	}
+
+	dl = &dir_lock[dir_id % DIR_LOCKS];
+	pthread_mutex_lock(dl);
+
+	/* a write to the source may give it a new inode until its lock is held */
+	do {
+		src = find(p, sb, dir_id, from, 4, 1);
+
+		if (src == -1) {
+			printf("\nNo file by the name %s", from);
+			pthread_mutex_unlock(dl);
+
+			return -1;
+		}
+
+		fl = &file_lock[src % FILE_LOCKS];
+		pthread_mutex_lock(fl);
+
+		if (find(p, sb, dir_id, from, 4, 1) == src) {
+			break;
+		}
+
+		pthread_mutex_unlock(fl);
+	} while (1);
+
+	begin_op();
+
+	if ((find(p, sb, dir_id, to, 4, 0) != -1) || (find(p, sb, dir_id, to, 2, 0) != -1)) {
+		printf("\nItem \"%s\" already exists!", to);
+		end_op(p);
+		pthread_mutex_unlock(fl);
+		pthread_mutex_unlock(dl);
+
+		return -1;
+	}
+
+	k.id = get_id(to, p, sb, dir_id, 4);
+	k.dir_id = dir_id;
+
+	inode_loc = make_item(p, sb, k, 4, to);
+
+	if (inode_loc == -1) {
+		end_op(p);
+		pthread_mutex_unlock(fl);
+		pthread_mutex_unlock(dl);
+
+		return -1;
+	}
+
+	dread(p, &in, sizeof(struct inode), INODE_OFF(sb, src));
+	dread(p, &s, sizeof(struct item_stat), BLOCK_OFF(sb, in.f[0]));
+	dread(p, &cp, sizeof(struct inode), INODE_OFF(sb, inode_loc));
+	dread(p, &cs, sizeof(struct item_stat), BLOCK_OFF(sb, cp.f[0]));
+
+	if (sb->shared == 0) {
+		pthread_mutex_lock(&sb_lock);
+		sb->shared = 1;
+		pthread_mutex_unlock(&sb_lock);
+	}
+
+	for (i = 1; i < 16; ++i) {
+		cp.f[i] = in.f[i];
+
+		if (cp.f[i] >= 0) {
+			add_ref(p, sb, cp.f[i], 1);
+		}
+	}
+
+	cs.lastblock = s.lastblock;
+	cs.lastblockbytes = s.lastblockbytes;
+	cs.blocks = s.blocks;
+	cs.uid = s.uid;
+	cs.gid = s.gid;
+	memcpy(cs.perm, s.perm, sizeof(cs.perm));
+
+	dwrite(p, &cp, sizeof(struct inode), INODE_OFF(sb, inode_loc));
+	dwrite(p, &cs, sizeof(struct item_stat), BLOCK_OFF(sb, cp.f[0]));
+
+	insert(p, k.id, k.dir_id, inode_loc, sb);
+	update_sb(p, sb);
+
+	end_op(p);
+	pthread_mutex_unlock(fl);
+	pthread_mutex_unlock(dl);
+
+	return s.blocks;
+}
+
+/**
+ * Moves item name of directory from (a file, or else a directory by that name) into
+ * directory to as to_name. The key of the item is taken out of the tree and put back
+ * under its new parent, and the key and name in its stat block are changed; a directory
+ * has its ".." record re-keyed as well. The items of a directory are keyed by its own id,
+ * which stays the same, so they are not touched and a move takes as long for a directory
+ * holding millions of items as for an empty one. "." and "..", the empty name and names
+ * with a / in them are refused, as name and as to_name. Returns 0, or -1 if nothing was
+ * moved.
+ */
+int move_item(FILE *p, struct superblock *sb, int from, char *name, int to, char *to_name)
+{
+	int x;
+	int type;
+	int inode_loc;
+	int dotdot;
+	struct inode in;
+	struct item_stat s;
+	pthread_mutex_t *dl[2];
+	pthread_mutex_t *fl;
+
+	if (!valid_name(name) || !valid_name(to_name)) {
+		printf("\nCan not move %s to %s: \".\", \"..\", empty names and names with / are not allowed.", name, to_name);
+
+		return -1;
+	}
+
+	/* only one move at a time, or two directories could be moved into each other */
+	pthread_mutex_lock(&move_lock);
+
+	dl[0] = &dir_lock[((from % DIR_LOCKS) < (to % DIR_LOCKS)) ? from % DIR_LOCKS : to % DIR_LOCKS];
+	dl[1] = &dir_lock[((from % DIR_LOCKS) < (to % DIR_LOCKS)) ? to % DIR_LOCKS : from % DIR_LOCKS];
+	pthread_mutex_lock(dl[0]);
+	if (dl[1] != dl[0]) {
+		pthread_mutex_lock(dl[1]);
+	}
+
+	fl = NULL;
+	type = 4;
+	inode_loc = find(p, sb, from, name, 4, 1);
+
+	if (inode_loc == -1) {
+		type = 2;
+		inode_loc = find(p, sb, from, name, 2, 1);
+	}
+
+	/* a write to a file may give it a new inode until its lock is held */
+	while ((type == 4) && (inode_loc != -1)) {
+		fl = &file_lock[inode_loc % FILE_LOCKS];
+		pthread_mutex_lock(fl);
+		x = find(p, sb, from, name, 4, 1);
+
+		if (x == inode_loc) {
+			break;
+		}
+
+		pthread_mutex_unlock(fl);
+		fl = NULL;
+		inode_loc = x;
+	}
+
+	begin_op();
+
+	if (inode_loc == -1) {
+		printf("\nNo file or directory by the name %s", name);
+	} else if ((from == to) && (strcmp(name, to_name) == 0)) {
+		inode_loc = -1;
+	} else if (find(p, sb, to, to_name, 0, 0) != -1) {
+		printf("\nItem \"%s\" already exists!", to_name);
+		inode_loc = -1;
+	} else if (type == 2) {
+		dread(p, &in, sizeof(struct inode), INODE_OFF(sb, inode_loc));
+		dread(p, &s, sizeof(struct item_stat), BLOCK_OFF(sb, in.f[0]));
+
+		for (x = to; (x != 1) && (x != -1) && (x != (int) s.k.id); x = find(p, sb, x, "..", 2, 0))
+			;
+
+		if (x == (int) s.k.id) {
+			printf("\nCan not move directory %s into itself.", name);
+			inode_loc = -1;
+		}
+	}
+
+	if (inode_loc != -1) {
+		inode_loc = cow_item(p, sb, inode_loc);
+	}
+
+	if (inode_loc != -1) {
+		dread(p, &in, sizeof(struct inode), INODE_OFF(sb, inode_loc));
+		dread(p, &s, sizeof(struct item_stat), BLOCK_OFF(sb, in.f[0]));
+
+		/* a rename in place keeps the key */
+		if (from != to) {
+			remove_key(p, sb, s.k);
+		}
+
+		s.k.dir_id = to;
+		strcpy(s.name, to_name);
+		dwrite(p, &s, sizeof(struct item_stat), BLOCK_OFF(sb, in.f[0]));
+
+		if (from != to) {
+			insert(p, s.k.id, s.k.dir_id, inode_loc, sb);
+		}
+
+		dotdot = ((type == 2) && (from != to)) ? find(p, sb, s.k.id, "..", 2, 1) : -1;
+		dotdot = (dotdot == -1) ? -1 : cow_item(p, sb, dotdot);
+
+		if (dotdot != -1) {
+			dread(p, &in, sizeof(struct inode), INODE_OFF(sb, dotdot));
+			dread(p, &s, sizeof(struct item_stat), BLOCK_OFF(sb, in.f[0]));
+
+			remove_key(p, sb, s.k);
+			s.k.id = to;
+			dwrite(p, &s, sizeof(struct item_stat), BLOCK_OFF(sb, in.f[0]));
+			insert(p, s.k.id, s.k.dir_id, dotdot, sb);
+		}
+	}
+
+	end_op(p);
+
+	if (fl != NULL) {
+		pthread_mutex_unlock(fl);
+	}
+
+	if (dl[1] != dl[0]) {
+		pthread_mutex_unlock(dl[1]);
+	}
+	pthread_mutex_unlock(dl[0]);
+	pthread_mutex_unlock(&move_lock);
+
+	return (inode_loc == -1) ? -1 : 0;
+}
+
+/**
+ * Returns true if name can be the name of an item: not empty, not "." or "..", no / in it
+ * and shorter than 256 bytes.
+ */
+bool valid_name(const char *name)
+{
+	return (name[0] != '\0') && (strcmp(name, ".") != 0) && (strcmp(name, "..") != 0) &&
+			(strchr(name, '/') == NULL) && (strlen(name) < 256);
+}
+
+/**
+ * Removes item name of directory dir_id: a file, or else a directory by that name, which
+ * has to be empty unless recursive is set (rm -r). The item is taken out of the tree
+ * first, which leaves the rest of a directory tree unreachable. Then the keys of every
+ * directory in it are taken out a directory at a time with remove_range(), and the
+ * inodes, stat blocks and block maps of the items are released in batches of RM_BATCH
+ * items, in journaled operations of their own, so a crash halfway only leaves the
+ * blocks of the items not released yet in use. The directory pwd_id is in can not be
+ * removed.
+ */
+void remove_item(FILE *p, struct superblock *sb, int dir_id, char *name, bool recursive, int pwd_id)
+{
+	int i;
+	int x;
+	int type;
+	int inode_loc;
+	double secs;
+	struct timespec start;
+	struct timespec end;
+	struct inode in;
+	struct item_stat s;
+	struct dir_entry *ents;
+	struct rm_state rs;
+	pthread_mutex_t *dl;
+	pthread_mutex_t *fl;
+
+	memset(&rs, 0, sizeof(struct rm_state));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* nothing may be moved into a directory tree while it is taken apart */
+	pthread_mutex_lock(&move_lock);
+	dl = &dir_lock[dir_id % DIR_LOCKS];
+	pthread_mutex_lock(dl);
+
+	fl = NULL;
+	type = 4;
+	inode_loc = find(p, sb, dir_id, name, 4, 1);
+
+	if (inode_loc == -1) {
+		type = 2;
+		inode_loc = find(p, sb, dir_id, name, 2, 1);
+	}
+
+	/* a write to a file may give it a new inode until its lock is held */
+	while ((type == 4) && (inode_loc != -1)) {
+		fl = &file_lock[inode_loc % FILE_LOCKS];
+		pthread_mutex_lock(fl);
+		x = find(p, sb, dir_id, name, 4, 1);
+
+		if (x == inode_loc) {
+			break;
+		}
+
+		pthread_mutex_unlock(fl);
+		fl = NULL;
+		inode_loc = x;
+	}
+
+	begin_op();
+
+	if (inode_loc == -1) {
+		printf("\nNo file or directory by the name %s", name);
+	} else if (type == 2) {
+		dread(p, &in, sizeof(struct inode), INODE_OFF(sb, inode_loc));
+		dread(p, &s, sizeof(struct item_stat), BLOCK_OFF(sb, in.f[0]));
+
+		for (x = pwd_id; (x != 1) && (x != -1) && (x != (int) s.k.id); x = find(p, sb, x, "..", 2, 0))
+			;
+
+		if (x == (int) s.k.id) {
+			printf("\nCan not remove directory %s, pwd is in it.", name);
+			inode_loc = -1;
+		} else if (!recursive) {
+			x = scan_dir(p, sb, s.k.id, 0, &ents);
+			free(ents);
+
+			/* its ".." is always there */
+			if (x > 1) {
+				printf("\nDirectory %s is not empty, rm -r removes it with all it holds.", name);
+				inode_loc = -1;
+			}
+		}
+	}
+
+	if (inode_loc != -1) {
+		inode_loc = cow_item(p, sb, inode_loc);
+	}
+
+	if (inode_loc != -1) {
+		dread(p, &in, sizeof(struct inode), INODE_OFF(sb, inode_loc));
+		dread(p, &s, sizeof(struct item_stat), BLOCK_OFF(sb, in.f[0]));
+
+		remove_key(p, sb, s.k);
+
+		if (type == 2) {
+			list_add(&rs.dirs, &rs.n_dirs, &rs.cap_dirs, s.k.id);
+			++rs.subdirs;
+		} else {
+			++rs.files;
+		}
+
+		drop_item(p, sb, inode_loc, &in, &rs);
+	}
+
+	end_op(p);
+
+	if (fl != NULL) {
+		pthread_mutex_unlock(fl);
+	}
+
+	pthread_mutex_unlock(dl);
+
+	/* an item created in a directory before its keys are taken out goes with them */
+	while (rs.n_dirs > 0) {
+		x = rs.dirs[--rs.n_dirs];
+		dl = &dir_lock[x % DIR_LOCKS];
+		pthread_mutex_lock(dl);
+		begin_op();
+		remove_range(p, sb, x, &rs);
+		pthread_mutex_unlock(dl);
+
+		for (i = 0; i < rs.n_items; ++i) {
+			dread(p, &in, sizeof(struct inode), INODE_OFF(sb, rs.items[i]));
+			dread(p, &s, sizeof(struct item_stat), BLOCK_OFF(sb, in.f[0]));
+
+			if (s.type != 2) {
+				++rs.files;
+			} else if (strcmp(s.name, "..") != 0) {
+				list_add(&rs.dirs, &rs.n_dirs, &rs.cap_dirs, s.k.id);
+				++rs.subdirs;
+			}
+
+			drop_item(p, sb, rs.items[i], &in, &rs);
+
+			if (rs.n_inodes >= RM_BATCH) {
+				release_items(p, sb, &rs);
+				end_op(p);
+				begin_op();
+			}
+		}
+
+		rs.n_items = 0;
+		end_op(p);
+	}
+
+	begin_op();
+	release_items(p, sb, &rs);
+	end_op(p);
+	pthread_mutex_unlock(&move_lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	if (recursive && (inode_loc != -1)) {
+		printf("\nRemoved %lld files and %lld directories in %.3f s: %.0f items/s",
+				rs.files, rs.subdirs, secs, (rs.files + rs.subdirs) / ((secs > 0) ? secs : 1e-9));
+	}
+
+	free(rs.items);
+	free(rs.dirs);
+	free(rs.blocks);
+	free(rs.inodes);
+
+	return;
+}
+
+/**
+ * Lets go of the item whose inode inode_loc (read into in) is out of the tree. An inode
+ * still shared with a snapshot only loses an owner. Otherwise the inode, its stat block
+ * and the blocks of its block map go into rs, to be released by release_items(); an
+ * indirect block shared with a snapshot goes without the blocks it points to, which
+ * it still owns.
+ */
+void drop_item(FILE *p, struct superblock *sb, int inode_loc, struct inode *in, struct rm_state *rs)
+{
+	int i;
+
+	if (get_ref(p, sb, INODE_REF(sb, inode_loc)) > 0) {
+		add_ref(p, sb, INODE_REF(sb, inode_loc), -1);
+
+		return;
+	}
+
+	/* the stat block and the direct blocks; holes and compressed lengths are not blocks */
+	for (i = 0; i < 14; ++i) {
+		if (in->f[i] >= 0) {
+			list_add(&rs->blocks, &rs->n_blocks, &rs->cap_blocks, in->f[i]);
+		}
+	}
+
+	drop_ptr_block(p, sb, in->f[14], 1, rs);
+	drop_ptr_block(p, sb, in->f[15], 2, rs);
+	list_add(&rs->inodes, &rs->n_inodes, &rs->cap_inodes, inode_loc);
+
+	return;
+}
+
+/**
+ * Adds indirect block b (level 1) or double indirect block b (level 2) to the blocks rs
+ * releases, with the blocks it points to. A shared one only loses an owner, right away,
+ * so that the last of the files sharing it (see copy_file()) finds it private.
+ */
+void drop_ptr_block(FILE *p, struct superblock *sb, int b, int level, struct rm_state *rs)
+{
+	int i;
+	int *ptr;
+
+	if (b < 0) {
+		return;
+	}
+
+	if (get_ref(p, sb, b) > 0) {
+		release_block(p, sb, b);
+
+		return;
+	}
+
+	ptr = (int *) malloc(sb->blocksize);
+	read_ptr_block(p, sb->blocksize, b, ptr);
+
+	for (i = 0; i < PTRS(sb->blocksize); ++i) {
+		if (level > 1) {
+			drop_ptr_block(p, sb, ptr[i], level - 1, rs);
+		} else if (ptr[i] >= 0) {
+			list_add(&rs->blocks, &rs->n_blocks, &rs->cap_blocks, ptr[i]);
+		}
+	}
+
+	free(ptr);
+	list_add(&rs->blocks, &rs->n_blocks, &rs->cap_blocks, b);
+
+	return;
+}
+
+/**
+ * Releases the blocks and inodes gathered in rs (see release_block()), sorted by number,
+ * so the maps and inode blocks they change are gone through front to back once.
+ */
+void release_items(FILE *p, struct superblock *sb, struct rm_state *rs)
+{
+	int i;
 
-	if (fb == -1) {
+	/* the lists are NULL until something is added to them */
+	if (rs->n_blocks > 0) {
+		qsort(rs->blocks, rs->n_blocks, sizeof(int), cmp_int);
+
+		for (i = 0; i < rs->n_blocks; ++i) {
+			release_block(p, sb, rs->blocks[i]);
+		}
+	}
+
+	if (rs->n_inodes > 0) {
+		qsort(rs->inodes, rs->n_inodes, sizeof(int), cmp_int);
+
+		for (i = 0; i < rs->n_inodes; ++i) {
+			free_inode(p, sb, rs->inodes[i]);
+			invalidate_map(rs->inodes[i]);
+		}
+	}
+
+	rs->n_blocks = 0;
+	rs->n_inodes = 0;
+
+	return;
+}
+
+/**
+ * Gives inode i, whose item is gone, back to its allocation group.
+ */
+void free_inode(FILE *p, struct superblock *sb, int i)
+{
+	struct inode in;
+	struct alloc_group *ag;
+
+	memset(&in, -1, sizeof(struct inode));
+	ag = &groups[inode_group(i)];
+
+	pthread_mutex_lock(&ag->lock);
+	dwrite(p, &in, sizeof(struct inode), INODE_OFF(sb, i));
+	if (ag->free_inodes != -1) {
+		++ag->free_inodes;
+	}
+	pthread_mutex_unlock(&ag->lock);
+
+	return;
+}
+
+/**
+ * Appends v to the array *a of *n ints, growing it (its room is *cap) as needed.
+ */
+void list_add(int **a, int *n, int *cap, int v)
+{
+	if (*n == *cap) {
+		*cap = (*cap == 0) ? 64 : *cap * 2;
+		*a = (int *) realloc(*a, *cap * sizeof(int));
+	}
+
+	(*a)[(*n)++] = v;
+
+	return;
+}
+
+/**
+ * Returns the open file table entry for the file whose inode is at inode_loc, with its
+ * block map built. If the file is not open, the least recently used entry nobody uses is
+ * taken over, waiting for one if all are in use. An entry whose map went stale while in
+ * use is left to its users and the file gets a fresh one. Pair with close_file().
+ */
+struct open_file *open_file(FILE *p, struct superblock *sb, int inode_loc)
+{
+	int i;
+	int victim;
+
+	pthread_mutex_lock(&oft_lock);
+
+	while (1) {
+		victim = -1;
+
+		for (i = 0; i < MAX_OPEN; ++i) {
+			if (oft[i].inode_loc == inode_loc && oft[i].tick != 0) {
+				if (oft[i].valid == 1) {
+					oft[i].tick = ++oft_tick;
+					++oft[i].users;
+					pthread_mutex_unlock(&oft_lock);
+
+					return &oft[i];
+				}
+				if (oft[i].users > 0) {
+					oft[i].inode_loc = -1;
+				}
+			}
+			if ((oft[i].users == 0) && ((victim == -1) || (oft[i].tick < oft[victim].tick))) {
+				victim = i;
+			}
+		}
+
+		if (victim != -1) {
+			break;
+		}
+
+		pthread_cond_wait(&oft_free, &oft_lock);
+	}
+
+	oft[victim].inode_loc = inode_loc;
+	oft[victim].inode_off = INODE_OFF(sb, inode_loc);
+	oft[victim].bs = sb->blocksize;
+	oft[victim].valid = 0;
+	oft[victim].users = 1;
+	oft[victim].tick = ++oft_tick;
+
+	build_map(p, &oft[victim]);
+
+	pthread_mutex_unlock(&oft_lock);
+
+	return &oft[victim];
+}
+
+void close_file(struct open_file *of)
+{
+	pthread_mutex_lock(&oft_lock);
+
+	if (--of->users == 0) {
+		pthread_cond_signal(&oft_free);
+	}
+
+	pthread_mutex_unlock(&oft_lock);
+
+	return;
+}
+
+/**
+ * Called whenever the block map of a file changes, so that the next open rebuilds it.
+ */
+void invalidate_map(int inode_loc)
+{
+	int i;
+
+	pthread_mutex_lock(&oft_lock);
+
+	for (i = 0; i < MAX_OPEN; ++i) {
+		if (oft[i].inode_loc == inode_loc && oft[i].tick != 0) {
+			oft[i].valid = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&oft_lock);
+
+	return;
+}
+
+/**
+ * Adds logical block lblock at block loc to the block map, extending the last extent
+ * when the block is physically contiguous with it.
+ */
+void map_add(struct open_file *of, int lblock, int loc)
+{
+	struct extent *e;
+
+	if (of->n_ext > 0) {
+		e = &of->ext[of->n_ext - 1];
+
+		if ((e->lblock + e->len == lblock) &&
+				(((e->loc < 0) && (loc == e->loc)) || ((e->loc >= 0) && (e->loc + e->len == loc)))) {
+			++e->len;
+
+			return;
+		}
+	}
+
+	if (of->n_ext == of->cap) {
+		of->cap = (of->cap == 0) ? 16 : of->cap * 2;
+		of->ext = (struct extent *) realloc(of->ext, of->cap * sizeof(struct extent));
+	}
+
+	e = &of->ext[of->n_ext++];
+	e->lblock = lblock;
+	e->loc = loc;
+	e->len = 1;
+
+	return;
+}
+
+/**
+ * Reads the pointer block at loc into ptr. A missing pointer block (loc == -1) stands for
+ * PTRS(bs) holes, so ptr is filled with -1 instead.
+ */
+void read_ptr_block(FILE *p, int bs, int loc, int *ptr)
+{
+	int i;
+
+	if (loc == -1) {
+		for (i = 0; i < PTRS(bs); ++i) {
+			ptr[i] = -1;
+		}
+
+		return;
+	}
+
+	dread(p, ptr, bs, (off_t) loc * bs);
+
+	return;
+}
+
+/**
+ * Walks the inode's direct, indirect and double indirect pointers once and stores
+ * them as extents. Each pointer block is read only once per build.
+ */
+int build_map(FILE *p, struct open_file *of)
+{
+	int i;
+	int j;
+	int count;
+	struct inode in;
+	struct item_stat s;
+	int indirect[PTRS(MAX_BS)];
+	int d_indirect[PTRS(MAX_BS)];
+
+	dread(p, &in, sizeof(struct inode), of->inode_off);
+	dread(p, &s, sizeof(struct item_stat), (off_t) in.f[0] * of->bs);
+
+	of->n_ext = 0;
+	of->zc = -1;
+	of->blocks = s.blocks;
+	of->size = (s.blocks == 0) ? 0 : (off_t) (s.blocks - 1) * of->bs + s.lastblockbytes;
+	count = 0;
+
+	for (i = 1; (i < 14) && (count < s.blocks); ++i, ++count) {
+		map_add(of, count, in.f[i]);
+	}
+
+	if (count < s.blocks) {
+		read_ptr_block(p, of->bs, in.f[14], indirect);
+
+		for (i = 0; (i < PTRS(of->bs)) && (count < s.blocks); ++i, ++count) {
+			map_add(of, count, indirect[i]);
+		}
+	}
+
+	if (count < s.blocks) {
+		read_ptr_block(p, of->bs, in.f[15], d_indirect);
+
+		for (i = 0; (i < PTRS(of->bs)) && (count < s.blocks); ++i) {
+			read_ptr_block(p, of->bs, d_indirect[i], indirect);
+
+			for (j = 0; (j < PTRS(of->bs)) && (count < s.blocks); ++j, ++count) {
+				map_add(of, count, indirect[j]);
+			}
+		}
+	}
+
+	of->valid = 1;
+
+	if (DEBUG) {
+		printf("\nBuilt block map of %d blocks in %d extents", of->blocks, of->n_ext);
+	}
+
+	return of->n_ext;
+}
+
+/**
+ * Returns block number of logical block lblock of an open file, -1 if it is a hole
+ * or out of range, or the ZMARK() of its compressed cluster past the compressed data.
+ */
+int map_block(struct open_file *of, int lblock)
+{
+	int lo;
+	int hi;
+	int mid;
+	struct extent *e;
+
+	lo = 0;
+	hi = of->n_ext - 1;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		e = &of->ext[mid];
+
+		if (lblock < e->lblock) {
+			hi = mid - 1;
+		} else if (lblock >= e->lblock + e->len) {
+			lo = mid + 1;
+		} else {
+			if (e->loc < 0) {
+				return e->loc;
+			}
+
+			return e->loc + (lblock - e->lblock);
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Returns true if logical block lblock of an open file is in a compressed cluster. The
+ * last pointer of a compressed cluster is always a ZMARK().
+ */
+bool cluster_packed(struct open_file *of, int lblock)
+{
+	int last;
+
+	last = lblock / CLUSTER * CLUSTER + CLUSTER - 1;
+
+	if (last >= of->blocks) {
+		last = of->blocks - 1;
+	}
+
+	return (lblock < of->blocks) && (map_block(of, last) < -1);
+}
+
+/**
+ * Decompresses compressed cluster c of an open file into buf, which holds CLUSTER blocks.
+ * The compressed data is read a run of contiguous blocks at a time, and its blocks are
+ * checked against their checksums. Returns 0, or -1 if the data can not be decompressed.
+ */
+int read_cluster(FILE *p, struct open_file *of, int c, char *buf)
+{
+	int i;
+	int j;
+	int k;
+	int n;
+	int run;
+	int loc;
+	int len;
+	char *z;
+
+	n = (of->blocks - c * CLUSTER < CLUSTER) ? of->blocks - c * CLUSTER : CLUSTER;
+
+	for (k = 0; (k < n) && (map_block(of, c * CLUSTER + k) >= 0); ++k)
+		;
+
+	if (k == n) {
+		return -1;
+	}
+
+	len = ZMARK(map_block(of, c * CLUSTER + k));
+	z = (char *) malloc((size_t) k * of->bs);
+
+	for (i = 0; i < k; i += run) {
+		loc = map_block(of, c * CLUSTER + i);
+
+		for (run = 1; (i + run < k) && (map_block(of, c * CLUSTER + i + run) == loc + run); ++run)
+			;
+
+		dread(p, z + (size_t) i * of->bs, (size_t) run * of->bs, (off_t) loc * of->bs);
+
+		for (j = 0; j < run; ++j) {
+			if (!check_csum(p, loc + j, z + (size_t) (i + j) * of->bs)) {
+				printf("\nERROR: Block %d of inode %d does not match its checksum.", loc + j, of->inode_loc);
+			}
+		}
+	}
+
+	if ((len > k * of->bs) ||
+			(lz_decompress((unsigned char *) z, len, (unsigned char *) buf, n * of->bs) != n * of->bs)) {
+		printf("\nERROR: Compressed cluster %d of inode %d is damaged.", c, of->inode_loc);
+		free(z);
+
+		return -1;
+	}
+
+	free(z);
+
+	return 0;
+}
+
+/**
+ * Reads up to len bytes at offset of the file whose inode is at inode_loc into buf.
+ * Returns the number of bytes read, 0 at end of file, -1 for a negative offset. The last
+ * compressed cluster read is kept decompressed in the open file entry, so small reads in
+ * a row decompress it once.
+ */
+int read_file(FILE *p, struct superblock *sb, int inode_loc, off_t offset, char *buf, int len)
+{
+	int n;
+	int lb;
+	int got;
+	int loc;
+	struct open_file *of;
+
+	if (offset < 0) {
 		return -1;
 	}
 
-	nn.parent = -1;
-	nn.isLeaf = 0;
-	nn.size = 0;
-	nn.left = -1;
-	nn.right = -1;
+	of = open_file(p, sb, inode_loc);
+
+	if (offset + len > of->size) {
+		len = of->size - offset;
+	}
+
+	got = 0;
+
+	while (len > 0) {
+		n = of->bs - (offset % of->bs);
+		if (n > len) {
+			n = len;
+		}
+
+		lb = offset / of->bs;
+		loc = map_block(of, lb);
+
+		if (cluster_packed(of, lb)) {
+			pthread_mutex_lock(&of->zlock);
+
+			if (of->zbuf == NULL) {
+				of->zbuf = (char *) malloc((size_t) CLUSTER * MAX_BS);
+			}
+
+			if ((of->zc != lb / CLUSTER) && (read_cluster(p, of, lb / CLUSTER, of->zbuf) == -1)) {
+				memset(of->zbuf, 0, (size_t) CLUSTER * of->bs);
+			}
+
+			of->zc = lb / CLUSTER;
+			memcpy(buf + got, of->zbuf + (size_t) (lb % CLUSTER) * of->bs + (offset % of->bs), n);
+			pthread_mutex_unlock(&of->zlock);
+		} else if (loc == -1) {
+			memset(buf + got, 0, n);
+		} else {
+			dread(p, buf + got, n, BLOCK_OFF(sb, loc) + (offset % of->bs));
+		}
+
+		got += n;
+		offset += n;
+		len -= n;
+	}
+
+	close_file(of);
+
+	return got;
+}
+
+void ra_init(struct readahead *ra)
+{
+	ra->next = -1;
+	ra->window = 0;
+	ra->ahead = -1;
+
+	return;
+}
+
+/**
+ * Records an access to logical block lblock of an open file. While the accesses stay
+ * sequential the window doubles up to RA_MAX blocks; a random access resets it.
+ * Prefetches are issued for the extents covering the window once less than half of
+ * it is left ahead of the reader, so the kernel reads the next batch asynchronously.
+ */
+void ra_file(FILE *p, struct open_file *of, struct readahead *ra, int lblock)
+{
+	int i;
+	int from;
+	int to;
+	int start;
+	int end;
+	struct extent *e;
+
+	if (lblock == ra->next) {
+		if (ra->window < RA_MAX) {
+			ra->window = (ra->window == 0) ? RA_MIN : ra->window * 2;
+		}
+	} else {
+		ra->window = 0;
+		ra->ahead = lblock;
+	}
+
+	ra->next = lblock + 1;
+
+	if ((ra->window == 0) || (ra->ahead - lblock > ra->window / 2)) {
+		return;
+	}
+
+	from = (ra->ahead > lblock) ? ra->ahead : lblock + 1;
+	to = lblock + 1 + ra->window;
+
+	if (to > of->blocks) {
+		to = of->blocks;
+	}
+
+	for (i = 0; (i < of->n_ext) && (from < to); ++i) {
+		e = &of->ext[i];
+
+		if (e->lblock + e->len <= from) {
+			continue;
+		}
+
+		start = (from > e->lblock) ? from : e->lblock;
+		end = (to < e->lblock + e->len) ? to : e->lblock + e->len;
+
+		if ((start < end) && (e->loc >= 0)) {
+			image_advise(p, (off_t) (e->loc + start - e->lblock) * of->bs,
+					(off_t) (end - start) * of->bs, POSIX_FADV_WILLNEED);
+		}
+	}
+
+	if (DEBUG) {
+		printf("\nReadahead of blocks %d-%d, window %d", from, to, ra->window);
+	}
+
+	ra->ahead = to;
+
+	return;
+}
+
+/**
+ * Records a visit of the leaf at loc whose right link is right. Visiting the leaves the
+ * right links point to one after another counts as sequential, which grows the window. Since split leaves are
+ * allocated from the lowest free blocks, siblings mostly sit next to each other, so the
+ * window is prefetched as a run of blocks starting at the right sibling.
+ */
+void ra_leaf(FILE *p, struct superblock *sb, struct readahead *ra, int loc, int right)
+{
+	if (loc == ra->next) {
+		if (ra->window < RA_MAX) {
+			ra->window = (ra->window == 0) ? 1 : ra->window * 2;
+		}
+	} else {
+		ra->window = 1;
+		ra->ahead = -1;
+	}
+
+	ra->next = right;
 
-	for (i = 0; i < 339; ++i) {
-		nn.key[i].dir_id = -1;
-		nn.key[i].id = -1;
-		nn.link[i] = -1;
+	if ((right == -1) || ((right >= loc) && (right < ra->ahead))) {
+		return;
 	}
 
-	nn.link[339] = -1;
+	image_advise(p, BLOCK_OFF(sb, right), (off_t) ra->window * sb->blocksize, POSIX_FADV_WILLNEED);
+	ra->ahead = right + ra->window;
+
+	return;
+}
 
-	use_block(p, fb);
+/**
+ * returns true if the block contains only zeroes.
+ * ORs the block together a word at a time, which the compiler turns into vector instructions.
+ */
+bool zero_block(const char *block, int len)
+{
+	int i;
+	unsigned long acc;
+	const unsigned long *w;
 
-	fb *= 4096;
+	w = (const unsigned long *) block;
+	acc = 0;
 
-	fseek(p, fb, SEEK_SET);
-	fwrite(&nn, sizeof(struct node), 1, p);
+	for (i = 0; i < len / (int) sizeof(unsigned long); ++i) {
+		acc |= w[i];
+	}
 
-	return fb;
+	return acc == 0;
 }
 
-void insert(FILE *p, int id, int dir_id, int block, struct superblock *sb)
+/**
+ * Copies logical block lblock of the local file f into a newly allocated block and returns
+ * its location. Blocks lying entirely in a hole of the local file (found with SEEK_DATA and
+ * SEEK_HOLE, without reading them) or containing only zeroes are not allocated, and -1 is
+ * returned so that the block map records a hole. With is->dedup the block goes through
+ * the dedup index, and with is->compress the location comes from the block map of its
+ * cluster, which is imported at its first block.
+ */
+int import_block(FILE *p, struct superblock *sb, FILE *f, struct hole_scan *hs, int lblock, char *block, struct import_state *is)
 {
-	bool flag;
-	int curr;
-	int i;
-	int j;
-	int l;
-	int r;
-	struct node n;
-	struct node tmp1;
-	struct node tmp2;
-	struct Key k;
+	if (is->compress) {
+		if (lblock % CLUSTER == 0) {
+			import_cluster(p, sb, f, hs, lblock, is);
+		}
 
-	k.dir_id = dir_id;
-	k.id = id;
+		return is->ptr[lblock % CLUSTER];
+	}
 
-	if (sb->root == -1) {
-		curr = get_node(p, sb);
+	if (!import_read(f, hs, sb->blocksize, lblock, block)) {
+		return -1;
+	}
 
-		if (curr == -1) {
-			err_noblocks();
+	return import_store(p, sb, block, is);
+}
 
-			return;
-		}
+/**
+ * Reads logical block lblock of the local file f into block, padded with zeroes at the
+ * end of the file. Returns false without reading if the block lies in a hole.
+ */
+bool import_read(FILE *f, struct hole_scan *hs, int bs, int lblock, char *block)
+{
+	off_t off;
 
-		sb->root = curr;
-		fseek(p, curr, SEEK_SET);
-		fread(&n, sizeof(struct node), 1, p);
+	off = (off_t) lblock * bs;
 
-		n.parent = -1;
-		n.isLeaf = 1;
-		n.size = 1;
-		n.key[0].dir_id = dir_id;
-		n.key[0].id = id;
-		n.link[0] = block;
-		n.left = -1;
-		n.right = -1;
+	if (off >= hs->hole) {
+		hs->data = lseek(hs->fd, off, SEEK_DATA);
 
-		fseek(p, curr, SEEK_SET);
-		fwrite(&n, sizeof(struct node), 1, p);
+		if (hs->data == -1) {
+			hs->data = hs->size;
+		}
 
-		update_sb(p, sb);
+		hs->hole = lseek(hs->fd, hs->data, SEEK_HOLE);
 
-		return;
-	} else {
-		fseek(p, sb->root, SEEK_SET);
-		fread(&n, sizeof(struct node), 1, p);
-		curr = sb->root;
-
-		while (n.isLeaf != 1) {
-			if (DEBUG) {
-				printf("\n\tSearching for leaf...");
-			}
-			for (i = 0; i < n.size; ++i) {
-				if (comparator((void *)&k, (void *)&n.key[i]) < 0) {
-					curr = n.link[i];
-					fseek(p, curr, SEEK_SET);
-					fread(&n, sizeof(struct node), 1, p);
-					break;
-				}
-			}
-			if (i == n.size) {
-				curr = n.link[i];
-				fseek(p, curr, SEEK_SET);
-				fread(&n, sizeof(struct node), 1, p);
-			}
+		if (hs->hole == -1) {
+			hs->hole = hs->size;
 		}
+	}
 
-		if (n.size < 339) {
-			if (DEBUG)
-				printf("\nInside first condition.");
-			for (i = 0; i < n.size; ++i) {
-				if (comparator((void *)&k, (void *)&n.key[i]) < 0) {
-					break;
-				}
-			}
+	if (off + bs <= hs->data) {
+		return false;
+	}
 
-			for (j = n.size; j > i; --j) {
-				n.key[j] = n.key[j-1];
-				n.link[j] = n.link[j-1];
-			}
+	memset(block, 0, bs);
+	fseeko(f, off, SEEK_SET);
+	fread(block, bs, 1, f);
 
-			n.key[i] = k;
-			n.link[i] = block;
-			++n.size;
+	return true;
+}
+
+/**
+ * Stores an imported block and returns its location, -1 for a block of zeroes or if no
+ * block was left, which sets is->full.
+ */
+int import_store(FILE *p, struct superblock *sb, char *block, struct import_state *is)
+{
+	int freeblock;
+
+	if (zero_block(block, sb->blocksize)) {
+		return -1;
+	}
 
-			if (DEBUG)
-				printf("\nIncremented size to %d", n.size);
+	if (is->dedup) {
+		freeblock = dedup_block(p, sb, block);
+		++is->blocks;
 
-			fseek(p, curr, SEEK_SET);
-			fwrite(&n, sizeof(struct node), 1, p);
+		if (freeblock == -1) {
+			is->full = true;
+
+			return -1;
+		} else if (freeblock < 0) {
+			freeblock = -freeblock;
 		} else {
-			l = get_node(p, sb);
-			r = get_node(p, sb);
+			++is->shared;
+		}
 
-			if (l == -1 || r == -1) {
-				err_noblocks();
+		return freeblock;
+	}
 
-				return;
-			}
+	freeblock = alloc_block(p, sb, home_group());
 
-			fseek(p, l, SEEK_SET);
-			fread(&tmp1, sizeof(struct node), 1, p);
-			tmp1.left = n.left;
-			tmp1.right = r;
-			tmp1.parent = n.parent;
-			tmp1.isLeaf = 1;
-
-			fseek(p, r, SEEK_SET);
-			fread(&tmp2, sizeof(struct node), 1, p);
-			tmp2.right = n.right;
-			tmp2.left = l;
-			tmp2.parent = n.parent;
-			tmp2.isLeaf = 1;
-
-			flag = false;
-			for (i = 0, j = 0; j < ((n.size / 2) + 1);) {
-				if ((flag == false) && (comparator((void *)&k, (void *)&n.key[i]) < 0)) {
-					tmp1.key[j] = k;
-					tmp1.link[j] = block;
-					++j;
-					flag = true;
-				} else {
-					tmp1.key[j] = n.key[i];
-					tmp1.link[j] = n.link[i];
-					++i;
-					++j;
-				}
-			}
-			tmp1.size = j;
+	if (freeblock == -1) {
+		is->full = true;
 
-			for (j = 0; i < n.size;) {
-				if ((flag == false) && (comparator((void *)&k, (void *)&n.key[i]) < 0)) {
-					tmp2.key[j] = k;
-					tmp2.link[j] = block;
-					++j;
-					flag = true;
-				} else {
-					tmp2.key[j] = n.key[i];
-					tmp2.link[j] = n.link[i];
-					++i;
-					++j;
-				}
-			}
-			if (flag == false) {
-				tmp2.key[j] = k;
-				tmp2.link[j] = block;
-				++j;
-				flag = true;
-			}
-			tmp2.parent = n.parent;
-			tmp2.size = j;
+		return -1;
+	}
 
-			free_block(p, curr);
+	if (is->run == NULL) {
+		data_write(p, block, sb->blocksize, BLOCK_OFF(sb, freeblock));
 
-			if (DEBUG) {
-				inorder(p, l);
-				inorder(p, r);
-			}
+		return freeblock;
+	}
 
-			tmp1.parent = promote(tmp2.key[0], n.parent, l, r, p, sb);
-			tmp2.parent = tmp1.parent;
+	if ((is->run_len > 0) && ((freeblock != is->run_start + is->run_len) ||
+			((is->run_len + 1) * sb->blocksize > IMPORT_CHUNK))) {
+		import_flush(p, sb, is);
+	}
 
-/*			tmp1.parent = find_parent(tmp1.key[0], p, sb);
-			tmp2.parent = find_parent(tmp2.key[0], p, sb);
-*/
-			tmp2.left = l;
-			tmp2.right = n.right;
-			fseek(p, r, SEEK_SET);
-			fwrite(&tmp2, sizeof(struct node), 1, p);
+	if (is->run_len == 0) {
+		is->run_start = freeblock;
+	}
 
-			tmp1.left = n.left;
-			tmp1.right = r;
-			fseek(p, l, SEEK_SET);
-			fwrite(&tmp1, sizeof(struct node), 1, p);
+	memcpy(is->run + (size_t) is->run_len * sb->blocksize, block, sb->blocksize);
+	++is->run_len;
 
-			if (n.left != -1) {
-				fseek(p, n.left, SEEK_SET);
-				fread(&tmp1, BS, 1, p);
-				tmp1.right = l;
-				fseek(p, n.left, SEEK_SET);
-				fwrite(&tmp1, BS, 1, p);
-			}
+	return freeblock;
+}
 
-			if (n.right != -1) {
-				fseek(p, n.right, SEEK_SET);
-				fread(&tmp2, BS, 1, p);
-				tmp2.left = r;
-				fseek(p, n.left, SEEK_SET);
-				fwrite(&tmp2, BS, 1, p);
-			}
-		}
+/**
+ * Writes the blocks import_store() has kept back with one data_write(), which a striped
+ * image spreads over its files. Must be called before the operation ends, so they are on
+ * disk before the block map pointing to them is committed.
+ */
+void import_flush(FILE *p, struct superblock *sb, struct import_state *is)
+{
+	if (is->run_len > 0) {
+		data_write(p, is->run, (size_t) is->run_len * sb->blocksize, BLOCK_OFF(sb, is->run_start));
 	}
 
+	is->run_len = 0;
+
 	return;
 }
 
-void debug_show_filled_blocks(FILE *p)
+/**
+ * Hash of the contents of a block, for the dedup index. Eight independent 32-bit lanes
+ * take one word each per round, so the compiler turns the inner loop into vector
+ * multiplies, and the lanes are mixed into 64 bits at the end. len is a multiple of 32.
+ */
+unsigned long long block_hash(const char *block, int len)
 {
 	int i;
-	struct superblock sb;
+	int j;
+	unsigned int h[8];
+	unsigned long long r;
+	const unsigned int *w;
 
-	if (!DEBUG) {
-		printf("Sorry, binary compiled as production, not debug. Set the DEBUG flag in source and compile to access the feature.");
-		return;
-	}
+	w = (const unsigned int *) block;
 
-	fseek(p, 0, SEEK_SET);
-	fread(&sb, sizeof(struct superblock), 1, p);
+	for (j = 0; j < 8; ++j) {
+		h[j] = 0x9E3779B1U * (j + 1);
+	}
 
-	printf("\nBlocks in use: ");
-	for (i = 0; i < sb.blocks; ++i) {
-		if (check_block(p, i) == true) {
-			printf("%d ", i);
+	for (i = 0; i < len / (int) sizeof(unsigned int); i += 8) {
+		for (j = 0; j < 8; ++j) {
+			h[j] += w[i + j] * 0x85EBCA77U;
+			h[j] = (h[j] << 13) | (h[j] >> 19);
+			h[j] *= 0x9E3779B1U;
 		}
 	}
 
-	return;
+	r = len;
+
+	for (j = 0; j < 8; ++j) {
+		r ^= h[j];
+		r *= 0x100000001B3ULL;
+		r ^= r >> 29;
+	}
+
+	return r;
 }
 
 /**
- * returns true if block i is in use, else false
+ * Stores a data block with contents block through the dedup index, an open addressed
+ * table of struct dedup_entry in the blocks from sb->dedup on, keyed by block_hash().
+ * The DEDUP_PROBE entries from the hash's slot are searched for the same hash, and the
+ * block found is compared with block, so a collision is never shared. An equal block
+ * gains an owner and its number is returned. Otherwise block is written to a new block,
+ * which is indexed if a free entry was seen, and minus its number is returned; -1 if no
+ * block was left.
+ *
+ * The index owns the blocks in it as well, so they are never written in place (writes
+ * to them copy them, see cow_data()) and an entry always matches its block. Entries
+ * are never replaced; once the probed entries are full, new blocks are not indexed.
  */
-bool check_block(FILE *p, int i)
+int dedup_block(FILE *p, struct superblock *sb, const char *block)
 {
+	int i;
 	int b;
-	int m;
-	int x;
-	int loc;
-	char a;
+	int slot;
+	int per;
+	int freeblock;
+	int empty;
+	off_t off;
+	unsigned long long h;
+	struct dedup_entry ent[MAX_BS / sizeof(struct dedup_entry)];
+	char old[MAX_BS];
+	pthread_mutex_t *dl;
+
+	h = block_hash(block, sb->blocksize);
+	per = sb->blocksize / sizeof(struct dedup_entry);
+	b = h % sb->dedup_blocks;
+	off = BLOCK_OFF(sb, sb->dedup + b);
+	dl = &dedup_lock[b % DEDUP_LOCKS];
+	empty = -1;
+
+	pthread_mutex_lock(dl);
+	dread(p, ent, sb->blocksize, off);
+
+	for (i = 0; i < DEDUP_PROBE; ++i) {
+		slot = ((h >> 32) + i) % per;
+
+		if (ent[slot].blk == 0) {
+			empty = (empty == -1) ? slot : empty;
+		} else if (ent[slot].hash == h) {
+			dread(p, old, sb->blocksize, BLOCK_OFF(sb, ent[slot].blk));
+
+			if (memcmp(old, block, sb->blocksize) == 0) {
+				add_ref(p, sb, ent[slot].blk, 1);
+				pthread_mutex_unlock(dl);
+
+				return ent[slot].blk;
+			}
+		}
+	}
+
+	freeblock = alloc_block(p, sb, home_group());
 
-	b = i / (8 * 4096) + 2;
-	m = (i % (8 * 4096)) / 8;
-	x = (i % (8 * 4096)) % 8;
+	if (freeblock == -1) {
+		pthread_mutex_unlock(dl);
 
-	loc = b * 4096 + m;
+		return -1;
+	}
 
-	fseek(p, loc, SEEK_SET);
-	fread(&a, sizeof(char), 1, p);
+	data_write(p, block, sb->blocksize, BLOCK_OFF(sb, freeblock));
 
-	if ((a >> x) & 1) {
-		return true;
-	} else {
-		return false;
+	if (empty != -1) {
+		ent[empty].hash = h;
+		ent[empty].blk = freeblock;
+		dwrite(p, &ent[empty], sizeof(struct dedup_entry), off + empty * sizeof(struct dedup_entry));
+		add_ref(p, sb, freeblock, 1);
 	}
+
+	pthread_mutex_unlock(dl);
+
+	return -freeblock;
 }
 
 /**
- * This function can be optimized by reading block-wise, storing in struct freeblock, 
- * and then checking if each f is less than 255. If less than 255, at least one block
- * is unoccupied. Then check for unoccupied block within f.
- * */
-int get_free_block(FILE *p, struct superblock *sb)
+ * Imports the cluster starting at logical block lblock of the local file f, and fills
+ * is->ptr with its block map. A cluster of n blocks whose compressed data fits in fewer
+ * blocks is stored as that data, followed in the map by ZMARK(compressed length) for
+ * the blocks it saves; other clusters are stored block by block like without compression.
+ * A cluster of zeroes is all holes. If no block is left, is->full is set.
+ */
+void import_cluster(FILE *p, struct superblock *sb, FILE *f, struct hole_scan *hs, int lblock, struct import_state *is)
 {
-	int fb;
+	int i;
+	int n;
+	int k;
+	int len;
+	int bs;
 
-	for (fb = (2 + sb->freeblocksmap); fb < sb->blocks; ++fb) {
-		if (check_block(p, fb) == false) {
-			break;
+	bs = sb->blocksize;
+	n = (is->total - lblock < CLUSTER) ? is->total - lblock : CLUSTER;
+
+	for (i = 0; i < n; ++i) {
+		if (!import_read(f, hs, bs, lblock + i, is->zin + (size_t) i * bs)) {
+			memset(is->zin + (size_t) i * bs, 0, bs);
 		}
 	}
 
-	if (fb == sb->blocks) {
-		err_noblocks();
+	len = -1;
 
-		return -1;
+	if ((n > 1) && !zero_block(is->zin, n * bs)) {
+		len = lz_compress((unsigned char *) is->zin, n * bs, (unsigned char *) is->zout, (n - 1) * bs);
 	}
 
-	return fb;
-}
+	if (len == -1) {
+		for (i = 0; i < n; ++i) {
+			is->ptr[i] = import_store(p, sb, is->zin + (size_t) i * bs, is);
+		}
 
-void update_sb(FILE *p, struct superblock *sb)
-{
-	fseek(p, 0, SEEK_SET);
-	fwrite(sb, sizeof(struct superblock), 1, p);
+		return;
+	}
 
-	fseek(p, 4096, SEEK_SET);
-	fwrite(sb, sizeof(struct superblock), 1, p);
+	k = (len + bs - 1) / bs;
+	memset(is->zout + len, 0, (size_t) k * bs - len);
 
-	return;
-}
+	for (i = 0; i < k; ++i) {
+		is->ptr[i] = alloc_block(p, sb, home_group());
 
-int comparator(const void *p, const void *q)
-{
-	if ((((struct Key *)p)->dir_id - ((struct Key *)q)->dir_id) == 0) {
-		return (((struct Key *)p)->id - ((struct Key *)q)->id);
-	} else {
-		return (((struct Key *)p)->dir_id - ((struct Key *)q)->dir_id);
+		if (is->ptr[i] == -1) {
+			/* the blocks of the cluster allocated so far are not in any block map yet */
+			while (--i >= 0) {
+				free_block(p, sb, is->ptr[i]);
+			}
+
+			for (i = 0; i < n; ++i) {
+				is->ptr[i] = -1;
+			}
+
+			is->full = true;
+
+			return;
+		}
+
+		data_write(p, is->zout + (size_t) i * bs, bs, BLOCK_OFF(sb, is->ptr[i]));
 	}
+
+	for (i = k; i < n; ++i) {
+		is->ptr[i] = ZMARK(len);
+	}
+
+	is->packed += n;
+	is->stored += k;
+
+	return;
 }
 
-int promote(struct Key k, int parent, int l, int r, FILE *p, struct superblock *sb)
+/**
+ * Compresses n bytes of src into dst with a byte oriented LZ77 in the style of LZ4: a
+ * sequence is a token byte with the number of literals in its high half and the match
+ * length - 4 in its low half (15 meaning that length bytes follow, adding up to 255
+ * each), the literals, and a 2 byte offset back to the match. The last sequence has only
+ * literals. Matches are found through a table of the last position of every hashed 4
+ * byte string, and the search steps further the longer it finds none, so data that does
+ * not compress passes quickly. Returns the compressed size, or -1 if it exceeds cap.
+ */
+int lz_compress(const unsigned char *src, int n, unsigned char *dst, int cap)
 {
 	int i;
-	int j;
-	struct node n;
+	int ip;
+	int op;
+	int ref;
+	int len;
+	int miss;
+	int anchor;
+	unsigned int seq;
+	unsigned int h;
+	int table[1 << LZ_HASH_BITS];
+
+	for (i = 0; i < (1 << LZ_HASH_BITS); ++i) {
+		table[i] = -1;
+	}
 
-	if (parent == -1) {
-		if (DEBUG) {
-			printf("\n\nParent is -1, so creating new root.\n");
+	ip = 0;
+	op = 0;
+	miss = 0;
+	anchor = 0;
+
+	while (ip + 4 <= n) {
+		memcpy(&seq, src + ip, 4);
+		h = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+		ref = table[h];
+		table[h] = ip;
+
+		if ((ref == -1) || (ip - ref > 65535) || (memcmp(src + ref, src + ip, 4) != 0)) {
+			ip += 1 + (miss++ >> 6);
+
+			continue;
 		}
 
-		parent = get_node(p, sb);
+		/* eight bytes at a time, then the rest one by one */
+		for (len = 4; (ip + len + 8 <= n) && (memcmp(src + ref + len, src + ip + len, 8) == 0); len += 8)
+			;
 
-		if (parent == -1) {
-			err_noblocks();
+		for (; (ip + len < n) && (src[ref + len] == src[ip + len]); ++len)
+			;
 
-			return parent;
+		op = lz_sequence(dst, op, cap, src + anchor, ip - anchor, ip - ref, len);
+
+		if (op == -1) {
+			return -1;
 		}
 
-		fseek(p, parent, SEEK_SET);
-		fread(&n, sizeof(struct node), 1, p);
+		ip += len;
+		anchor = ip;
+		miss = 0;
+	}
 
-		n.parent = -1;
-		n.isLeaf = 0;
-		n.key[0] = k;
-		n.link[0] = l;
-		n.link[1] = r;
-		n.left = -1;
-		n.right = -1;
-		n.size = 1;
+	return lz_sequence(dst, op, cap, src + anchor, n - anchor, 0, 0);
+}
+
+/**
+ * Appends a sequence to dst at op: nlit literals from lit, then a match of len bytes off
+ * bytes back, or none if len is 0. Returns the new end of dst, -1 if it would pass cap.
+ */
+int lz_sequence(unsigned char *dst, int op, int cap, const unsigned char *lit, int nlit, int off, int len)
+{
+	int t;
+	int m;
 
-		fseek(p, parent, SEEK_SET);
-		fwrite(&n, sizeof(struct node), 1, p);
+	if (op + 1 + (nlit / 255 + 1) + nlit + 2 + (len / 255 + 1) > cap) {
+		return -1;
+	}
 
-		sb->root = parent;
-		update_sb(p, sb);
+	m = (len == 0) ? 0 : len - 4;
+	dst[op++] = (((nlit < 15) ? nlit : 15) << 4) | ((m < 15) ? m : 15);
 
-		if (DEBUG) {
-			inorder(p, parent);
+	if (nlit >= 15) {
+		for (t = nlit - 15; t >= 255; t -= 255) {
+			dst[op++] = 255;
 		}
 
-		return parent;
+		dst[op++] = t;
 	}
 
-	fseek(p, parent, SEEK_SET);
-	fread(&n, sizeof(struct node), 1, p);
+	memcpy(dst + op, lit, nlit);
+	op += nlit;
 
+	if (len == 0) {
+		return op;
+	}
 
-	if (n.size < 339) {
-		for (i = 0; i < n.size; ++i) {
-			if (comparator((void *)&k, (void *)&n.key[i]) < 0) {
-				break;
-			}
-		}
+	dst[op++] = off & 0xff;
+	dst[op++] = off >> 8;
 
-		for (j = n.size; j > i; --j) {
-			n.key[j] = n.key[j-1];
-			n.link[j+1] = n.link[j];
+	if (m >= 15) {
+		for (t = m - 15; t >= 255; t -= 255) {
+			dst[op++] = 255;
 		}
 
-		n.key[i] = k;
-		n.link[i] = l;
-		n.link[i + 1] = r;
-		++n.size;
+		dst[op++] = t;
+	}
 
-		fseek(p, parent, SEEK_SET);
-		fwrite(&n, sizeof(struct node), 1, p);
+	return op;
+}
 
-		return parent;
-	} else {
-		bool flag;
-		int L;
-		int R;
-		struct node tmp1;
-		struct node tmp2;
-		struct Key ktmp;
+/**
+ * Decompresses the n bytes of src made by lz_compress() into dst. Returns the size of
+ * the result, or -1 if src is damaged or the result would exceed cap bytes.
+ */
+int lz_decompress(const unsigned char *src, int n, unsigned char *dst, int cap)
+{
+	int i;
+	int ip;
+	int op;
+	int off;
+	int len;
+	int nlit;
+
+	ip = 0;
+	op = 0;
+
+	while (ip < n) {
+		nlit = src[ip] >> 4;
+		len = (src[ip] & 15) + 4;
+		++ip;
+
+		if (nlit == 15) {
+			do {
+				if (ip >= n) {
+					return -1;
+				}
 
-		L = get_node(p, sb);
-		R = get_node(p, sb);
+				nlit += src[ip];
+			} while (src[ip++] == 255);
+		}
 
-		if ((L == -1) || (R == -1)) {
-			err_noblocks();
+		if ((ip + nlit > n) || (op + nlit > cap)) {
+			return -1;
+		}
 
-			return parent;
+		memcpy(dst + op, src + ip, nlit);
+		ip += nlit;
+		op += nlit;
+
+		if (ip == n) {
+			break;
 		}
 
-		flag = false;
+		if (ip + 2 > n) {
+			return -1;
+		}
 
-		fseek(p, L, SEEK_SET);
-		fread(&tmp1, sizeof(struct node), 1, p);
+		off = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
 
-		fseek(p, R, SEEK_SET);
-		fread(&tmp2, sizeof(struct node), 1, p);
+		if (len == 19) {
+			do {
+				if (ip >= n) {
+					return -1;
+				}
 
-		for (i = 0, j = 0; i < ((n.size / 2) + 1);) {
-			if ((flag == false) && (comparator((void *)&k, (void *)&n.key[j]) < 0)) {
-				tmp1.key[i] = k;
-				tmp1.link[i] = l;
-				tmp1.link[i + 1] = r;
-				n.link[j] = r;
-				parent = L;
-				flag = true;
-				++i;
-			} else {
-				tmp1.key[i] = n.key[j];
-				tmp1.link[i] = n.link[j];
-				++i;
-				++j;
-			}
+				len += src[ip];
+			} while (src[ip++] == 255);
 		}
-		if (flag == false) {
-			tmp1.link[i] = n.link[j];
+
+		if ((off == 0) || (off > op) || (op + len > cap)) {
+			return -1;
 		}
 
-		if ((flag == false) && (comparator((void *)&k, (void *)&n.key[j]) < 0)) {
-			ktmp = k;
-			tmp1.link[i] = l;
-			tmp2.link[0] = r;
-			tmp2.key[0] = n.key[j];
-			++j;
-			i = 1;
-			parent = -1;
-			flag = true;
+		if (off >= len) {
+			memcpy(dst + op, dst + op - off, len);
 		} else {
-			i = 0;
-		}
-
-		for (; j < n.size;) {
-			if ((flag == false) && (comparator((void *)&k, (void *)&n.key[j]) < 0)) {
-				tmp2.key[i] = k;
-				tmp2.link[i] = l;
-				tmp2.link[i + 1] = r;
-				n.link[j] = r;
-				++i;
-				parent = R;
-				flag = true;
-			} else {
-				tmp2.key[i] = n.key[j];
-				tmp2.link[i] = n.link[j];
-				++i;
-				++j;
+			for (i = 0; i < len; ++i) {
+				dst[op + i] = dst[op - off + i];
 			}
 		}
-		if (flag == false) {
-			tmp2.link[i] = n.link[j];
-		}
 
-		tmp1.parent = n.parent;
+		op += len;
+	}
+
+	return op;
+}
 
-		free_block(p, parent);
+/**
+ * Runs threads workers at once, each creating items files in a directory of its own and
+ * looking every one of them up again, and reports the throughput of both together.
+ */
+void bench_mt(FILE *p, struct superblock *sb, int threads, int items, int dir_id)
+{
+	int i;
+	int run;
+	double secs;
+	char name[256];
+	pthread_t *tid;
+	struct bench_arg *arg;
+	struct timespec start;
+	struct timespec end;
 
-		tmp1.parent = promote(ktmp, tmp1.parent, L, R, p, sb);
-		tmp2.parent = tmp1.parent;
+	if ((threads < 1) || (items < 1)) {
+		printf("\nUsage: bench_mt <threads> <items per thread>");
 
-		if (tmp1.parent == -1) {
-/*			tmp1.parent = find_parent(tmp1.key[0], p, sb);
-			tmp2.parent = find_parent(tmp2.key[0], p, sb);
-*/		}
+		return;
+	}
 
+	tid = (pthread_t *) malloc(threads * sizeof(pthread_t));
+	arg = (struct bench_arg *) malloc(threads * sizeof(struct bench_arg));
+	run = sb->idcounter;
+
+	for (i = 0; i < threads; ++i) {
+		sprintf(name, "bench_%d_%d", run, i);
+		arg[i].p = p;
+		arg[i].sb = sb;
+		arg[i].items = items;
+		new_empty_file_dir(p, sb, name, dir_id, 2);
+		arg[i].dir_id = find(p, sb, dir_id, name, 2, 0);
+	}
 
-		fseek(p, L, SEEK_SET);
-		fwrite(&tmp1, sizeof(struct node), 1, p);
-		fseek(p, R, SEEK_SET);
-		fwrite(&tmp2, sizeof(struct node), 1, p);
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-		return parent;
+	for (i = 0; i < threads; ++i) {
+		pthread_create(&tid[i], NULL, bench_worker, &arg[i]);
 	}
-}
 
-void err_noblocks()
-{
-	printf("\nERROR: No more free blocks in fs!");
+	for (i = 0; i < threads; ++i) {
+		pthread_join(tid[i], NULL);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("\n%d threads: %d creates and %d finds in %.3f s, %.0f ops/s", threads,
+			threads * items, threads * items, secs, 2.0 * threads * items / secs);
+
+	free(tid);
+	free(arg);
 
 	return;
 }
 
-int find_parent(struct Key k, FILE *p, struct superblock *sb)
+void *bench_worker(void *a)
 {
-	int prev;
-	int curr;
 	int i;
-	struct node n;
-
-	curr = sb->root;
-	prev = -1;
-
-	while (1) {
-		fseek(p, curr, SEEK_SET);
-		fread(&n, sizeof(struct node), 1, p);
+	char name[256];
+	struct bench_arg *arg;
 
-		for (i = 0; i < n.size; ++i) {
-			if (comparator((void *)&k, (void *)&n.key[i]) == 0) {
-				return prev;
-			}
-		}
+	arg = (struct bench_arg *) a;
 
-		prev = curr;
+	for (i = 0; i < arg->items; ++i) {
+		sprintf(name, "f%d", i);
+		new_empty_file_dir(arg->p, arg->sb, name, arg->dir_id, 4);
 
-		for (i = 0; i < n.size; ++i) {
-			if (comparator((void *)&k, (void *)&n.key[i]) < 0) {
-				curr = n.link[i];
-				break;
-			}
-		}
-		if (i == n.size) {
-			curr = n.link[i];
+		if (find(arg->p, arg->sb, arg->dir_id, name, 4, 0) == -1) {
+			printf("\nERROR: %s not found after creating it!", name);
 		}
 	}
 
-	return prev;
+	return NULL;
 }
 
-void init_inodes(FILE *p, struct superblock *sb)
+/**
+ * Imports many host files into directory dir_id at once: src is either a host directory,
+ * whose regular files are imported, or a file listing one host path per line.
+ * Names that already exist in the directory are skipped. The items are created up front,
+ * then threads readers read the host files, allocate runs of blocks for their data and
+ * queue it for IMPORT_WRITERS writers, which keep that many writes in flight on the image.
+ * The keys of all new files are inserted into the B+ tree in key order at the end, so
+ * the files only become visible once they are complete.
+ */
+void batch_import(FILE *p, struct superblock *sb, char *src, int dir_id, int threads)
 {
 	int i;
-	int inode_blocks;
-	int start;
-	int end;
-	struct inode in[64];
+	int j;
+	int n;
+	int n_names;
+	int added;
+	double secs;
+	struct dir_entry *names;
+	pthread_t *tid;
+	pthread_mutex_t *dl;
+	struct batch b;
+	struct batch_file *files;
+	struct timespec start;
+	struct timespec end;
+
+	n = batch_list(src, &files);
+
+	if (n <= 0) {
+		printf("\nNothing to import from %s", src);
+		free(files);
 
-	for (i = 0; i < 64; ++i) {
-		in[i].f[0] = -1;
+		return;
 	}
 
-	inode_blocks = sb->n_inodes / sb->inodes;
-	start = 2 + sb->freeblocksmap;
-	end = start + inode_blocks;
+	dl = &dir_lock[dir_id % DIR_LOCKS];
+	pthread_mutex_lock(dl);
 
-	for (i = start; i < end; ++i) {
-		fseek(p, 4096 * i, SEEK_SET);
-		fwrite(&in, 64 * sizeof(struct inode), 1, p);
-		use_block(p, i);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* names already in the directory, sorted, and the batch sorted by name */
+	n_names = scan_dir(p, sb, dir_id, 4, &names);
+	qsort(files, n, sizeof(struct batch_file), cmp_batch_file);
+
+	for (i = 0, j = 0; i < n; ++i) {
+		if ((j > 0) && (strcmp(files[i].name, files[j - 1].name) == 0)) {
+			printf("\n%s: file \"%s\" is already in the batch, skipped", files[i].path, files[i].name);
+			continue;
+		}
+		if (bsearch(files[i].name, names, n_names, sizeof(struct dir_entry), cmp_name) != NULL) {
+			printf("\nFile \"%s\" already exists!", files[i].name);
+			continue;
+		}
+		files[j++] = files[i];
 	}
 
-	return;
-}
+	n = j;
+	free(names);
 
-/**
- * Returns byte location of first free inode found inside the allocated space for inodes.
- * */
-int get_inode(FILE *p, struct superblock *sb)
-{
-	int i;
-	int start;
-	struct inode in;
+	begin_op();
 
-	if (sb->n_inodes == 0) {
-		printf("\nn_inodes is zero!");
+	for (i = 0; i < n; ++i) {
+		files[i].k.id = get_id(files[i].name, p, sb, dir_id, 4);
+		files[i].k.dir_id = dir_id;
+		files[i].inode_loc = make_item(p, sb, files[i].k, 4, files[i].name);
+	}
 
-		exit(0);
+	end_op(p);
+
+	b.p = p;
+	b.sb = sb;
+	b.files = files;
+	b.n_files = n;
+	b.next = 0;
+	b.bytes = 0;
+	b.q.head = NULL;
+	b.q.tail = NULL;
+	b.q.n = 0;
+	b.q.max = IMPORT_QUEUE;
+	b.q.done = 0;
+	pthread_mutex_init(&b.q.lock, NULL);
+	pthread_cond_init(&b.q.not_empty, NULL);
+	pthread_cond_init(&b.q.not_full, NULL);
+
+	tid = (pthread_t *) malloc((threads + IMPORT_WRITERS) * sizeof(pthread_t));
+
+	for (i = 0; i < IMPORT_WRITERS; ++i) {
+		pthread_create(&tid[i], NULL, batch_writer, &b);
 	}
 
-	start = (2 + sb->freeblocksmap) * 4096;
-	fseek(p, start, SEEK_SET);
+	for (i = 0; i < threads; ++i) {
+		pthread_create(&tid[IMPORT_WRITERS + i], NULL, batch_reader, &b);
+	}
 
-	for (i = 0; i < sb->n_inodes; ++i) {
-		fseek(p, (start + sizeof(struct inode) * i), SEEK_SET);
-		fread(&in, sizeof(struct inode), 1, p);
-		if (in.f[0] == -1) {
-			return (start + i * sizeof(struct inode));
-		}
+	for (i = 0; i < threads; ++i) {
+		pthread_join(tid[IMPORT_WRITERS + i], NULL);
 	}
 
-	return -1;
-}
+	pthread_mutex_lock(&b.q.lock);
+	b.q.done = 1;
+	pthread_cond_broadcast(&b.q.not_empty);
+	pthread_mutex_unlock(&b.q.lock);
 
-int new_empty_file_dir(FILE *p, struct superblock *sb, char name[], int dir_id, int type)
-{
-	int inode_loc;
-	int stat_loc;
-	struct inode in;
-	struct Key k;
-	struct stat s;
+	for (i = 0; i < IMPORT_WRITERS; ++i) {
+		pthread_join(tid[i], NULL);
+	}
 
-	if (find(p, sb, dir_id, name, type, 0) != -1) {
-		if (type == 2) {
-			printf("\nDirectory \"%s\" already exists!", name);
-		} else if (type == 4) {
-			printf("\nFile \"%s\" already exists!", name);
-		} else {
-			printf("\nItem \"%s\" already exists!", name);
-		}
+	added = 0;
+	begin_op();
 
-		return -2;
+	for (i = 0; i < n; ++i) {
+		if (files[i].inode_loc != -1) {
+			insert(p, files[i].k.id, files[i].k.dir_id, files[i].inode_loc, sb);
+			++added;
+		}
 	}
 
-	k.id = get_id(name, p, sb);
-	k.dir_id = dir_id;
+	pthread_mutex_unlock(dl);
 
-	inode_loc = get_inode(p, sb);
-	stat_loc = get_free_block(p, sb);
+	update_sb(p, sb);
+	end_op(p);
 
-	if (stat_loc == -1) {
-		err_noblocks();
+	clock_gettime(CLOCK_MONOTONIC, &end);
 
-		return -1;
-	}
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
 
-	use_block(p, stat_loc);
+	printf("\nImported %d files, %lld bytes in %.3f s: %.1f MB/s, %.0f files/s (%d readers, %d writers)",
+			added, b.bytes, secs, b.bytes / secs / (1 << 20), added / secs, threads, IMPORT_WRITERS);
 
-	stat_loc *= 4096;
+	pthread_mutex_destroy(&b.q.lock);
+	pthread_cond_destroy(&b.q.not_empty);
+	pthread_cond_destroy(&b.q.not_full);
+	free(tid);
+	free(files);
 
-	if (DEBUG)
-		printf("\nStat Loc: %d, inode loc: %d", stat_loc, inode_loc);
+	return;
+}
 
-	in.f[0] = stat_loc;
-	in.f[1] = -1;
+/**
+ * Fills *files with the regular files of host directory src, or with the paths listed
+ * in file src, one per line. Subdirectories are not descended into; they and any other
+ * entry that is not a regular file are reported and skipped. Returns their number.
+ */
+int batch_list(char *src, struct batch_file **files)
+{
+	int n;
+	int cap;
+	char *base;
+	char line[PATH_MAX];
+	DIR *d;
+	FILE *f;
+	struct dirent *e;
+	struct stat st;
 
-	init_stat(&s, k, inode_loc, type, name);
+	n = 0;
+	cap = 64;
+	*files = (struct batch_file *) malloc(cap * sizeof(struct batch_file));
 
-	fseek(p, inode_loc, SEEK_SET);
-	fwrite(&in, sizeof(struct inode), 1, p);
+	d = opendir(src);
+	f = (d == NULL) ? fopen(src, "r") : NULL;
 
-	fseek(p, stat_loc, SEEK_SET);
-	fwrite(&s, sizeof(struct stat), 1, p);
+	if ((d == NULL) && (f == NULL)) {
+		printf("\nCan not open %s", src);
 
-	if (DEBUG) {
-		printf("\nAbout to insert key.");
+		return 0;
 	}
 
-	insert(p, k.id, k.dir_id, inode_loc, sb);
-
-	if (type == 2) {
-		k.dir_id = k.id;
-		k.id = dir_id;
+	while (1) {
+		if (d != NULL) {
+			e = readdir(d);
 
-		inode_loc = get_inode(p, sb);
-		stat_loc = get_free_block(p, sb);
+			if (e == NULL) {
+				break;
+			}
 
-		if (stat_loc == -1) {
-			err_noblocks();
+			if ((strcmp(e->d_name, ".") == 0) || (strcmp(e->d_name, "..") == 0)) {
+				continue;
+			}
 
-			return -1;
-		}
+			snprintf(line, sizeof(line), "%s/%s", src, e->d_name);
+		} else {
+			if (fgets(line, sizeof(line), f) == NULL) {
+				break;
+			}
 
-		use_block(p, stat_loc);
+			line[strcspn(line, "\r\n")] = '\0';
 
-		stat_loc *= 4096;
+			if (line[0] == '\0') {
+				continue;
+			}
+		}
 
-		if (DEBUG)
-			printf("\nStat Loc: %d, inode loc: %d", stat_loc, inode_loc);
+		if (stat(line, &st) != 0) {
+			printf("\nCan not open %s, skipped", line);
+			continue;
+		}
 
-		in.f[0] = stat_loc;
-		in.f[1] = -1;
+		if (S_ISDIR(st.st_mode)) {
+			printf("\n%s is a directory, skipped", line);
+			continue;
+		}
 
-		init_stat(&s, k, inode_loc, type, "..");
+		if (!S_ISREG(st.st_mode)) {
+			printf("\n%s is not a regular file, skipped", line);
+			continue;
+		}
 
-		fseek(p, inode_loc, SEEK_SET);
-		fwrite(&in, sizeof(struct inode), 1, p);
+		base = strrchr(line, '/');
+		base = (base == NULL) ? line : base + 1;
 
-		fseek(p, stat_loc, SEEK_SET);
-		fwrite(&s, sizeof(struct stat), 1, p);
+		if (strlen(base) > 255) {
+			printf("\nName of %s is too long, skipped", line);
+			continue;
+		}
 
-		if (DEBUG) {
-			printf("\nAbout to insert key.");
+		if (n == cap) {
+			cap *= 2;
+			*files = (struct batch_file *) realloc(*files, cap * sizeof(struct batch_file));
 		}
 
-		insert(p, k.id, k.dir_id, inode_loc, sb);
+		strcpy((*files)[n].path, line);
+		strcpy((*files)[n].name, base);
+		(*files)[n].inode_loc = -1;
+		++n;
 	}
 
-	fseek(p, 0, SEEK_SET);
-	fwrite(sb, sizeof(struct superblock), 1, p);
+	if (d != NULL) {
+		closedir(d);
+	} else {
+		fclose(f);
+	}
 
-	return inode_loc;
+	return n;
 }
 
-void ls(FILE *p, struct superblock *sb, int dir_id)
+/**
+ * Reader of a batch import. Takes files one at a time, reads them IMPORT_CHUNK bytes at a
+ * time and hands each run of non-zero blocks to the writers. Holes of the host file are
+ * skipped and blocks of zeroes are not allocated, as in import(). Once a file is read,
+ * its pointer blocks, stat and inode are written.
+ */
+void *batch_reader(void *arg)
 {
 	int i;
-	int curr;
-	struct node n;
+	int j;
+	int n;
+	int fd;
+	int len;
+	int loc;
+	int blocks;
+	int chunk;
+	int bs;
+	int lb;
+	int *ptr;
+	off_t data;
+	ssize_t got;
+	char *buf;
+	struct batch *b;
+	struct batch_file *bf;
+	struct write_req *req;
 	struct inode in;
-	struct stat s;
+	struct item_stat s;
+	struct stat st;
 
-	curr = sb->root;
+	b = (struct batch *) arg;
+	bs = b->sb->blocksize;
+	chunk = IMPORT_CHUNK / bs;
+	buf = (char *) malloc(IMPORT_CHUNK);
 
-	if (curr == -1) {
-		return;
-	}
- 
-	fseek(p, sb->root, SEEK_SET);
-	fread(&n, sizeof(struct node), 1, p);
-	if (DEBUG) {
-		printf("\n%d is first dir_id of root, n.size = %d", n.key[0].dir_id, n.size);
-	}
+	while ((i = __sync_fetch_and_add(&b->next, 1)) < b->n_files) {
+		bf = &b->files[i];
 
-	while (n.isLeaf == 0) {
-		for (i = 0; i < n.size; ++i) {
-			if (dir_id < n.key[i].dir_id) {
-				curr = n.link[i];
-				break;
-			}
+		if (bf->inode_loc == -1) {
+			continue;
 		}
-		if (i == n.size) {
-			curr = n.link[i];
-		}
-
-		fseek(p, curr, SEEK_SET);
-		fread(&n, sizeof(struct node), 1, p);
-	}
-	if (DEBUG) {
-		printf("\n%d is first dir_id of first leaf", n.key[0].dir_id);
-	}
 
-	while (n.key[0].dir_id == dir_id) {
-		if (n.left == -1) {
-			break;
-		}
-		curr = n.left;
-		fseek(p, curr, SEEK_SET);
-		fread(&n, sizeof(struct node), 1, p);
-	}
+		fd = open(bf->path, O_RDONLY);
 
-	while (1) {
-		if (DEBUG) {
-			printf("\ndir_id: %d, n.size = %d, n.right = %d\n", n.key[0].dir_id, n.size, n.right);
-		}
+		if ((fd == -1) || (fstat(fd, &st) != 0)) {
+			printf("\nCan not read %s", bf->path);
 
-		for (i = 0; i < n.size; ++i) {
-			if (n.key[i].dir_id == dir_id) {
-				fseek(p, n.link[i], SEEK_SET);
-				fread(&in, sizeof(struct inode), 1, p);
-				fseek(p, in.f[0], SEEK_SET);
-				fread(&s, sizeof(struct stat), 1, p);
-				if (s.type == 4) {
-					printf("f ");
-				} else {
-					printf("D ");
-				}
-				printf("%20s    %25s\n", s.name, s.ltime);
+			if (fd != -1) {
+				close(fd);
 			}
+			continue;
 		}
 
-		if (n.right == -1) {
-			break;
+		blocks = (st.st_size + bs - 1) / bs;
+
+		if (blocks > 13 + PTRS(bs) + PTRS(bs) * PTRS(bs)) {
+			printf("\n%s is larger than the maximum file size, only the start is imported", bf->path);
+			blocks = 13 + PTRS(bs) + PTRS(bs) * PTRS(bs);
 		}
 
-		fseek(p, n.right, SEEK_SET);
-		fread(&n, sizeof(struct node), 1, p);
+		ptr = (int *) malloc((blocks + 1) * sizeof(int));
 
-		if (n.key[0].dir_id != dir_id){
-			break;
+		for (j = 0; j < blocks; ++j) {
+			ptr[j] = -1;
 		}
 
-/*		if (n.key[n.size - 1].dir_id == dir_id) {
-			if (n.right == -1) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+		lb = 0;
+
+		while (lb < blocks) {
+			data = lseek(fd, (off_t) lb * bs, SEEK_DATA);
+
+			if (data == -1) {
 				break;
 			}
-			fseek(p, n.right, SEEK_SET);
-			fread(&n, sizeof(struct node), 1, p);
-		} else {
-			break;
-		}
-*/	}
 
-	return;
-}
+			if (data >= (off_t) (lb + 1) * bs) {
+				lb = data / bs;
+				continue;
+			}
 
-void init_stat(struct stat *s, struct Key k, int inode_loc, int type, char *name)
-{
-	char t[25];
+			n = (blocks - lb < chunk) ? blocks - lb : chunk;
+			got = pread(fd, buf, (size_t) n * bs, (off_t) lb * bs);
 
-	get_time(t);
+			if (got < 0) {
+				got = 0;
+			}
 
-	if (DEBUG) {
-		printf("\nGot time.");
-	}
+			memset(buf + got, 0, (size_t) n * bs - got);
 
-	s->k = k;
-	s->inode = inode_loc;
-	s->type = type;
-	s->uid = 1000;
-	s->gid = 100;
-	strcpy(s->name, name);
+			for (j = 0; j < n; ) {
+				if (zero_block(buf + (size_t) j * bs, bs)) {
+					++j;
+					continue;
+				}
 
-	if (DEBUG) {
-		printf("\nCopied name.");
-	}
+				for (len = 1; (j + len < n) && !zero_block(buf + (size_t) (j + len) * bs, bs); ++len)
+					;
 
-	strcpy(s->ctime, t);
-	strcpy(s->ltime, t);
-	strcpy(s->mtime, t);
+				loc = alloc_run(b->p, b->sb, home_group(), len, &len);
 
-	s->perm[0] = 7;
-	s->perm[1] = 5;
-	s->perm[2] = 5;
+				if (loc == -1) {
+					break;
+				}
 
-	if (DEBUG) {
-		printf("\nStats generated successfully.");
+				req = (struct write_req *) malloc(sizeof(struct write_req));
+				req->loc = loc;
+				req->len = len;
+				req->data = (char *) malloc((size_t) len * bs);
+				memcpy(req->data, buf + (size_t) j * bs, (size_t) len * bs);
+				queue_put(&b->q, req);
+
+				for (; len > 0; --len, ++j, ++loc) {
+					ptr[lb + j] = loc;
+				}
+			}
+
+			if (j < n) {
+				break;
+			}
+
+			lb += n;
+		}
+
+		close(fd);
+
+		begin_op();
+		dread(b->p, &in, sizeof(struct inode), INODE_OFF(b->sb, bf->inode_loc));
+		write_block_map(b->p, b->sb, &in, ptr, blocks);
+		dwrite(b->p, &in, sizeof(struct inode), INODE_OFF(b->sb, bf->inode_loc));
+
+		dread(b->p, &s, sizeof(struct item_stat), BLOCK_OFF(b->sb, in.f[0]));
+		s.blocks = blocks;
+		s.lastblock = (blocks > 0) ? ptr[blocks - 1] : -1;
+		s.lastblockbytes = (blocks > 0) ? st.st_size - (off_t) (blocks - 1) * bs : 0;
+
+		if (s.lastblockbytes > bs) {
+			s.lastblockbytes = bs;
+		}
+		dwrite(b->p, &s, sizeof(struct item_stat), BLOCK_OFF(b->sb, in.f[0]));
+		end_op(b->p);
+
+		free(ptr);
+
+		__sync_fetch_and_add(&b->bytes, (long long) st.st_size);
 	}
 
-	return;
+	free(buf);
+
+	return NULL;
 }
 
-void get_time(char *t)
+void *batch_writer(void *arg)
 {
-	time_t currtime;
-	struct tm *loc_time;
+	struct batch *b;
+	struct write_req *req;
 
-	currtime = time(NULL);
-	loc_time = localtime(&currtime);
-	strcpy(t, asctime(loc_time));
-	t[24] = '\0';
+	b = (struct batch *) arg;
 
-	return;
+	while ((req = queue_get(&b->q)) != NULL) {
+		data_write(b->p, req->data, (size_t) req->len * b->sb->blocksize, BLOCK_OFF(b->sb, req->loc));
+		free(req->data);
+		free(req);
+	}
+
+	return NULL;
 }
 
-int get_id(char *name, FILE *p, struct superblock *sb)
+void queue_put(struct write_queue *q, struct write_req *req)
 {
-	int id;
+	pthread_mutex_lock(&q->lock);
 
-	if (strcmp(name, "/") == 0) {
-		return 1;
+	while (q->n == q->max) {
+		pthread_cond_wait(&q->not_full, &q->lock);
 	}
 
-	id = sb->idcounter;
+	req->next = NULL;
+
+	if (q->tail == NULL) {
+		q->head = req;
+	} else {
+		q->tail->next = req;
+	}
 
-	++sb->idcounter;
+	q->tail = req;
+	++q->n;
 
-	update_sb(p, sb);
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
 
-	return id;
+	return;
 }
 
-void debug_showroot(FILE *p, struct superblock *sb)
+/**
+ * Returns the oldest queued request, waiting for one if needed, or NULL once the queue
+ * is empty and done.
+ */
+struct write_req *queue_get(struct write_queue *q)
 {
-	int i;
-	struct node n;
+	struct write_req *req;
 
-	if (!DEBUG) {
-		printf("\n\tNOT compiled as debug.\n");
+	pthread_mutex_lock(&q->lock);
 
-		return;
+	while ((q->n == 0) && (q->done == 0)) {
+		pthread_cond_wait(&q->not_empty, &q->lock);
 	}
 
-	fseek(p, sb->root, SEEK_SET);
-	fread(&n, sizeof(struct node), 1, p);
+	req = q->head;
 
-	printf("\nRoot location: %d. Root node contents: ", sb->root);
+	if (req != NULL) {
+		q->head = req->next;
 
-	for (i = 0; i < n.size; ++i) {
-		printf("\ndir_id = %d, id = %d", n.key[i].dir_id, n.key[i].id);
-		printf(", link: %d", n.link[i]);
+		if (q->head == NULL) {
+			q->tail = NULL;
+		}
+
+		--q->n;
+		pthread_cond_signal(&q->not_full);
 	}
 
-	return;
+	pthread_mutex_unlock(&q->lock);
+
+	return req;
 }
 
-void batch_create_files(FILE *p, struct superblock *sb, int n, int dir_id)
+/**
+ * Writes the n pointers at ptr to a newly allocated pointer block, padded with holes.
+ * Returns the block, or -1 without allocating if all n pointers are holes.
+ */
+int write_ptr_block(FILE *p, struct superblock *sb, int *ptr, int n)
 {
 	int i;
-	int tmp;
-	char fname[256];
+	int loc;
+	int block[PTRS(MAX_BS)];
 
-	for (i = 0; i < n; ++i) {
-		sprintf(fname, "batch_file_%d", i);
-		tmp = new_empty_file_dir(p, sb, fname, dir_id, 4);
-		if (tmp == -2) {
-			++n;
-		}
+	for (i = 0; (i < n) && (ptr[i] == -1); ++i)
+		;
+
+	if (i == n) {
+		return -1;
 	}
 
-	return;
+	loc = alloc_block(p, sb, home_group());
+
+	if (loc == -1) {
+		return -1;
+	}
+
+	for (i = 0; i < PTRS(sb->blocksize); ++i) {
+		block[i] = (i < n) ? ptr[i] : -1;
+	}
+
+	dwrite(p, block, sb->blocksize, BLOCK_OFF(sb, loc));
+
+	return loc;
 }
 
-void inorder(FILE *p, int root)
+/**
+ * Stores the block numbers of logical blocks 0 to blocks - 1 of a file, given in ptr, in
+ * inode in: direct pointers first, then single and double indirect blocks, which are only
+ * allocated where they point to at least one block.
+ */
+void write_block_map(FILE *p, struct superblock *sb, struct inode *in, int *ptr, int blocks)
 {
 	int i;
-	struct node n;
-
-	if (!DEBUG) {
-		printf("\nNOT in debug mode!");
+	int n;
+	int count;
+	int d_indirect[PTRS(MAX_BS)];
 
-		return;
+	for (i = 1; i < 16; ++i) {
+		in->f[i] = -1;
 	}
 
-	if (root == -1) {
-		return;
+	for (count = 0; (count < 13) && (count < blocks); ++count) {
+		in->f[count + 1] = ptr[count];
 	}
 
-	fseek(p, root, SEEK_SET);
-	fread(&n, sizeof(struct node), 1, p);
+	if (count < blocks) {
+		n = (blocks - count < PTRS(sb->blocksize)) ? blocks - count : PTRS(sb->blocksize);
+		in->f[14] = write_ptr_block(p, sb, ptr + count, n);
+		count += n;
+	}
 
-	if (n.isLeaf == 1) {
-		for (i = 0; i < n.size; ++i) {
-			printf("%d ", n.key[i].id);
-		}
-	} else {
-		for (i = 0; i < n.size; ++i) {
-			inorder(p, n.link[i]);
+	if (count < blocks) {
+		for (i = 0; count < blocks; ++i) {
+			n = (blocks - count < PTRS(sb->blocksize)) ? blocks - count : PTRS(sb->blocksize);
+			d_indirect[i] = write_ptr_block(p, sb, ptr + count, n);
+			count += n;
 		}
-		inorder(p, n.link[i]);
+
+		in->f[15] = write_ptr_block(p, sb, d_indirect, i);
 	}
 
 	return;
 }
 
-int find(FILE *p, struct superblock *sb, int dir_id, char name[], int type, int id_or_loc)
+/**
+ * Orders names, and directory entries by name.
+ */
+int cmp_name(const void *a, const void *b)
 {
-	int i;
-	int curr;
-	struct node n;
-	struct inode in;
-	struct stat s;
+	return strcmp((const char *) a, (const char *) b);
+}
 
-	curr = sb->root;
+int cmp_batch_file(const void *a, const void *b)
+{
+	return strcmp(((const struct batch_file *) a)->name, ((const struct batch_file *) b)->name);
+}
 
-	if (curr == -1) {
+/**
+ * Writes len bytes of buf at offset into the file whose inode is at inode_loc. Holes and
+ * blocks past the end are allocated as they are written to, and the file grows if the
+ * write ends past its end. A file shared with a snapshot gets an inode of its own first,
+ * and the blocks it writes to are copied. Returns the number of bytes written, -1 for a
+ * negative offset.
+ */
+int write_file(FILE *p, struct superblock *sb, int inode_loc, off_t offset, char *buf, int len)
+{
+	int n;
+	int lb;
+	int loc;
+	int live;
+	int done;
+	int boff;
+	int last;
+	int last_lb;
+	off_t slot;
+	off_t size;
+	off_t end;
+	char block[MAX_BS];
+	struct inode in;
+	struct item_stat s;
+	struct open_file *of;
+	pthread_mutex_t *fl;
+
+	if (offset < 0) {
 		return -1;
 	}
 
-	fseek(p, sb->root, SEEK_SET);
-	fread(&n, sizeof(struct node), 1, p);
-	if (DEBUG) {
-		printf("\n%d is first dir_id of root, n.size = %d", n.key[0].dir_id, n.size);
-	}
+	while (1) {
+		fl = &file_lock[inode_loc % FILE_LOCKS];
+		pthread_mutex_lock(fl);
+		begin_op();
 
-	while (n.isLeaf == 0) {
-		for (i = 0; i < n.size; ++i) {
-			if (dir_id < n.key[i].dir_id) {
-				if (DEBUG) {
-					printf("\n\tTaking a left before dir_id: %d, and key #%d", n.key[i].dir_id, i);
-				}
-				curr = n.link[i];
-				break;
-			}
+		live = cow_item(p, sb, inode_loc);
+
+		if (live == inode_loc) {
+			break;
 		}
-		if (i == n.size) {
-			if (DEBUG) {
-				printf("\n\tTaking a right after dir_id: %d, and key #%d", n.key[i-1].dir_id, i);
-			}
-			curr = n.link[i];
+
+		end_op(p);
+		pthread_mutex_unlock(fl);
+
+		if (live == -1) {
+			return 0;
 		}
 
-		fseek(p, curr, SEEK_SET);
-		fread(&n, sizeof(struct node), 1, p);
-	}
-	if (DEBUG) {
-		printf("\n%d is first dir_id of first leaf found", n.key[0].dir_id);
+		inode_loc = live;
 	}
 
-	while (n.key[0].dir_id == dir_id) {
-		if (n.left == -1) {
-			break;
-		}
-		if (DEBUG) {
-			printf("\n\tGoing left from this node because left node also has same dir_id");
-		}
-		curr = n.left;
-		fseek(p, curr, SEEK_SET);
-		fread(&n, sizeof(struct node), 1, p);
+	dread(p, &in, sizeof(struct inode), INODE_OFF(sb, inode_loc));
+	dread(p, &s, sizeof(struct item_stat), BLOCK_OFF(sb, in.f[0]));
+
+	size = (s.blocks == 0) ? 0 : (off_t) (s.blocks - 1) * sb->blocksize + s.lastblockbytes;
+
+	/* compressed clusters are written as plain blocks, and so is the last one before the file grows */
+	if ((len > 0) && (!unpack_clusters(p, sb, inode_loc, &in, &s, offset / sb->blocksize, (offset + len - 1) / sb->blocksize) ||
+			((offset + len > size) && (s.blocks > 0) &&
+			!unpack_clusters(p, sb, inode_loc, &in, &s, s.blocks - 1, s.blocks - 1)))) {
+		len = 0;
 	}
 
-	while (1) {
-		if (DEBUG) {
-			printf("\ndir_id: %d, n.size = %d, n.right = %d\n", n.key[0].dir_id, n.size, n.right);
+	of = open_file(p, sb, inode_loc);
+	done = 0;
+	last = -1;
+	last_lb = -1;
+
+	while (done < len) {
+		lb = (offset + done) / sb->blocksize;
+		boff = (offset + done) % sb->blocksize;
+		n = sb->blocksize - boff;
+
+		if (n > len - done) {
+			n = len - done;
 		}
-		for (i = 0; i < n.size; ++i) {
-			if (n.key[i].dir_id == dir_id) {
-				fseek(p, n.link[i], SEEK_SET);
-				fread(&in, sizeof(struct inode), 1, p);
-				fseek(p, in.f[0], SEEK_SET);
-				fread(&s, sizeof(struct stat), 1, p);
-				if (strcmp(s.name, name) == 0 && s.type == type) {
-					if (s.type == type) {
-						if (DEBUG) {
-							printf("\nFound key at key index: %d", i);
-						}
-						if (id_or_loc == 0) {
-							return s.k.id;
-						} else {
-							return n.link[i];
-						}
-					} else {
-						printf("\n%s is not a ", name);
 
-						if (type == 2) {
-							printf("directory!");
-						} else if (type == 4) {
-							printf("file!");
-						} else {
-							printf("item!");
-						}
+		loc = (lb < of->blocks) ? map_block(of, lb) : -1;
 
-						return -1;
-					}
-				}
+		if ((loc != -1) && (sb->shared != 0)) {
+			slot = block_slot(p, sb, inode_loc, &in, lb);
+			loc = (slot == -1) ? -1 : cow_data(p, sb, slot);
+
+			if (loc == -1) {
+				break;
 			}
 		}
 
-		if (n.right == -1) {
-			break;
-		}
+		if (loc == -1) {
+			slot = block_slot(p, sb, inode_loc, &in, lb);
 
-		if (n.key[n.size - 1].dir_id == dir_id) {
-			if (n.right == -1) {
+			if (slot == -1) {
 				break;
 			}
-			if (DEBUG) {
-				printf("\n\tGoing right from this node because it also has the same dir_id");
+
+			loc = alloc_block(p, sb, home_group());
+
+			if (loc == -1) {
+				break;
 			}
-			fseek(p, n.right, SEEK_SET);
-			fread(&n, sizeof(struct node), 1, p);
+
+			memset(block, 0, sb->blocksize);
+			memcpy(block + boff, buf + done, n);
+			data_write(p, block, sb->blocksize, BLOCK_OFF(sb, loc));
+			dwrite(p, &loc, sizeof(int), slot);
 		} else {
-			break;
+			data_write(p, buf + done, n, BLOCK_OFF(sb, loc) + boff);
 		}
+
+		last_lb = lb;
+		last = loc;
+		done += n;
 	}
 
-	return -1;
+	close_file(of);
+
+	end = offset + done;
+
+	if ((done > 0) && (end > size)) {
+		s.blocks = (end + sb->blocksize - 1) / sb->blocksize;
+		s.lastblockbytes = end - (off_t) (s.blocks - 1) * sb->blocksize;
+		s.lastblock = last;
+	} else if ((done > 0) && (last_lb == s.blocks - 1)) {
+		s.lastblock = last;
+	}
+
+	get_time(s.mtime);
+	dwrite(p, &s, sizeof(struct item_stat), BLOCK_OFF(sb, in.f[0]));
+
+	invalidate_map(inode_loc);
+
+	end_op(p);
+	pthread_mutex_unlock(fl);
+
+	return done;
 }
 
-void import(FILE *p, struct superblock *sb, char path[], int dir_id, char name[])
+/**
+ * Server mode: serves requests of struct request on Unix socket sock with workers worker
+ * threads, all sharing the image p mounted once and its superblock sb. Accepted
+ * connections are watched with epoll, one shot at a time: the worker that takes a
+ * connection with a request waiting serves that one request and hands the connection
+ * back, so any number of clients share the workers request by request.
+ */
+void serve(FILE *p, struct superblock *sb, char *sock, int workers)
 {
-	FILE *f;
 	int i;
-	int j;
-	int size;
-	int inode_loc;
-	int freeblock;
-	int lastblock;
-	int lastblockbytes;
-	int blocks_req;
-	int count;
-	struct inode in;
-	struct stat s;
-	char block[4096];
-	int d_indirect[1024];
-	int indirect[1024];
+	int fd;
+	int c;
+	struct sockaddr_un addr;
+	struct server srv;
+	struct epoll_event ev;
+	pthread_t *tid;
+
+	if (workers < 1) {
+		workers = 1;
+	}
 
-	memset(block, 0, 4096);
-	count = 0;
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock);
+	unlink(sock);
+
+	if ((fd == -1) || (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) || (listen(fd, SERVER_BACKLOG) != 0)) {
+		printf("\nCan not listen on %s", sock);
 
-	if (access(path, F_OK) != 1) {
-		f = fopen(path, "rb");
-	} else {
 		return;
 	}
 
-	fseek(f, 0, SEEK_END);
-	size = ftell(f);
-	blocks_req = size / 4096;
-	if (size % 4096 != 0) {
-		++blocks_req;
-		lastblockbytes = size % 4096;
-	} else {
-		lastblockbytes = 4096;
-	}
-	inode_loc = new_empty_file_dir(p, sb, name, dir_id, 4);
+	signal(SIGPIPE, SIG_IGN);
 
-	printf("\nBlock size for reading file: %lu", sizeof(block));
+	srv.p = p;
+	srv.sb = sb;
+	srv.epfd = epoll_create1(0);
 
-	fseek(p, inode_loc, SEEK_SET);
-	fread(&in, sizeof(struct inode), 1, p);
+	if (srv.epfd == -1) {
+		printf("\nCan not create an epoll instance");
+		close(fd);
 
-	for (i = 1; i < 16; ++i) {
-		in.f[i] = -1;
+		return;
 	}
 
-	fseek(f, 0, SEEK_SET);
-	for (i = 1, count = 0; (i < 14) && (count < blocks_req); ++i) {
-		printf("\n\n\tDirect block #%d", i);
-		freeblock = get_free_block(p, sb);
-		use_block(p, freeblock);
-		freeblock *= 4096;
+	tid = (pthread_t *) malloc(workers * sizeof(pthread_t));
 
-		in.f[i] = freeblock;
-		in.f[i + 1] = -1;
-		++count;
-		lastblock = freeblock;
-		fread(block, 4096, 1, f);
-		fseek(p, freeblock, SEEK_SET);
-		fwrite(block, 4096, 1, p);
+	for (i = 0; i < workers; ++i) {
+		pthread_create(&tid[i], NULL, server_worker, &srv);
 	}
 
-	if (count < blocks_req) {
-		for (i = 0; i < 1024; ++i) {
-			indirect[i] = -1;
-		}
+	printf("\nServing %s with %d workers\n", sock, workers);
+	fflush(stdout);
 
-		for (i = 0; (i < 1024) && (count < blocks_req); ++i) {
-			freeblock = get_free_block(p, sb);
-			use_block(p, freeblock);
-			freeblock *= 4096;
-			indirect[i] = freeblock;
-			++count;
+	while (1) {
+		c = accept(fd, NULL, NULL);
 
-			fseek(p, freeblock, SEEK_SET);
-			lastblock = freeblock;
-			fread(block, 4096, 1, f);
-			fwrite(block, 4096, 1, p);
+		if (c == -1) {
+			continue;
 		}
 
-		freeblock = get_free_block(p, sb);
-		use_block(p, freeblock);
-		freeblock *= 4096;
-		in.f[14] = freeblock;
-
-		fseek(p, freeblock, SEEK_SET);
-		fwrite(indirect, 4096, 1, p);
-	}
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.fd = c;
 
-	if (count < blocks_req) {
-		for (i = 0; i < 1024; ++i) {
-			d_indirect[i] = -1;
+		if (epoll_ctl(srv.epfd, EPOLL_CTL_ADD, c, &ev) != 0) {
+			close(c);
 		}
+	}
 
-		for (i = 0; (i < 1024) && (count < blocks_req); ++i) {
-			for (j = 0; j < 1024; ++j) {
-				indirect[j] = -1;
-			}
+	return;
+}
 
-			for(j = 0; (j < 1024) && (count < blocks_req); ++j) {
-				freeblock = get_free_block(p, sb);
-				use_block(p, freeblock);
-				freeblock *= 4096;
-				indirect[j] = freeblock;
-				++count;
+/**
+ * Worker of serve(): takes a connection epoll reports readable, serves its next request
+ * and re-arms it. A connection the client closed, or that sent a malformed request, is
+ * closed, and the journal is committed.
+ */
+void *server_worker(void *arg)
+{
+	int fd;
+	bool ok;
+	char *data;
+	struct server *srv;
+	struct request req;
+	struct epoll_event ev;
 
-				fseek(p, freeblock, SEEK_SET);
-				lastblock = freeblock;
-				fread(block, 4096, 1, f);
-				fwrite(block, 4096, 1, p);
-			}
-			freeblock = get_free_block(p, sb);
-			use_block(p, freeblock);
-			freeblock *= 4096;
-			d_indirect[i] = freeblock;
+	srv = (struct server *) arg;
+	data = (char *) malloc(MAX_IO);
 
-			fseek(p, freeblock, SEEK_SET);
-			fwrite(indirect, 4096, 1, p);
+	while (1) {
+		if (epoll_wait(srv->epfd, &ev, 1, -1) != 1) {
+			continue;
 		}
-		freeblock = get_free_block(p, sb);
-		use_block(p, freeblock);
-		freeblock *= 4096;
-		in.f[15] = freeblock;
 
-		fseek(p, freeblock, SEEK_SET);
-		fwrite(d_indirect, 4096, 1, p);
-	}
+		fd = ev.data.fd;
+		ok = read_full(fd, &req, sizeof(req)) && (req.len >= 0) && (req.len <= MAX_IO) &&
+				((req.op != OP_WRITE) || read_full(fd, data, req.len));
 
-	fclose(f);
-	
-	fseek(p, in.f[0], SEEK_SET);
-	fread(&s, 4096, 1, p);
-	s.lastblock = lastblock;
-	s.lastblockbytes = lastblockbytes;
-	s.blocks = blocks_req;
-	fseek(p, in.f[0], SEEK_SET);
-	fwrite(&s, 4096, 1, p);
+		if (ok) {
+			req.name[255] = '\0';
+			req.path[PATH_MAX - 1] = '\0';
 
-	fseek(p, inode_loc, SEEK_SET);
-	fwrite(&in, sizeof(struct inode), 1, p);
+			handle(srv, fd, &req, data);
 
-	if (DEBUG) {
-		printf("\nLast block: %d, last block bytes: %d, blocks: %d", lastblock, s.lastblockbytes, s.blocks);
-	}
+			ev.events = EPOLLIN | EPOLLONESHOT;
+			ev.data.fd = fd;
+			ok = (epoll_ctl(srv->epfd, EPOLL_CTL_MOD, fd, &ev) == 0);
+		}
 
-	printf("\nWrote one file successfully. File size = %d Bytes", size);
+		if (!ok) {
+			epoll_ctl(srv->epfd, EPOLL_CTL_DEL, fd, NULL);
+			close(fd);
+			journal_commit(srv->p, true);
+		}
+	}
 
-	return;
+	return NULL;
 }
 
-void extract(FILE *p, struct superblock *sb, int dir_id, char *name, char *fname)
+/**
+ * Runs one request and sends its reply on fd. data holds the data of OP_WRITE and is
+ * used for the reply data of OP_READ.
+ */
+void handle(struct server *srv, int fd, struct request *req, char *data)
 {
-	FILE *f;
 	int i;
-	int j;
+	int n;
 	int inode_loc;
-	int lb;
-	int lbb;
-	int count;
-	int blocks;
-	char block[4096];
-	struct inode in;
-	struct stat s;
+	off_t size;
+	FILE *p;
+	struct superblock *sb;
+	struct dir_entry *ents;
+	struct ls_entry *ls;
+	struct reply rep;
+	struct stat st;
+
+	p = srv->p;
+	sb = srv->sb;
+	rep.status = -1;
+	rep.len = 0;
+
+	switch (req->op) {
+		case OP_CREATE:
+		case OP_MKDIR:
+			if (new_empty_file_dir(p, sb, req->name, req->dir_id, (req->op == OP_MKDIR) ? 2 : 4) >= 0) {
+				rep.status = find(p, sb, req->dir_id, req->name, (req->op == OP_MKDIR) ? 2 : 4, 0);
+			}
+			break;
+		case OP_FIND:
+			rep.status = find(p, sb, req->dir_id, req->name, req->type, 0);
+			break;
+		case OP_LS:
+			n = scan_dir(p, sb, req->dir_id, 0, &ents);
+			ls = (struct ls_entry *) calloc(n + 1, sizeof(struct ls_entry));
+
+			for (i = 0; i < n; ++i) {
+				ls[i].type = ents[i].type;
+				ls[i].id = ents[i].id;
+				strcpy(ls[i].name, ents[i].name);
+			}
 
-	if (DEBUG) {
-		printf("\nBefore declaration of variables");
-	}
+			rep.status = n;
+			rep.len = n * sizeof(struct ls_entry);
 
-	if (DEBUG) {
-		printf("\nBefore declaring stat structure variable");
-	}
+			if (write_full(fd, &rep, sizeof(rep))) {
+				write_full(fd, ls, rep.len);
+			}
 
-	if (DEBUG) {
-		printf("\nDeclared all variables for extraction");
-	}
+			free(ls);
+			free(ents);
 
-	inode_loc = find(p, sb, dir_id, name, 4, 1);
+			return;
+		case OP_READ:
+			if ((req->offset < 0) || (req->offset + req->len > MAX_FILE_SIZE(sb->blocksize))) {
+				break;
+			}
 
-	if (inode_loc == -1) {
-		return;
-	}
-/*
-	if (access(fname, F_OK) != 1) {
-		printf("\nFile with name %s already exists in local folder. Please choose another name.", fname);
+			inode_loc = find(p, sb, req->dir_id, req->name, 4, 1);
 
-		return;
-	}
-*/
-	fseek(p, inode_loc, SEEK_SET);
-	fread(&in, sizeof(struct inode), 1, p);
+			if (inode_loc != -1) {
+				rep.status = read_file(p, sb, inode_loc, req->offset, data, req->len);
+				rep.len = (rep.status > 0) ? rep.status : 0;
+			}
+			break;
+		case OP_WRITE:
+			if ((req->offset < 0) || (req->offset + req->len > MAX_FILE_SIZE(sb->blocksize))) {
+				break;
+			}
 
-	fseek(p, in.f[0], SEEK_SET);
-	fread(&s, sizeof(struct stat), 1, p);
-	lb = s.lastblock;
-	lbb = s.lastblockbytes;
-	count = 0;
-	blocks = s.blocks;
+			inode_loc = find(p, sb, req->dir_id, req->name, 4, 1);
 
-	f = fopen(fname, "wb");
-	fseek(f, 0, SEEK_SET);
-	i = 1;
-
-	for (i = 1; (i < 14) && (in.f[i] != -1) && (count < blocks); ++i) {
-		printf("\nReading direct block #%d", i);
-		fseek(p, in.f[i], SEEK_SET);
-		if (in.f[i] == lb) {
-			fread(block, 4096, 1, p);
-			fwrite(block, lbb, 1, f);
-			++count;
-			fclose(f);
+			if (inode_loc != -1) {
+				rep.status = write_file(p, sb, inode_loc, req->offset, data, req->len);
+			}
+			break;
+		case OP_IMPORT:
+			if ((stat(req->path, &st) == 0) && (find(p, sb, req->dir_id, req->name, 4, 1) == -1)
+					&& (import(p, sb, req->path, req->dir_id, req->name, 0) == 0)) {
+				rep.status = (st.st_size > INT_MAX) ? INT_MAX : st.st_size;
+			}
+			break;
+		case OP_EXPORT:
+			inode_loc = find(p, sb, req->dir_id, req->name, 4, 1);
 
-			return;
-		} else {
-			fread(block, 4096, 1, p);
-			fwrite(block, 4096, 1, f);
-			++count;
-		}
+			if (inode_loc != -1) {
+				size = export_file(p, sb, inode_loc, req->path);
+				rep.status = (size > INT_MAX) ? INT_MAX : size;
+			}
+			break;
+		default:
+			break;
+	};
+
+	if (write_full(fd, &rep, sizeof(rep)) && (rep.len > 0)) {
+		write_full(fd, data, rep.len);
 	}
 
-	if ((in.f[14] != -1) && (count < blocks)) {
-		int indirect[1024];
+	return;
+}
 
-		fseek(p, in.f[14], SEEK_SET);
-		fread(indirect, 4096, 1, p);
+bool read_full(int fd, void *buf, size_t len)
+{
+	ssize_t n;
 
-		for (i = 0; (i < 1024) && (indirect[i] != -1) && (count < blocks); ++i) {
-			if (DEBUG) {
-				printf("\n  Reading indirect block #%d", i);
-			}
-			fseek(p, indirect[i], SEEK_SET);
-			if (indirect[i] == lb) {
-				fread(block, 4096, 1, p);
-				fwrite(block, lbb, 1, f);
-				++count;
-				fclose(f);
+	while (len > 0) {
+		n = read(fd, buf, len);
 
-				return;
-			} else {
-				fread(block, 4096, 1, p);
-				fwrite(block, 4096, 1, f);
-				++count;
-			}
+		if (n <= 0) {
+			return false;
 		}
+
+		buf = (char *) buf + n;
+		len -= n;
 	}
 
-	if ((in.f[15] != -1) && (count < blocks)) {
-		int d_indirect[1024];
+	return true;
+}
 
-		fseek(p, in.f[15], SEEK_SET);
-		fread(d_indirect, 4096, 1, p);
+bool write_full(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
 
-		for (i = 0; (i < 1024) && (d_indirect[i] != -1) && (count < blocks); ++i) {
-			int indirect[1024];
-			if (DEBUG) {
-				printf("\n    Reading double indirect #%d", i);
-			}
-			fseek(p, d_indirect[i], SEEK_SET);
-			fread(indirect, 4096, 1, p);
+	while (len > 0) {
+		n = write(fd, buf, len);
 
-			for (j = 0; (j < 1024) && (indirect[j] != -1) && (count < blocks); ++j) {
-				if (DEBUG) {
-					printf("\n      Reading indirect block #%d", j);
-				}
-				fseek(p, indirect[j], SEEK_SET);
-				if (indirect[j] == lb) {
-					fread(block, 4096, 1, p);
-					fwrite(block, lbb, 1, f);
-					++count;
-					fclose(f);
-
-					return;
-				} else {
-					fread(block, 4096, 1, p);
-					fwrite(block, 4096, 1, f);
-					++count;
-				}
-			}
+		if (n <= 0) {
+			return false;
 		}
+
+		buf = (const char *) buf + n;
+		len -= n;
 	}
-	fclose(f);
 
-	return;
+	return true;
 }
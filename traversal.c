@@ -8,6 +8,17 @@
 #define MAGIC "FaSTdEvL"
 #define DEBUG 1
 #define BS 4096
+#define MAX_BS 65536
+#define NODE_KEYS(bs) (((bs) - 24) / 12)
+#define NODE_LINKS_AT(bs) (12 + NODE_KEYS(bs) * 8)
+#define SNAP_MAX 32
+#define SNAP_NAME 24
+
+struct snapshot {
+	char name[SNAP_NAME];
+	char ctime[28];
+	int root;
+};
 
 /**
  * Stored in block 0 and its backup in block 1
@@ -21,6 +32,17 @@
  * root: Root of the B+ Tree, initially -1
  * freeblocksmap: number of blocks for freeblocks map
  * idcounter: maintains a count of id# last assigned. Useful for item id generation
+ * version: on-disk format revision. Since revision 1, root and node links are block numbers
+ * journal, journal_blocks: metadata journal region. This tool reads the image as it is, so
+ * 	after a crash mount it with fs1 once to replay the journal first.
+ * refmap, refmap_blocks, shared: reference counts of blocks shared with snapshots
+ * snaps, snap: snapshots, saved roots of the B+ tree; only the live tree is printed
+ * dedup, dedup_blocks: index of data blocks by hash, for import -d
+ * csum, csum_blocks: CRC32C of every data block, for export and scrub
+ * cipher, kdf_iter, kdf_salt, key_check: encryption of the image. The tree of an encrypted
+ * 	image can only be read by fs1, with its passphrase.
+ * stripes, stripe_unit: files the image is striped over; only images of one file are read
+ * shards, shard: B+ trees the namespace is split into; only the tree of shard 0 is printed
  * padding: Padding bytes
  */
 struct superblock {
@@ -33,7 +55,30 @@ struct superblock {
 	int root;
 	int freeblocksmap;
 	int idcounter;
-	char padding[4052];
+	int version;
+	int agcount;
+	int agblocks;
+	int aginodes;
+	int journal;
+	int journal_blocks;
+	int refmap;
+	int refmap_blocks;
+	int shared;
+	int snaps;
+	struct snapshot snap[SNAP_MAX];
+	int dedup;
+	int dedup_blocks;
+	int csum;
+	int csum_blocks;
+	int cipher;
+	int kdf_iter;
+	unsigned char kdf_salt[16];
+	unsigned char key_check[16];
+	int stripes;
+	int stripe_unit;
+	int shards;
+	int shard;
+	char padding[2148];
 };
 
 /**
@@ -52,28 +97,31 @@ struct Key {
  *  parent: location of parent of the node. -1, for root node
  * 	isLeaf: 1 if node is leaf, else 0
  * 	size: number of keys currently in the node
- *  key[339]: stores keys in the node
- *  link[340]: stores links to children of the node, but in case of leaf node, stores inode location
+ *  key[n - 1]: stores keys in the node
+ *  link[n]: stores links to children of the node, but in case of leaf node, stores inode location
  * 	left: logical left node of leaf node
  * 	right: logical right node of leaf node
  *  padding: padding bytes to match size of structure with blocksize
  * if non-leaf node, left and right should be set to -1
- * (5 * 4 + 4 * n + 8 * (n - 1)) = 4096, because we want the size to match the block size.
- * => n = 340.67 = 340
+ * (5 * 4 + 4 * n + 8 * (n - 1)) = blocksize, because we want the size to match the block size.
+ * => n = NODE_KEYS(blocksize) + 1
+ * Links start right after the NODE_KEYS(blocksize) keys, so blocks smaller than MAX_BS
+ * are converted in read_node().
  */
 struct node {
 	int parent;
 	int isLeaf;
 	int size;
-	struct Key key[339];
-	int link[340];
+	struct Key key[NODE_KEYS(MAX_BS)];
+	int link[NODE_KEYS(MAX_BS) + 1];
 	int left;
 	int right;
 	char padding[4];
 };
 
 int comp_str(char *, char *, int);
-void preorder(int, FILE *);
+void read_node(FILE *, int, int, struct node *);
+void preorder(int, FILE *, int);
 
 int main()
 {
@@ -101,13 +149,25 @@ int main()
 		exit(2);
 	}
 
+	if (sb.cipher != 0) {
+		printf("\n\tThe image is encrypted. Exiting.");
+
+		exit(2);
+	}
+
+	if (sb.stripes > 1) {
+		printf("\n\tThe image is striped over %d files. Exiting.", sb.stripes);
+
+		exit(2);
+	}
+
 	if (sb.root == -1) {
 		printf("\nEmpty filesystem. No B+ tree found.");
 
 		return 0;
 	}
 
-	preorder(sb.root, p);
+	preorder(sb.root, p, sb.blocksize);
 
 	return 0;
 }
@@ -125,13 +185,29 @@ int comp_str(char a[], char b[], int len)
 	return 0;
 }
 
-void preorder(int root, FILE *p)
+void read_node(FILE *p, int bs, int loc, struct node *n)
+{
+	char *buf;
+
+	buf = (char *) malloc(bs);
+
+	fseeko(p, (off_t) loc * bs, SEEK_SET);
+	fread(buf, bs, 1, p);
+	memcpy(n, buf, 12 + NODE_KEYS(bs) * sizeof(struct Key));
+	memcpy(n->link, buf + NODE_LINKS_AT(bs), (NODE_KEYS(bs) + 1) * sizeof(int));
+	memcpy(&n->left, buf + NODE_LINKS_AT(bs) + (NODE_KEYS(bs) + 1) * sizeof(int), 2 * sizeof(int));
+
+	free(buf);
+
+	return;
+}
+
+void preorder(int root, FILE *p, int bs)
 {
 	int i;
 	struct node n;
 
-	fseek(p, root, SEEK_SET);
-	fread(&n, 4096, 1, p);
+	read_node(p, bs, root, &n);
 
 	printf("n.size=%d ", n.size);
 	printf(" (");
@@ -151,7 +227,7 @@ void preorder(int root, FILE *p)
 
 	for (i = 0; i <= n.size; ++i) {
 		printf(" child %d: ", i);
-		preorder(n.link[i], p);
+		preorder(n.link[i], p, bs);
 	}
 
 	return;